@@ -0,0 +1,196 @@
+#!/usr/bin/lua
+-- Benchmarks BSON <-> Lua conversions, and the cost of mongo.stats()
+--
+-- Run from the repository root:
+--    lua bench/codec.lua
+--
+-- Cases marked as "server" need a running mongod and are skipped when the
+-- connection fails. Configuration can be set with the following environment
+-- variables:
+--    TEST_SERVER   ('localhost')
+--    TEST_DB       ('test')
+--    BENCH_DOCS    (100000) number of documents used by server cases
+--    BENCH_ITERS   (20000)  number of iterations used by offline cases
+--
+-- Under LuaJIT with bench/malloc_count.so preloaded (see malloc_count.c)
+-- the number of malloc/realloc calls per operation is reported as well.
+
+local mongo = require 'mongo'
+local os = require 'os'
+
+local test_server = os.getenv('TEST_SERVER') or 'localhost'
+local test_db = os.getenv('TEST_DB') or 'test'
+local test_ns = test_db .. '.bench_codec'
+local num_docs = tonumber(os.getenv('BENCH_DOCS') or 100000)
+local num_iters = tonumber(os.getenv('BENCH_ITERS') or 20000)
+
+local malloc_count = function() return 0 end
+if jit then
+    local ffi = require 'ffi'
+    ffi.cdef 'unsigned long malloc_count(void);'
+    if pcall(function() return ffi.C.malloc_count end) then
+        malloc_count = function() return tonumber(ffi.C.malloc_count()) end
+    end
+end
+
+local function bench(name, n, func)
+    collectgarbage('collect')
+    local mem0 = collectgarbage('count')
+    local allocs0 = malloc_count()
+    local t0 = mongo.time()
+    func(n)
+    local elapsed = mongo.time() - t0
+    local allocs = malloc_count() - allocs0
+    local mem = collectgarbage('count') - mem0
+    print(string.format('%-40s %10d ops %10.3f s %12.0f ops/s %10.0f KB %8.1f allocs/op',
+                        name, n, elapsed, n / elapsed, mem, allocs / n))
+end
+
+-- document shapes
+local oid_date_json = [[{
+  "_id" : { "$oid" : "507f1f77bcf86cd799439011" },
+  "owner" : { "$oid" : "507f191e810c19729de860ea" },
+  "created" : { "$date" : 1400000000000 },
+  "updated" : { "$date" : 1400000001000 },
+  "expires" : { "$date" : 1400000002000 },
+  "name" : "bench",
+  "count" : 42
+}]]
+
+local function oid_date_doc()
+    return {
+        _id = mongo.ObjectId(),
+        owner = mongo.ObjectId(),
+        created = mongo.Date(1400000000000),
+        updated = mongo.Date(1400000001000),
+        expires = mongo.Date(1400000002000),
+        name = 'bench',
+        count = 42,
+    }
+end
+
+-- offline cases
+bench('decode oid/date doc (fromjson)', num_iters, function(n)
+    for i=1,n do mongo.fromjson(oid_date_json) end
+end)
+
+bench('encode oid/date doc (JSON string)', num_iters, function(n)
+    for i=1,n do mongo.BSON.New(oid_date_json) end
+end)
+
+bench('construct bsontypes', num_iters, function(n)
+    for i=1,n do oid_date_doc() end
+end)
+
+bench('encode oid/date doc', num_iters, function(n)
+    local doc = oid_date_doc()
+    for i=1,n do mongo.BSON.New(doc) end
+end)
+
+local array = {}
+for i=1,10000 do array[i] = i end
+bench('encode 10k-element array', math.ceil(num_iters / 100), function(n)
+    local doc = { values = array }
+    for i=1,n do mongo.BSON.New(doc) end
+end)
+
+bench('encode 10k-element mongo.Array', math.ceil(num_iters / 100), function(n)
+    local doc = { values = mongo.Array(array) }
+    for i=1,n do mongo.BSON.New(doc) end
+end)
+
+local nested = { leaf = oid_date_doc() }
+for i=1,50 do nested = { level = i, child = nested, siblings = { i, i + 1 } } end
+bench('encode 50-level nested doc', num_iters, function(n)
+    for i=1,n do mongo.BSON.New(nested) end
+end)
+
+bench('tojson oid/date doc', num_iters, function(n)
+    local doc = oid_date_doc()
+    for i=1,n do mongo.tojson(doc) end
+end)
+
+bench('tojson 50-level nested doc pretty', num_iters, function(n)
+    local options = { pretty = true }
+    for i=1,n do mongo.tojson(nested, options) end
+end)
+
+-- both decoders on the same documents, see mongo.decoder()
+local strings = {}
+for i=1,100 do strings['field' .. i] = string.rep('x', i) end
+
+local shapes = {
+    { 'oid/date doc', mongo.BSON.New(oid_date_doc()), num_iters },
+    { '100 strings doc', mongo.BSON.New(strings), num_iters },
+    { '10k-element array', mongo.BSON.New({ values = array }), math.ceil(num_iters / 100) },
+    { '50-level nested doc', mongo.BSON.New(nested), num_iters },
+}
+for _,decoder in ipairs{ 'iterator', 'raw' } do
+    mongo.decoder(decoder)
+    for _,shape in ipairs(shapes) do
+        local doc = shape[2]
+        bench('decode ' .. shape[1] .. ' (' .. decoder .. ')', shape[3], function(n)
+            for i=1,n do doc:totable() end
+        end)
+    end
+end
+mongo.decoder('raw')
+
+-- methods answered without a round trip are not timed by mongo.stats()
+local offline_db = mongo.Connection.New()
+for _,enabled in ipairs{ false, true } do
+    mongo.stats_enable(enabled)
+    bench('gen_index_name stats=' .. tostring(enabled), num_iters, function(n)
+        local keys = { name = 1 }
+        for i=1,n do offline_db:gen_index_name(keys) end
+    end)
+end
+
+-- server cases
+local db = mongo.Connection.New()
+if not db or not db:connect(test_server) then
+    print('server cases skipped: unable to connect to ' .. test_server)
+    return
+end
+
+db:drop_collection(test_ns)
+bench('server: insert_batch iterator', num_docs, function(n)
+    local i = 0
+    assert( db:insert_batch(test_ns, function()
+        i = i + 1
+        if i <= n then return oid_date_doc() end
+    end) )
+end)
+
+bench('server: cursor results oid/date doc', num_docs, function(n)
+    local q = assert( db:query(test_ns, {}) )
+    for r in q:results() do end
+end)
+
+bench('server: cursor results key_cache=false', num_docs, function(n)
+    local q = assert( db:query(test_ns, {}, nil, nil, nil, { key_cache = false }) )
+    for r in q:results() do end
+end)
+
+bench('server: cursor results reuse=true', num_docs, function(n)
+    local q = assert( db:query(test_ns, {}) )
+    for r in q:results({ reuse = true }) do end
+end)
+
+bench('server: cursor results prefetch=2', num_docs, function(n)
+    local q = assert( db:query(test_ns, {}, nil, nil, nil, { prefetch = 2 }) )
+    for r in q:results() do end
+    print(string.format('    waited %.3f s for batches', q:stats().wait_time))
+end)
+
+-- the cost of recording the latency of every call
+for _,enabled in ipairs{ false, true } do
+    mongo.stats_enable(enabled)
+    bench('server: count stats=' .. tostring(enabled), math.ceil(num_iters / 100), function(n)
+        for i=1,n do db:count(test_ns, { name = 'none' }) end
+    end)
+end
+local count = mongo.stats().count[test_ns]
+print(string.format('    count p50 %.6f s p99 %.6f s', count.p50, count.p99))
+
+db:drop_collection(test_ns)
@@ -0,0 +1,29 @@
+/*
+ * Counts the calls to malloc and realloc of the process, reported as
+ * allocations per operation by bench/codec.lua under LuaJIT:
+ *
+ *    cc -shared -fPIC -o bench/malloc_count.so bench/malloc_count.c
+ *    LD_PRELOAD=./bench/malloc_count.so luajit bench/codec.lua
+ *
+ * glibc only, it forwards to the __libc_* entry points.
+ */
+#include <stddef.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long count = 0;
+
+void *malloc(size_t size) {
+    ++count;
+    return __libc_malloc(size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    ++count;
+    return __libc_realloc(ptr, size);
+}
+
+unsigned long malloc_count(void) {
+    return count;
+}
@@ -13,6 +13,11 @@
 #define LUAMONGO_GRIDFILE        "mongo.GridFile"
 #define LUAMONGO_GRIDFSCHUNK     "mongo.GridFSChunk"
 #define LUAMONGO_GRIDFILEBUILDER "mongo.GridFileBuilder"
+#define LUAMONGO_GRIDFILEREADER  "mongo.GridFileReader"
+#define LUAMONGO_BSON            "mongo.BSON"
+#define LUAMONGO_POOL            "mongo.Pool"
+#define LUAMONGO_OBJECTID        "mongo.ObjectId"
+#define LUAMONGO_DATE            "mongo.Date"
 // not an actual class, pseudo-base for error messages
 #define LUAMONGO_DBCLIENT       "mongo.DBClient"
 #else
@@ -24,6 +29,11 @@
 #define LUAMONGO_GRIDFILE        "GridFile"
 #define LUAMONGO_GRIDFSCHUNK     "GridFSChunk"
 #define LUAMONGO_GRIDFILEBUILDER "GridFileBuilder"
+#define LUAMONGO_GRIDFILEREADER  "GridFileReader"
+#define LUAMONGO_BSON            "BSON"
+#define LUAMONGO_POOL            "Pool"
+#define LUAMONGO_OBJECTID        "ObjectId"
+#define LUAMONGO_DATE            "Date"
 // not an actual class, pseudo-base for error messages
 #define LUAMONGO_DBCLIENT       "DBClient"
 #endif
@@ -40,10 +50,16 @@
 #define LUAMONGO_ERR_REMOVE_FAILED      "Remove failed: %s"
 #define LUAMONGO_ERR_UPDATE_FAILED      "Update failed: %s"
 #define LUAMONGO_ERR_CONNECTION_LOST    "Connection lost"
+#define LUAMONGO_ERR_POOL_EXHAUSTED     "Pool exhausted: %d connections in use"
+#define LUAMONGO_ERR_CLOSED             "Attempt to use a closed %s"
+#define LUAMONGO_ERR_PREFETCHING        "Connection in use by a prefetching cursor"
+#define LUAMONGO_ERR_PREFETCH_SHARED    "prefetch needs a connection without other open cursors or GridFS objects"
+#define LUAMONGO_ERR_IMMUTABLE          "%s values can not be modified, create a new one with %s()"
 #define LUAMONGO_UNSUPPORTED_BSON_TYPE  "Unsupported BSON type `%s'"
 #define LUAMONGO_UNSUPPORTED_LUA_TYPE   "Unsupported Lua type `%s'"
 #define LUAMONGO_REQUIRES_JSON_OR_TABLE "JSON string or Lua table required"
 #define LUAMONGO_REQUIRES_QUERY         LUAMONGO_QUERY ", JSON string or Lua table required"
+#define LUAMONGO_REQUIRES_BULK_OP       "Bulk operation {insert = doc}, {update = {query, doc}} or {remove = {query}} required"
 #define LUAMONGO_NOT_IMPLEMENTED        "Not implemented: %s.%s"
 #define LUAMONGO_ERR_CALLING            "Error calling %s.%s: %s"
 
@@ -37,6 +37,12 @@ extern int mongo_gridfs_register(lua_State *L);
 extern int mongo_gridfile_register(lua_State *L);
 extern int mongo_gridfschunk_register(lua_State *L);
 extern int mongo_gridfilebuilder_register(lua_State *L);
+extern int mongo_gridfilereader_register(lua_State *L);
+extern int mongo_bson_register(lua_State *L);
+extern int mongo_pool_register(lua_State *L);
+extern int mongo_stats(lua_State *L);
+extern int mongo_stats_reset(lua_State *L);
+extern int mongo_stats_enable(lua_State *L);
 
 int mongo_sleep(lua_State *L) {
     double sleeptime = luaL_checknumber(L, 1);
@@ -79,6 +85,9 @@ LM_EXPORT int luaopen_mongo(lua_State *L) {
     static const luaL_Reg static_functions[] = {
         {"sleep", mongo_sleep},
         {"time", mongo_time},
+        {"stats", mongo_stats},
+        {"stats_reset", mongo_stats_reset},
+        {"stats_enable", mongo_stats_enable},
         {NULL, NULL}
     };
     
@@ -119,6 +128,18 @@ LM_EXPORT int luaopen_mongo(lua_State *L) {
     mongo_gridfilebuilder_register(L);
     lua_setfield(L, -2, LUAMONGO_GRIDFILEBUILDER);
 
+    // LUAMONGO_GRIDFILEREADER
+    mongo_gridfilereader_register(L);
+    lua_setfield(L, -2, LUAMONGO_GRIDFILEREADER);
+
+    // LUAMONGO_BSON
+    mongo_bson_register(L);
+    lua_setfield(L, -2, LUAMONGO_BSON);
+
+    // LUAMONGO_POOL
+    mongo_pool_register(L);
+    lua_setfield(L, -2, LUAMONGO_POOL);
+
     /*
      * push the created table to the top of the stack
      * so "mongo = require('mongo')" works
@@ -0,0 +1,318 @@
+#include <iostream>
+#include <vector>
+#include <client/dbclient.h>
+#include "utils.h"
+#include "common.h"
+
+using namespace mongo;
+
+extern bool lua_arg_to_bson(lua_State *L, int stackpos, BSONObj &obj);
+extern void bson_to_table(lua_State *L, const BSONObj &obj);
+extern void bson_to_array(lua_State *L, const BSONObj &obj);
+extern void lua_push_value(lua_State *L, const BSONElement &elem);
+
+// A mongo.BSON userdata is a read-only view over a BSON document. The root
+// view owns a copy of the document bytes; views over nested objects and
+// arrays point into that same buffer and keep their parent view alive
+// through their uservalue. Fields are decoded only when they are indexed.
+struct BSONView {
+    BSONObj obj;
+    bool is_array;
+    std::vector<int> offsets; // of the elements of an array, once indexed
+
+    BSONView(const BSONObj &o, bool a) : obj(o), is_array(a) { }
+
+    // the i-th element (1-based), found by one walk of the array in total
+    BSONElement element(int i) {
+        if (offsets.empty()) {
+            BSONObjIterator it(obj);
+            while (it.more())
+                offsets.push_back(static_cast<int>(it.next().rawdata() - obj.objdata()));
+        }
+        if (i < 1 || static_cast<size_t>(i) > offsets.size())
+            return BSONElement();
+        return BSONElement(obj.objdata() + offsets[i - 1]);
+    }
+};
+
+namespace {
+inline BSONView* userdata_to_bsonview(lua_State* L, int index) {
+    void *ud = luaL_checkudata(L, index, LUAMONGO_BSON);
+    BSONView *view = *((BSONView **)ud);
+    return view;
+}
+
+/*
+ * pushes a view on obj, anchor is the stack index of the view owning the
+ * bytes of obj, or 0 when obj owns them
+ */
+void bsonview_push(lua_State *L, const BSONObj &obj, bool is_array, int anchor) {
+    BSONView **view = (BSONView **)lua_newuserdata(L, sizeof(BSONView *));
+    *view = new BSONView(obj, is_array);
+
+    luaL_getmetatable(L, LUAMONGO_BSON);
+    lua_setmetatable(L, -2);
+
+    if (anchor) {
+        lua_createtable(L, 1, 0);
+        lua_pushvalue(L, anchor);
+        lua_rawseti(L, -2, 1);
+        lua_setuservalue(L, -2);
+    }
+}
+
+/*
+ * like lua_push_value, but embedded objects and arrays become views
+ */
+void bsonview_push_value(lua_State *L, const BSONElement &elem, int anchor) {
+    switch (elem.type()) {
+    case mongo::Object:
+        bsonview_push(L, elem.embeddedObject(), false, anchor);
+        break;
+    case mongo::Array:
+        bsonview_push(L, elem.embeddedObject(), true, anchor);
+        break;
+    default:
+        lua_push_value(L, elem);
+    }
+}
+
+/*
+ * arrays are indexed by position (1-based), objects by field name
+ */
+BSONElement bsonview_find(lua_State *L, BSONView *view, int key) {
+    if (view->is_array) {
+        if (lua_type(L, key) == LUA_TNUMBER) {
+            int i = lua_tointeger(L, key);
+            if (i >= 1 && i == lua_tonumber(L, key))
+                return view->element(i);
+        }
+    } else if (lua_type(L, key) == LUA_TSTRING) {
+        return view->obj.getField(lua_tostring(L, key));
+    }
+    return BSONElement();
+}
+} // anonymous namespace
+
+/*
+ * returns the document of the mongo.BSON at index, or NULL when the value
+ * is not a mongo.BSON
+ */
+const BSONObj* bson_testudata(lua_State *L, int index) {
+    void *ud = lua_touserdata(L, index);
+    if (ud == NULL || !lua_getmetatable(L, index))
+        return NULL;
+
+    luaL_getmetatable(L, LUAMONGO_BSON);
+    bool is_bson = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+
+    return is_bson ? &(*((BSONView **)ud))->obj : NULL;
+}
+
+/*
+ * pushes a mongo.BSON view owning a copy of obj
+ */
+void bson_create(lua_State *L, const BSONObj &obj) {
+    bsonview_push(L, obj.getOwned(), false, 0);
+}
+
+/*
+ * doc,err = mongo.BSON.New(lua_table or json_str or bson_str)
+ */
+static int bson_new(lua_State *L) {
+    int resultcount = 1;
+
+    try {
+        BSONObj data;
+        if (!lua_arg_to_bson(L, 1, data)) {
+            throw(LUAMONGO_REQUIRES_JSON_OR_TABLE);
+        }
+        bson_create(L, data);
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_BSON, "New", e.what());
+        resultcount = 2;
+    } catch (const char *err) {
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        resultcount = 2;
+    }
+
+    return resultcount;
+}
+
+/*
+ * t = doc:totable()
+ *    decodes the whole view into Lua tables
+ */
+static int bson_totable(lua_State *L) {
+    BSONView *view = userdata_to_bsonview(L, 1);
+
+    if (view->is_array)
+        bson_to_array(L, view->obj);
+    else
+        bson_to_table(L, view->obj);
+
+    return 1;
+}
+
+static int bson_pairs_iterator(lua_State *L) {
+    BSONView *view = userdata_to_bsonview(L, lua_upvalueindex(1));
+    int offset = lua_tointeger(L, lua_upvalueindex(2));
+    int n = lua_tointeger(L, lua_upvalueindex(3));
+
+    BSONElement elem(view->obj.objdata() + offset);
+    if (elem.eoo()) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_pushinteger(L, offset + elem.size());
+    lua_replace(L, lua_upvalueindex(2));
+    lua_pushinteger(L, ++n);
+    lua_replace(L, lua_upvalueindex(3));
+
+    if (view->is_array)
+        lua_pushinteger(L, n);
+    else
+        lua_pushstring(L, elem.fieldName());
+    bsonview_push_value(L, elem, lua_upvalueindex(1));
+
+    return 2;
+}
+
+/*
+ * bson_str = doc:data()
+ *    the raw BSON bytes of the view
+ */
+static int bson_data(lua_State *L) {
+    BSONView *view = userdata_to_bsonview(L, 1);
+    lua_pushlstring(L, view->obj.objdata(), view->obj.objsize());
+    return 1;
+}
+
+/*
+ * for key,value in doc:pairs() do ... end
+ * __pairs
+ */
+static int bson_pairs(lua_State *L) {
+    userdata_to_bsonview(L, 1);
+
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, 4); // first element follows the int32 document size
+    lua_pushinteger(L, 0);
+    lua_pushcclosure(L, bson_pairs_iterator, 3);
+
+    return 1;
+}
+
+/*
+ * value = doc:get(key)
+ *    the field called key, also when its name is the one of a method
+ */
+static int bson_get(lua_State *L) {
+    BSONView *view = userdata_to_bsonview(L, 1);
+
+    BSONElement elem = bsonview_find(L, view, 2);
+    if (elem.eoo())
+        lua_pushnil(L);
+    else
+        bsonview_push_value(L, elem, 1);
+
+    return 1;
+}
+
+/*
+ * value = doc[key]
+ *    methods come first, fields with the name of a method are read with
+ *    doc:get(key)
+ * __index
+ */
+static int bson_index(lua_State *L) {
+    userdata_to_bsonview(L, 1);
+
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    if (!lua_isnil(L, -1))
+        return 1;
+    lua_pop(L, 1);
+
+    return bson_get(L);
+}
+
+/*
+ * num_fields = #doc
+ * __len
+ */
+static int bson_len(lua_State *L) {
+    BSONView *view = userdata_to_bsonview(L, 1);
+    if (view->is_array && !view->offsets.empty())
+        lua_pushinteger(L, view->offsets.size());
+    else
+        lua_pushinteger(L, view->obj.nFields());
+    return 1;
+}
+
+/*
+ * __gc
+ */
+static int bson_gc(lua_State *L) {
+    BSONView *view = userdata_to_bsonview(L, 1);
+    delete view;
+    return 0;
+}
+
+/*
+ * __tostring
+ */
+static int bson_tostring(lua_State *L) {
+    BSONView *view = userdata_to_bsonview(L, 1);
+    lua_pushstring(L, view->obj.toString(view->is_array).c_str());
+    return 1;
+}
+
+int mongo_bson_register(lua_State *L) {
+    static const luaL_Reg bson_methods[] = {
+        {"data", bson_data},
+        {"get", bson_get},
+        {"pairs", bson_pairs},
+        {"totable", bson_totable},
+        {NULL, NULL}
+    };
+
+    static const luaL_Reg bson_class_methods[] = {
+        {"New", bson_new},
+        {NULL, NULL}
+    };
+
+    luaL_newmetatable(L, LUAMONGO_BSON);
+
+    // methods are upvalues of __index, looked up before the fields
+    lua_newtable(L);
+    luaL_setfuncs(L, bson_methods, 0);
+    lua_pushcclosure(L, bson_index, 1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, bson_len);
+    lua_setfield(L, -2, "__len");
+
+    lua_pushcfunction(L, bson_pairs);
+    lua_setfield(L, -2, "__pairs");
+
+    lua_pushcfunction(L, bson_gc);
+    lua_setfield(L, -2, "__gc");
+
+    lua_pushcfunction(L, bson_tostring);
+    lua_setfield(L, -2, "__tostring");
+
+    lua_pop(L,1);
+
+    #if LUA_VERSION_NUM < 502
+    luaL_register(L, LUAMONGO_BSON, bson_class_methods);
+    #else
+    luaL_newlib(L, bson_class_methods);
+    #endif
+
+    return 1;
+}
@@ -1,4 +1,6 @@
 #include <iostream>
+#include <cstring>
+#include <sys/time.h>
 #include <client/dbclient.h>
 #include "utils.h"
 #include "common.h"
@@ -6,14 +8,34 @@
 using namespace mongo;
 
 void push_bsontype_table(lua_State* L, mongo::BSONType bsontype);
+void objectid_create(lua_State *L, const void *data);
+void date_create(lua_State *L, long long ms);
+bool date_testudata(lua_State *L, int index, long long *ms);
+extern void lua_push_int64(lua_State *L, long long v);
+static const char *bsontype_metatable_name(mongo::BSONType bsontype);
 extern const char *bson_name(int type);
 extern void lua_to_bson(lua_State *L, int stackpos, BSONObj &obj);
+extern void lua_to_json(lua_State *L, int stackpos, bool canonical, int indent, bool sort);
 extern void bson_to_lua(lua_State *L, const BSONObj &obj);
+extern bool json_to_lua(lua_State *L, const char *data, size_t len);
+extern bool lua_to_int64(lua_State *L, int stackpos, long long *v);
+extern bool raw_decoder_enabled(lua_State *L);
+extern void raw_decoder_enable(lua_State *L, bool enable);
 
+/*
+ * date = mongo.Date([ms])
+ *    milliseconds since the epoch, now by default
+ */
 static int bson_type_Date(lua_State *L) {
-    push_bsontype_table(L, mongo::Date);
-    lua_pushvalue(L, 1);
-    lua_rawseti(L, -2, 1); // t[1] = function arg #1
+    long long ms;
+    if (lua_isnoneornil(L, 1)) {
+        struct timeval wop;
+        gettimeofday(&wop, 0);
+        ms = static_cast<long long>(wop.tv_sec) * 1000 + wop.tv_usec / 1000;
+    } else if (!lua_to_int64(L, 1, &ms) && !date_testudata(L, 1, &ms)) {
+        ms = static_cast<long long>(luaL_checknumber(L, 1));
+    }
+    date_create(L, ms);
     return 1;
 }
 
@@ -61,12 +83,38 @@ static int bson_type_BinData(lua_State *L) {
     return 1;
 }
 
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * oid = mongo.ObjectId([hex_str])
+ *    a new ObjectId is generated when no hex string is given
+ */
 static int bson_type_ObjectID(lua_State *L) {
-    if(lua_gettop(L) == 0)
-        lua_pushstring(L, mongo::OID::gen().toString().data());
-    push_bsontype_table(L, mongo::jstOID);
-    lua_pushvalue(L, 1);
-    lua_rawseti(L, -2, 1); // t[1] = function arg #1
+    if (lua_isnoneornil(L, 1)) {
+        OID oid = OID::gen();
+        objectid_create(L, &oid);
+        return 1;
+    }
+
+    size_t len;
+    const char *hex = luaL_checklstring(L, 1, &len);
+    unsigned char data[OID::kOIDSize];
+    bool valid = len == 2 * OID::kOIDSize;
+    for (int i = 0; valid && i < OID::kOIDSize; ++i) {
+        int hi = hex_digit(hex[2*i]);
+        int lo = hex_digit(hex[2*i + 1]);
+        valid = hi >= 0 && lo >= 0;
+        data[i] = (hi << 4) | lo;
+    }
+    if (!valid)
+        return luaL_argerror(L, 1, "24 hex digits expected");
+
+    objectid_create(L, data);
     return 1;
 }
 
@@ -76,6 +124,31 @@ static int bson_type_NULL(lua_State *L) {
     return 1;
 }
 
+/*
+ * t = mongo.Array(t)
+ *    t is encoded as a BSON array of its elements 1 to #t, nil elements
+ *    as null, without checking its keys
+ */
+static int bson_type_Array(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+    luaL_getmetatable(L, bsontype_metatable_name(mongo::Array));
+    lua_setmetatable(L, 1);
+    return 1;
+}
+
+/*
+ * t = mongo.Object(t)
+ *    t is encoded as a BSON document, even when its keys are 1 to #t
+ */
+static int bson_type_Object(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+    luaL_getmetatable(L, bsontype_metatable_name(mongo::Object));
+    lua_setmetatable(L, 1);
+    return 1;
+}
+
 static int integer_value(lua_State *L) {
     if (lua_gettop(L) > 1) {
         luaL_checkint(L, 2);
@@ -140,22 +213,24 @@ static int generic_tostring(lua_State *L) {
 
 static int longlong_tostring(lua_State *L) {
     lua_rawgeti(L, 1, 1);
-    lua_Number num = lua_tonumber(L, -1);
 
     char numstr[64];
-    int len = snprintf(numstr, 64, "%.f", num);
+    long long v;
+    int len;
+    if (lua_to_int64(L, -1, &v))
+        len = snprintf(numstr, 64, "%lld", v);
+    else
+        len = snprintf(numstr, 64, "%.f", lua_tonumber(L, -1));
 
     lua_pushlstring(L, numstr, len);
 
     return 1;
 }
 
-static int date_tostring(lua_State *L) {
+static int push_date_string(lua_State *L, double ms) {
     char datestr[64];
 
-    lua_rawgeti(L, 1, 1);
-
-    time_t t = (time_t)(lua_tonumber(L, -1)/1000);
+    time_t t = (time_t)(ms/1000);
 
 #if defined(_WIN32)
     ctime_s(datestr, 64, &t);
@@ -170,6 +245,202 @@ static int date_tostring(lua_State *L) {
     return 1;
 }
 
+static int date_tostring(lua_State *L) {
+    lua_rawgeti(L, 1, 1);
+    return push_date_string(L, lua_tonumber(L, -1));
+}
+
+// ObjectId and Date values are userdata holding the 12 bytes of the OID and
+// the milliseconds since the epoch, with one shared metatable each. The hex
+// form of an ObjectId is only built by tostring(oid) and oid:hex(). For the
+// code written for the former wrapper tables, oid() and oid[1] return the
+// hex string and date() and date[1] the milliseconds.
+
+typedef char oid_size_check[sizeof(OID) == OID::kOIDSize ? 1 : -1];
+
+static void *testudata(lua_State *L, int index, const char *tname) {
+    void *ud = lua_touserdata(L, index);
+    if (ud == NULL || !lua_getmetatable(L, index))
+        return NULL;
+
+    luaL_getmetatable(L, tname);
+    bool is_type = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+
+    return is_type ? ud : NULL;
+}
+
+/*
+ * pushes an ObjectId from the 12 bytes at data
+ */
+void objectid_create(lua_State *L, const void *data) {
+    void *ud = lua_newuserdata(L, OID::kOIDSize);
+    memcpy(ud, data, OID::kOIDSize);
+    luaL_getmetatable(L, LUAMONGO_OBJECTID);
+    lua_setmetatable(L, -2);
+}
+
+/*
+ * the 12 bytes of the ObjectId at index, NULL for other values
+ */
+const unsigned char *objectid_testudata(lua_State *L, int index) {
+    return (const unsigned char *)testudata(L, index, LUAMONGO_OBJECTID);
+}
+
+/*
+ * pushes a Date from milliseconds since the epoch
+ */
+void date_create(lua_State *L, long long ms) {
+    long long *ud = (long long *)lua_newuserdata(L, sizeof(long long));
+    *ud = ms;
+    luaL_getmetatable(L, LUAMONGO_DATE);
+    lua_setmetatable(L, -2);
+}
+
+/*
+ * the milliseconds of the Date at index, false for other values
+ */
+bool date_testudata(lua_State *L, int index, long long *ms) {
+    long long *ud = (long long *)testudata(L, index, LUAMONGO_DATE);
+    if (ud) *ms = *ud;
+    return ud != NULL;
+}
+
+static const unsigned char *userdata_to_objectid(lua_State *L, int index) {
+    return (const unsigned char *)luaL_checkudata(L, index, LUAMONGO_OBJECTID);
+}
+
+static long long userdata_to_date(lua_State *L, int index) {
+    return *(long long *)luaL_checkudata(L, index, LUAMONGO_DATE);
+}
+
+/*
+ * hex_str = oid:hex()
+ */
+static int objectid_hex(lua_State *L) {
+    static const char digits[] = "0123456789abcdef";
+    const unsigned char *oid = userdata_to_objectid(L, 1);
+
+    char hex[OID::kOIDSize * 2];
+    for (int i = 0; i < OID::kOIDSize; ++i) {
+        hex[2*i] = digits[oid[i] >> 4];
+        hex[2*i + 1] = digits[oid[i] & 0xf];
+    }
+    lua_pushlstring(L, hex, sizeof(hex));
+    return 1;
+}
+
+/*
+ * seconds = oid:timestamp()
+ *    creation time stored in the first 4 bytes, seconds since the epoch
+ */
+static int objectid_timestamp(lua_State *L) {
+    const unsigned char *oid = userdata_to_objectid(L, 1);
+    unsigned int t = (oid[0] << 24) | (oid[1] << 16) | (oid[2] << 8) | oid[3];
+    lua_pushnumber(L, t);
+    return 1;
+}
+
+/*
+ * hex_str = oid()
+ *    ObjectIds are immutable, the former setter form oid(hex_str) raises an
+ *    error instead of being ignored
+ */
+static int objectid_call(lua_State *L) {
+    if (lua_gettop(L) > 1)
+        return luaL_error(L, LUAMONGO_ERR_IMMUTABLE, LUAMONGO_OBJECTID, LUAMONGO_OBJECTID);
+    return objectid_hex(L);
+}
+
+static int objectid_index(lua_State *L) {
+    if (lua_type(L, 2) == LUA_TNUMBER && lua_tointeger(L, 2) == 1)
+        return objectid_hex(L);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    return 1;
+}
+
+static int objectid_eq(lua_State *L) {
+    const unsigned char *a = objectid_testudata(L, 1);
+    const unsigned char *b = objectid_testudata(L, 2);
+    lua_pushboolean(L, a && b && memcmp(a, b, OID::kOIDSize) == 0);
+    return 1;
+}
+
+static int objectid_lt(lua_State *L) {
+    const unsigned char *a = userdata_to_objectid(L, 1);
+    const unsigned char *b = userdata_to_objectid(L, 2);
+    lua_pushboolean(L, memcmp(a, b, OID::kOIDSize) < 0);
+    return 1;
+}
+
+static int objectid_le(lua_State *L) {
+    const unsigned char *a = userdata_to_objectid(L, 1);
+    const unsigned char *b = userdata_to_objectid(L, 2);
+    lua_pushboolean(L, memcmp(a, b, OID::kOIDSize) <= 0);
+    return 1;
+}
+
+/*
+ * ms = date()
+ *    Dates are immutable, the former setter form date(ms) raises an error
+ *    instead of being ignored
+ */
+static int date_call(lua_State *L) {
+    if (lua_gettop(L) > 1)
+        return luaL_error(L, LUAMONGO_ERR_IMMUTABLE, LUAMONGO_DATE, LUAMONGO_DATE);
+    lua_push_int64(L, userdata_to_date(L, 1));
+    return 1;
+}
+
+static int date_index(lua_State *L) {
+    if (lua_type(L, 2) == LUA_TNUMBER && lua_tointeger(L, 2) == 1) {
+        lua_push_int64(L, userdata_to_date(L, 1));
+        return 1;
+    }
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    return 1;
+}
+
+static int date_ud_tostring(lua_State *L) {
+    return push_date_string(L, userdata_to_date(L, 1));
+}
+
+static int date_eq(lua_State *L) {
+    long long a, b;
+    lua_pushboolean(L, date_testudata(L, 1, &a) && date_testudata(L, 2, &b) && a == b);
+    return 1;
+}
+
+static int date_lt(lua_State *L) {
+    lua_pushboolean(L, userdata_to_date(L, 1) < userdata_to_date(L, 2));
+    return 1;
+}
+
+static int date_le(lua_State *L) {
+    lua_pushboolean(L, userdata_to_date(L, 1) <= userdata_to_date(L, 2));
+    return 1;
+}
+
+static void userdata_metatable_register(lua_State *L, const char *tname, mongo::BSONType bsontype,
+                                        const luaL_Reg *methods, const luaL_Reg *metamethods,
+                                        lua_CFunction index) {
+    luaL_newmetatable(L, tname);
+    luaL_setfuncs(L, metamethods, 0);
+
+    lua_pushinteger(L, bsontype);
+    lua_setfield(L, -2, "__bsontype");
+
+    lua_newtable(L);
+    luaL_setfuncs(L, methods, 0);
+    lua_pushcclosure(L, index, 1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pop(L, 1);
+}
+
+
 static int regex_tostring(lua_State *L) {
     lua_rawgeti(L, 1, 1);
     lua_rawgeti(L, 1, 2);
@@ -188,20 +459,57 @@ static int null_tostring(lua_State *L) {
 // TODO:
 //    all of this should be in Lua so it can get JIT wins
 //    bind the bson typeids
-//    each type could have its cached metatable (from registry)
 
 // all these types are represented as tables
 // the metatable entry __bsontype dictates the type
 // the t[1] represents the object itself, with some types using other fields
+// every type has one shared metatable, created at registration time and
+// kept in the registry under the name returned by bsontype_metatable_name
 
-void push_bsontype_table(lua_State* L, mongo::BSONType bsontype) {
-    lua_newtable(L);
-    lua_newtable(L);
+static const char *bsontype_metatable_name(mongo::BSONType bsontype) {
+    switch(bsontype) {
+        case mongo::NumberInt:
+            return LUAMONGO_ROOT ".bsontype.NumberInt";
+        case mongo::NumberLong:
+            return LUAMONGO_ROOT ".bsontype.NumberLong";
+        case mongo::Date:
+            return LUAMONGO_ROOT ".bsontype.Date";
+        case mongo::Timestamp:
+            return LUAMONGO_ROOT ".bsontype.Timestamp";
+        case mongo::Symbol:
+            return LUAMONGO_ROOT ".bsontype.Symbol";
+        case mongo::BinData:
+            return LUAMONGO_ROOT ".bsontype.BinData";
+        case mongo::jstOID:
+            return LUAMONGO_ROOT ".bsontype.ObjectID";
+        case mongo::RegEx:
+            return LUAMONGO_ROOT ".bsontype.RegEx";
+        case mongo::jstNULL:
+            return LUAMONGO_ROOT ".bsontype.NULL";
+        case mongo::Array:
+            return LUAMONGO_ROOT ".bsontype.Array";
+        case mongo::Object:
+            return LUAMONGO_ROOT ".bsontype.Object";
+    default:
+      ;
+    }
+    return NULL;
+}
+
+static void bsontype_metatable_register(lua_State *L, mongo::BSONType bsontype) {
+    luaL_newmetatable(L, bsontype_metatable_name(bsontype));
 
     lua_pushstring(L, "__bsontype");
     lua_pushinteger(L, bsontype);
     lua_settable(L, -3);
 
+    // mongo.Array and mongo.Object mark plain tables, their elements are
+    // the values
+    if (bsontype == mongo::Array || bsontype == mongo::Object) {
+        lua_pop(L, 1);
+        return;
+    }
+
     lua_pushstring(L, "__call");
     switch(bsontype) {
         case mongo::NumberInt:
@@ -254,6 +562,22 @@ void push_bsontype_table(lua_State* L, mongo::BSONType bsontype) {
     }
     lua_settable(L, -3);
 
+    lua_pop(L, 1);
+}
+
+void push_bsontype_table(lua_State* L, mongo::BSONType bsontype) {
+    switch(bsontype) {
+        case mongo::RegEx:
+            lua_createtable(L, 2, 0);
+            break;
+        case mongo::jstNULL:
+            lua_newtable(L);
+            break;
+    default:
+            lua_createtable(L, 1, 0);
+    }
+
+    luaL_getmetatable(L, bsontype_metatable_name(bsontype));
     lua_setmetatable(L, -2);
 }
 
@@ -261,7 +585,7 @@ void push_bsontype_table(lua_State* L, mongo::BSONType bsontype) {
  * typename = mongo.type(obj)
  */
 static int bson_type_name(lua_State *L) {
-    if (lua_istable(L, 1)) {
+    if (lua_istable(L, 1) || lua_isuserdata(L, 1)) {
         int bsontype_found = luaL_getmetafield(L, 1, "__bsontype");
 
         if (bsontype_found) {
@@ -279,15 +603,38 @@ static int bson_type_name(lua_State *L) {
     return 1;
 }
 
+/*
+ * pushes the value at index as a number: a Lua 5.3 integer stays one, a
+ * LuaJIT int64_t cdata is converted and a Date gives its milliseconds.
+ * Pushes nothing and returns false for other values
+ */
+static bool push_number(lua_State *L, int index) {
+    long long v;
+    if (lua_to_int64(L, index, &v) || date_testudata(L, index, &v)) {
+#if LUA_VERSION_NUM >= 503
+        lua_pushinteger(L, v);
+#else
+        lua_pushnumber(L, (lua_Number)v);
+#endif
+        return true;
+    }
+    if (lua_isnumber(L, index)) {
+        lua_pushnumber(L, lua_tonumber(L, index));
+        return true;
+    }
+    return false;
+}
+
 /*
  * num = mongo.tonumber(obj)
+ *    accepts numbers, int64 values, Date values and the wrapped BSON types
+ *    (NumberInt, NumberLong, ...)
  */
 static int bson_tonumber(lua_State *L) {
     int base = luaL_optint(L, 2, 10);
     if (base == 10) {  /* standard conversion */
         luaL_checkany(L, 1);
-        if (lua_isnumber(L, 1)) {
-            lua_pushnumber(L, lua_tonumber(L, 1));
+        if (push_number(L, 1)) {
             return 1;
         } else if (lua_istable(L, 1)) {
             int bsontype_found = luaL_getmetafield(L, 1, "__bsontype");
@@ -295,12 +642,10 @@ static int bson_tonumber(lua_State *L) {
             if (bsontype_found) {
                 lua_rawgeti(L, 1, 1);
 
-                if (lua_isnumber(L, -1)) {
-                    lua_pushnumber(L, lua_tonumber(L, -1));
+                if (push_number(L, -1))
                     return 1;
-                }
 
-                lua_pop(L, 1);
+                lua_pop(L, 2);
             }
         }
     } else {
@@ -322,14 +667,37 @@ static int bson_tonumber(lua_State *L) {
     return 1;
 }
 
+/*
+ * json,err = mongo.tojson(lua_table[, options])
+ *    accepts an optional table of options:
+ *       mode             "relaxed" (default) or "canonical" Extended JSON
+ *       pretty           true to indent with 2 spaces, or the number of
+ *                        spaces (default = false, a single line)
+ *       sort             write the fields of objects sorted by name
+ *                        (default = false)
+ */
 static int bson_tojson(lua_State *L) {
+    static const char *const modes[] = {"relaxed", "canonical", NULL};
     int resultcount = 1;
-    BSONObj obj;
+    bool canonical = false;
+    int indent = 0;
+    bool sort = false;
+
+    if (lua_type(L, 2) == LUA_TTABLE) {
+        lua_getfield(L, 2, "mode");
+        canonical = luaL_checkoption(L, -1, "relaxed", modes) == 1;
+        lua_getfield(L, 2, "pretty");
+        if (lua_type(L, -1) == LUA_TNUMBER)
+            indent = lua_tointeger(L, -1);
+        else if (lua_toboolean(L, -1))
+            indent = 2;
+        lua_getfield(L, 2, "sort");
+        sort = lua_toboolean(L, -1);
+        lua_pop(L, 3);
+    }
 
     if (lua_istable(L, 1)) {
-        lua_to_bson(L, 1, obj);
-
-        lua_pushstring(L, obj.toString().c_str());
+        lua_to_json(L, 1, canonical, indent, sort);
     } else {
         lua_pushnil(L);
         lua_pushfstring(L, "Argument is not a table");
@@ -339,10 +707,16 @@ static int bson_tojson(lua_State *L) {
     return resultcount;
 }
 
+/*
+ * t,err = mongo.fromjson(json_str)
+ */
 static int bson_fromjson(lua_State *L) {
-    const char *json = luaL_checkstring(L, 1);
+    size_t len;
+    const char *json = luaL_checklstring(L, 1, &len);
     int resultcount = 1;
-    BSONObj obj;
+
+    if (json_to_lua(L, json, len))
+        return 1;
 
     try {
         bson_to_lua(L, fromjson(json));
@@ -355,6 +729,23 @@ static int bson_fromjson(lua_State *L) {
     return resultcount;
 }
 
+/*
+ * previous = mongo.decoder(["raw" or "iterator"])
+ *    selects how BSON documents are decoded into Lua tables: "raw" walks
+ *    the document bytes and is the default, "iterator" goes through the
+ *    driver's BSONObjIterator and is kept for comparison. The choice is
+ *    kept per Lua state
+ */
+static int bson_decoder(lua_State *L) {
+    static const char *const names[] = {"iterator", "raw", NULL};
+
+    lua_pushstring(L, names[raw_decoder_enabled(L) ? 1 : 0]);
+    if (!lua_isnoneornil(L, 1))
+        raw_decoder_enable(L, luaL_checkoption(L, 1, NULL, names) == 1);
+
+    return 1;
+}
+
 int mongo_bsontypes_register(lua_State *L) {
     static const luaL_Reg bsontype_methods[] = {
         {"Date", bson_type_Date},
@@ -366,14 +757,57 @@ int mongo_bsontypes_register(lua_State *L) {
         {"BinData", bson_type_BinData},
         {"ObjectId", bson_type_ObjectID},
         {"NULL", bson_type_NULL},
+        {"Array", bson_type_Array},
+        {"Object", bson_type_Object},
 
         // Utils
         {"type", bson_type_name},
         {"tonumber", bson_tonumber},
         {"tojson", bson_tojson},
         {"fromjson", bson_fromjson},
+        {"decoder", bson_decoder},
+        {NULL, NULL}
+    };
+
+    static const mongo::BSONType bsontypes[] = {
+        mongo::NumberInt, mongo::NumberLong, mongo::Date, mongo::Timestamp,
+        mongo::Symbol, mongo::BinData, mongo::jstOID, mongo::RegEx,
+        mongo::jstNULL, mongo::Array, mongo::Object
+    };
+
+    for (size_t i = 0; i < sizeof(bsontypes)/sizeof(bsontypes[0]); ++i) {
+        bsontype_metatable_register(L, bsontypes[i]);
+    }
+
+    static const luaL_Reg objectid_methods[] = {
+        {"hex", objectid_hex},
+        {"timestamp", objectid_timestamp},
+        {NULL, NULL}
+    };
+    static const luaL_Reg objectid_metamethods[] = {
+        {"__call", objectid_call},
+        {"__tostring", objectid_hex},
+        {"__eq", objectid_eq},
+        {"__lt", objectid_lt},
+        {"__le", objectid_le},
+        {NULL, NULL}
+    };
+    userdata_metatable_register(L, LUAMONGO_OBJECTID, mongo::jstOID,
+                                objectid_methods, objectid_metamethods, objectid_index);
+
+    static const luaL_Reg date_methods[] = {
+        {NULL, NULL}
+    };
+    static const luaL_Reg date_metamethods[] = {
+        {"__call", date_call},
+        {"__tostring", date_ud_tostring},
+        {"__eq", date_eq},
+        {"__lt", date_lt},
+        {"__le", date_le},
         {NULL, NULL}
     };
+    userdata_metatable_register(L, LUAMONGO_DATE, mongo::Date,
+                                date_methods, date_metamethods, date_index);
 
     #if LUA_VERSION_NUM < 502
     luaL_register(L, LUAMONGO_ROOT, bsontype_methods); 
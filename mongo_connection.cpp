@@ -5,6 +5,9 @@
 using namespace mongo;
 
 extern const luaL_Reg dbclient_methods[];
+extern const luaL_Reg dbclient_local_methods[];
+extern bool connection_busy(const DBClientBase *connection);
+extern void connection_wait_idle(const DBClientBase *connection);
 
 namespace {
 inline DBClientConnection* userdata_to_connection(lua_State* L, int index) {
@@ -15,6 +18,19 @@ inline DBClientConnection* userdata_to_connection(lua_State* L, int index) {
 
 } // anonymous namespace
 
+/*
+ * pushes a new, unconnected, Connection userdata
+ */
+DBClientConnection* connection_create(lua_State *L, bool auto_reconnect, double rw_timeout) {
+    DBClientConnection **connection = (DBClientConnection **)lua_newuserdata(L, sizeof(DBClientConnection *));
+    *connection = new DBClientConnection(auto_reconnect, 0, rw_timeout);
+
+    luaL_getmetatable(L, LUAMONGO_CONNECTION);
+    lua_setmetatable(L, -2);
+
+    return *connection;
+}
+
 /*
  * db,err = mongo.Connection.New({})
  *    accepts an optional table of features:
@@ -39,11 +55,7 @@ static int connection_new(lua_State *L) {
             rw_timeout = 0;
         }
 
-        DBClientConnection **connection = (DBClientConnection **)lua_newuserdata(L, sizeof(DBClientConnection *));
-        *connection = new DBClientConnection(auto_reconnect, 0, rw_timeout);
-
-        luaL_getmetatable(L, LUAMONGO_CONNECTION);
-        lua_setmetatable(L, -2);
+        connection_create(L, auto_reconnect, rw_timeout);
     } catch (std::exception &e) {
         lua_pushnil(L);
         lua_pushfstring(L, LUAMONGO_ERR_CONNECTION_FAILED, e.what());
@@ -61,6 +73,9 @@ static int connection_connect(lua_State *L) {
     DBClientConnection *connection = userdata_to_connection(L, 1);
     const char *connectstr = luaL_checkstring(L, 2);
 
+    if (connection_busy(connection))
+        return luaL_error(L, LUAMONGO_ERR_PREFETCHING);
+
     try {
         connection->connect(connectstr);
     } catch (std::exception &e) {
@@ -79,6 +94,8 @@ static int connection_connect(lua_State *L) {
  */
 static int connection_gc(lua_State *L) {
     DBClientConnection *connection = userdata_to_connection(L, 1);
+    // a collected prefetching cursor may still be finishing a getMore
+    connection_wait_idle(connection);
     delete connection;
     return 0;
 }
@@ -106,7 +123,8 @@ int mongo_connection_register(lua_State *L) {
 
     luaL_newmetatable(L, LUAMONGO_CONNECTION);
     //luaL_register(L, NULL, dbclient_methods);
-    luaL_setfuncs(L, dbclient_methods, 0);
+    stats_setfuncs(L, dbclient_methods, "", true);
+    luaL_setfuncs(L, dbclient_local_methods, 0);
     //luaL_register(L, NULL, connection_methods);
     luaL_setfuncs(L, connection_methods, 0);
     lua_pushvalue(L,-1);
@@ -1,4 +1,11 @@
 #include <iostream>
+#include <deque>
+#include <set>
+#include <stdexcept>
+#include <sys/time.h>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 #include <client/dbclient.h>
 #include "utils.h"
 #include "common.h"
@@ -6,40 +13,520 @@
 using namespace mongo;
 
 extern void bson_to_lua(lua_State *L, const BSONObj &obj);
+extern void bson_to_lua_cached(lua_State *L, const BSONObj &obj, int keys);
+extern void bson_fill_table(lua_State *L, const BSONObj &obj, int table, int keys);
+extern void bson_create(lua_State *L, const BSONObj &obj);
+extern void lua_push_value(lua_State *L, const BSONElement &elem);
+
+// registry table of the cursors and GridFS objects using each connection,
+// weak keys at both levels
+#define LUAMONGO_CONNECTION_USERS LUAMONGO_ROOT ".connection_users"
+
+// slots of the uservalue table of a cursor
+enum {
+    CURSOR_CONNECTION = 1, // connection used by the prefetch thread
+    CURSOR_KEYS = 2 // field names of the last decoded document
+};
 
 namespace {
-inline DBClientCursor* userdata_to_cursor(lua_State* L, int index) {
+// connections used by a running prefetch thread: other calls on them are
+// refused, and they are only deleted once the thread is done with them
+boost::mutex busy_mutex;
+boost::condition_variable busy_cond;
+std::set<const DBClientBase *> busy_connections;
+
+void connection_acquire(const DBClientBase *connection) {
+    boost::mutex::scoped_lock lock(busy_mutex);
+    busy_connections.insert(connection);
+}
+
+void connection_release(const DBClientBase *connection) {
+    boost::mutex::scoped_lock lock(busy_mutex);
+    busy_connections.erase(connection);
+    busy_cond.notify_all();
+}
+
+double now() {
+    struct timeval wop;
+    gettimeofday(&wop, 0);
+    return static_cast<double>(wop.tv_sec) +
+        static_cast<double>(wop.tv_usec)*1e-6;
+}
+
+// cursor->more(), recording the getMore when the current batch is consumed
+bool cursor_more(DBClientCursor *cursor, const std::string &ns) {
+    if (!LUAMONGO_STATS_ENABLED || cursor->moreInCurrentBatch() ||
+        cursor->getCursorId() == 0)
+        return cursor->more();
+
+    double t0 = now();
+    try {
+        bool res = cursor->more();
+        stats_record("getMore", ns.c_str(), now() - t0, false);
+        return res;
+    } catch (...) {
+        stats_record("getMore", ns.c_str(), now() - t0, true);
+        throw;
+    }
+}
+} // anonymous namespace
+
+// Drains a driver cursor from a native thread, so the getMore of the next
+// batch overlaps with the processing of the current one on the Lua side.
+// At most depth batches of owned documents are kept ready. While it runs,
+// the thread is the only user of the cursor and its connection: the state
+// of the cursor is read from a copy taken under the mutex, and the
+// connection is refused to other calls (see connection_busy).
+class CursorPrefetcher {
+public:
+    CursorPrefetcher(DBClientBase *connection, DBClientCursor *cursor, int depth,
+                     const std::string &ns)
+        : connection(connection), cursor(cursor), depth(depth), ns(ns), pos(0),
+          done(false), stop(false), orphaned(false) {
+        capture(state);
+        connection_acquire(connection);
+        thread = new boost::thread(&CursorPrefetcher::run, this);
+    }
+
+    ~CursorPrefetcher() {
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            stop = true;
+        }
+        cond.notify_all();
+        if (thread->joinable())
+            thread->join();
+        delete thread;
+    }
+
+    /*
+     * stops the thread when the cursor is collected. Returns false when the
+     * thread is done and the prefetcher can be deleted, or true when the
+     * thread is left to finish its getMore without blocking the collector,
+     * then deletes the cursor and the prefetcher itself
+     */
+    bool abandon() {
+        boost::mutex::scoped_lock lock(mutex);
+        stop = true;
+        cond.notify_all();
+        if (done)
+            return false;
+        orphaned = true;
+        thread->detach();
+        return true;
+    }
+
+    // waits until a document is available, false when the cursor is exhausted
+    bool more() {
+        if (pos < current.size()) return true;
+
+        boost::mutex::scoped_lock lock(mutex);
+        while (batches.empty() && !done) cond.wait(lock);
+        if (batches.empty()) {
+            if (!error.empty()) throw std::runtime_error(error);
+            return false;
+        }
+
+        current.swap(batches.front());
+        batches.pop_front();
+        pos = 0;
+        cond.notify_all();
+        return true;
+    }
+
+    bool more_in_current_batch() {
+        if (pos < current.size()) return true;
+        boost::mutex::scoped_lock lock(mutex);
+        return !batches.empty();
+    }
+
+    int objs_left_in_batch() const {
+        return current.size() - pos;
+    }
+
+    BSONObj next() {
+        return current[pos++];
+    }
+
+    bool is_dead() {
+        boost::mutex::scoped_lock lock(mutex);
+        return state.dead;
+    }
+
+    long long cursor_id() {
+        boost::mutex::scoped_lock lock(mutex);
+        return state.id;
+    }
+
+    bool has_result_flag(int flag) {
+        boost::mutex::scoped_lock lock(mutex);
+        return (state.result_flags & flag) != 0;
+    }
+
+private:
+    struct CursorState {
+        bool dead;
+        long long id;
+        int result_flags;
+    };
+
+    // only called by the thread running the cursor
+    void capture(CursorState &st) {
+        st.dead = cursor->isDead();
+        st.id = cursor->getCursorId();
+        st.result_flags = 0;
+        for (int i = 0; i < 31; ++i) {
+            if (cursor->hasResultFlag(1 << i)) st.result_flags |= 1 << i;
+        }
+    }
+
+    void run() {
+        fetch();
+
+        bool orphan;
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            done = true;
+            orphan = orphaned;
+            cond.notify_all();
+        }
+
+        // an abandoned cursor is killed before the connection is given back
+        if (orphan)
+            delete cursor;
+        connection_release(connection);
+        if (orphan)
+            delete this;
+    }
+
+    void fetch() {
+        CursorState st;
+        try {
+            while (cursor_more(cursor, ns)) {
+                std::vector<BSONObj> batch;
+                batch.reserve(cursor->objsLeftInBatch());
+                do {
+                    batch.push_back(cursor->next().getOwned());
+                } while (cursor->moreInCurrentBatch());
+                capture(st);
+
+                boost::mutex::scoped_lock lock(mutex);
+                state = st;
+                while (batches.size() >= depth && !stop) cond.wait(lock);
+                if (stop) return;
+                batches.push_back(std::vector<BSONObj>());
+                batches.back().swap(batch);
+                cond.notify_all();
+            }
+        } catch (std::exception &e) {
+            boost::mutex::scoped_lock lock(mutex);
+            error = e.what();
+        }
+
+        capture(st);
+        boost::mutex::scoped_lock lock(mutex);
+        state = st;
+    }
+
+    DBClientBase *connection;
+    DBClientCursor *cursor;
+    size_t depth;
+    std::string ns;
+    std::vector<BSONObj> current; // batch being consumed by Lua
+    size_t pos;
+    std::deque< std::vector<BSONObj> > batches; // batches ready for Lua
+    bool done;
+    bool stop;
+    bool orphaned; // the cursor was collected while the thread was running
+    std::string error;
+    CursorState state; // of the cursor after the last batch fetched
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    boost::thread *thread;
+};
+
+// A cursor userdata points to the driver cursor together with the
+// per-cursor options given to db:query. Documents must be read through
+// more() and next(), which hide the prefetch thread when there is one.
+struct LuaCursor {
+    DBClientCursor *cursor;
+    CursorPrefetcher *prefetcher; // NULL unless the prefetch option is set
+    bool lazy; // documents are returned as mongo.BSON views
+    bool key_cache; // field names are kept between documents
+    double wait_time; // seconds spent waiting for batches
+    int prefetch;
+    std::string ns; // empty unless created by db:query
+
+    LuaCursor(DBClientCursor *c)
+        : cursor(c), prefetcher(NULL), lazy(false), key_cache(true),
+          wait_time(0), prefetch(0) { }
+
+    ~LuaCursor() {
+        if (prefetcher && prefetcher->abandon())
+            return; // the thread deletes the cursor
+        delete prefetcher;
+        delete cursor;
+    }
+
+    bool more() {
+        if (more_in_current_batch()) return true;
+        double t0 = now();
+        bool res = prefetcher ? prefetcher->more() : cursor_more(cursor, ns);
+        wait_time += now() - t0;
+        return res;
+    }
+
+    bool more_in_current_batch() {
+        return prefetcher ?
+            prefetcher->more_in_current_batch() : cursor->moreInCurrentBatch();
+    }
+
+    int objs_left_in_batch() const {
+        return prefetcher ?
+            prefetcher->objs_left_in_batch() : cursor->objsLeftInBatch();
+    }
+
+    BSONObj next() {
+        return prefetcher ? prefetcher->next() : cursor->next();
+    }
+
+    bool is_dead() {
+        return prefetcher ? prefetcher->is_dead() : cursor->isDead();
+    }
+
+    long long cursor_id() {
+        return prefetcher ? prefetcher->cursor_id() : cursor->getCursorId();
+    }
+
+    bool has_result_flag(int flag) {
+        return prefetcher ? prefetcher->has_result_flag(flag) : cursor->hasResultFlag(flag);
+    }
+};
+
+namespace {
+inline LuaCursor* userdata_to_luacursor(lua_State* L, int index) {
     void *ud = luaL_checkudata(L, index, LUAMONGO_CURSOR);
-    DBClientCursor *cursor = *((DBClientCursor **)ud);
-    return cursor;
+    LuaCursor *luacursor = *((LuaCursor **)ud);
+    return luacursor;
+}
+
+inline DBClientCursor* userdata_to_cursor(lua_State* L, int index) {
+    return userdata_to_luacursor(L, index)->cursor;
+}
+
+/*
+ * pushes the key cache of the cursor at index, or nothing and returns 0
+ * when the cursor does not decode documents with one
+ */
+int push_key_cache(lua_State *L, LuaCursor *luacursor, int index) {
+    if (luacursor->lazy || !luacursor->key_cache)
+        return 0;
+
+    lua_getuservalue(L, index);
+    lua_rawgeti(L, -1, CURSOR_KEYS);
+    lua_remove(L, -2);
+    return lua_gettop(L);
+}
+
+/*
+ * keys is the stack index of the key cache, 0 for none. When into is the
+ * stack index of a table, the document is decoded into it and it is pushed
+ */
+inline void push_document(lua_State *L, LuaCursor *luacursor, const BSONObj &obj, int keys,
+                          int into = 0) {
+    if (into && !luacursor->lazy) {
+        bson_fill_table(L, obj, into, keys);
+        lua_pushvalue(L, into);
+    } else if (luacursor->lazy)
+        bson_create(L, obj);
+    else if (keys)
+        bson_to_lua_cached(L, obj, keys);
+    else
+        bson_to_lua(L, obj);
+}
+} // anonymous namespace
+
+/*
+ * pushes a cursor userdata taking ownership of autocursor, or nil and an
+ * error message when the driver returned no cursor
+ */
+int cursor_push(lua_State *L, std::auto_ptr<DBClientCursor> autocursor) {
+    if (!autocursor.get()) {
+        lua_pushnil(L);
+        lua_pushstring(L, LUAMONGO_ERR_CONNECTION_LOST);
+        return 2;
+    }
+
+    LuaCursor **luacursor = (LuaCursor **)lua_newuserdata(L, sizeof(LuaCursor *));
+    *luacursor = new LuaCursor(autocursor.get());
+    autocursor.release();
+
+    luaL_getmetatable(L, LUAMONGO_CURSOR);
+    lua_setmetatable(L, -2);
+
+    lua_createtable(L, 2, 0);
+    lua_newtable(L);
+    lua_rawseti(L, -2, CURSOR_KEYS);
+    lua_setuservalue(L, -2);
+
+    return 1;
+}
+
+/*
+ * true while the thread of a prefetching cursor uses connection
+ */
+bool connection_busy(const DBClientBase *connection) {
+    boost::mutex::scoped_lock lock(busy_mutex);
+    return busy_connections.count(connection) > 0;
+}
+
+/*
+ * waits for the thread of a collected prefetching cursor to be done with
+ * connection, before the connection is deleted
+ */
+void connection_wait_idle(const DBClientBase *connection) {
+    boost::mutex::scoped_lock lock(busy_mutex);
+    while (busy_connections.count(connection))
+        busy_cond.wait(lock);
+}
+
+/*
+ * records the cursor or GridFS userdata at index user as a user of the
+ * connection userdata at index connection
+ */
+void connection_add_user(lua_State *L, int connection, int user) {
+    connection = connection < 0 ? lua_gettop(L) + connection + 1 : connection;
+    user = user < 0 ? lua_gettop(L) + user + 1 : user;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, LUAMONGO_CONNECTION_USERS);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_createtable(L, 0, 1);
+        lua_pushliteral(L, "k");
+        lua_setfield(L, -2, "__mode");
+        lua_pushvalue(L, -1);
+        lua_setmetatable(L, -3);
+        lua_setfield(L, LUA_REGISTRYINDEX, LUAMONGO_CONNECTION_USERS ".mt");
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, LUAMONGO_CONNECTION_USERS);
+    }
+
+    lua_pushvalue(L, connection);
+    lua_rawget(L, -2);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_getfield(L, LUA_REGISTRYINDEX, LUAMONGO_CONNECTION_USERS ".mt");
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, connection);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
+    }
+
+    lua_pushvalue(L, user);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, -3);
+    lua_pop(L, 2);
+}
+
+namespace {
+/*
+ * true when a GridFS object, or a cursor which may still send a getMore,
+ * uses the connection userdata at index
+ */
+bool connection_shared(lua_State *L, int connection) {
+    lua_getfield(L, LUA_REGISTRYINDEX, LUAMONGO_CONNECTION_USERS);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return false;
+    }
+    lua_pushvalue(L, connection);
+    lua_rawget(L, -2);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 2);
+        return false;
+    }
+
+    bool shared = false;
+    luaL_getmetatable(L, LUAMONGO_CURSOR);
+    int cursor_mt = lua_gettop(L);
+    for (lua_pushnil(L); !shared && lua_next(L, cursor_mt - 1); lua_pop(L, 1)) {
+        bool cursor = false;
+        if (lua_getmetatable(L, -2)) {
+            cursor = lua_rawequal(L, -1, cursor_mt);
+            lua_pop(L, 1);
+        }
+        if (!cursor) {
+            shared = true; // a GridFS object
+        } else {
+            // NULL once collected: weak keys may outlive their finalizer
+            LuaCursor *luacursor = *((LuaCursor **)lua_touserdata(L, -2));
+            shared = luacursor && luacursor->cursor_id() != 0;
+        }
+    }
+    lua_settop(L, cursor_mt - 3);
+
+    return shared;
 }
 } // anonymous namespace
 
 /*
  * cursor,err = db:query(ns, query)
+ *    options is the stack index of the options table given to db:query,
+ *    or 0 when there is none
  */
 int cursor_create(lua_State *L, DBClientBase *connection, const char *ns,
                   const Query &query, int nToReturn, int nToSkip,
-                  const BSONObj *fieldsToReturn, int queryOptions, int batchSize) {
+                  const BSONObj *fieldsToReturn, int queryOptions, int batchSize,
+                  int options) {
     int resultcount = 1;
 
+    bool lazy = false;
+    bool key_cache = true;
+    int prefetch = 0;
+    if (options) {
+        lua_getfield(L, options, "lazy");
+        lazy = lua_toboolean(L, -1);
+        lua_getfield(L, options, "key_cache");
+        key_cache = lua_isnil(L, -1) || lua_toboolean(L, -1);
+        lua_getfield(L, options, "prefetch");
+        prefetch = luaL_optint(L, -1, 0);
+        lua_pop(L, 3);
+    }
+
+    // the prefetch thread must be the only user of the connection
+    if (prefetch > 0 && connection_shared(L, 1)) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_QUERY_FAILED, LUAMONGO_ERR_PREFETCH_SHARED);
+        return 2;
+    }
+
     try {
         std::auto_ptr<DBClientCursor> autocursor = connection->query(
             ns, query, nToReturn, nToSkip,
             fieldsToReturn, queryOptions, batchSize);
 
-        if (!autocursor.get()) {
-            lua_pushnil(L);
-            lua_pushstring(L, LUAMONGO_ERR_CONNECTION_LOST);
-            return 2;
-        }
+        resultcount = cursor_push(L, autocursor);
+        if (resultcount == 1) {
+            LuaCursor *luacursor = userdata_to_luacursor(L, -1);
+            luacursor->ns = ns;
+            luacursor->lazy = lazy;
+            luacursor->key_cache = key_cache;
+            connection_add_user(L, 1, -1);
 
-        DBClientCursor **cursor = (DBClientCursor **)lua_newuserdata(L, sizeof(DBClientCursor *));
-        *cursor = autocursor.get();
-        autocursor.release();
+            if (prefetch > 0 && !luacursor->cursor->tailable()) {
+                luacursor->prefetch = prefetch;
+                luacursor->prefetcher = new CursorPrefetcher(connection, luacursor->cursor,
+                                                             prefetch, luacursor->ns);
 
-        luaL_getmetatable(L, LUAMONGO_CURSOR);
-        lua_setmetatable(L, -2);
+                // the prefetch thread uses the connection of db:query
+                lua_getuservalue(L, -1);
+                lua_pushvalue(L, 1);
+                lua_rawseti(L, -2, CURSOR_CONNECTION);
+                lua_pop(L, 1);
+            }
+        }
     } catch (std::exception &e) {
         lua_pushnil(L);
         lua_pushfstring(L, LUAMONGO_ERR_QUERY_FAILED, e.what());
@@ -50,37 +537,197 @@ int cursor_create(lua_State *L, DBClientBase *connection, const char *ns,
 }
 
 /*
- * res = cursor:next()
+ * res = cursor:next([t])
+ *    with a table t, the document is decoded into t, which is returned.
+ *    Its previous fields are removed and its subtables are refilled when
+ *    the document has an object or an array at the same place, so any
+ *    reference kept to them sees the new values.
  */
 static int cursor_next(lua_State *L) {
-    DBClientCursor *cursor = userdata_to_cursor(L, 1);
+    LuaCursor *luacursor = userdata_to_luacursor(L, 1);
+    int into = 0;
+    if (!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        into = 2;
+    }
+    int keys = push_key_cache(L, luacursor, 1);
 
-    if (cursor->more()) {
-        bson_to_lua(L, cursor->next());
-    } else {
+    try {
+        if (luacursor->more()) {
+            push_document(L, luacursor, luacursor->next(), keys, into);
+        } else {
+            lua_pushnil(L);
+        }
+    } catch (std::exception &e) {
         lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CURSOR,
+                        "next", e.what());
+        return 2;
     }
 
     return 1;
 }
 
 static int result_iterator(lua_State *L) {
-    DBClientCursor *cursor = userdata_to_cursor(L, lua_upvalueindex(1));
+    LuaCursor *luacursor = userdata_to_luacursor(L, lua_upvalueindex(1));
+    int into = lua_istable(L, lua_upvalueindex(2)) ? lua_upvalueindex(2) : 0;
+    int keys = push_key_cache(L, luacursor, lua_upvalueindex(1));
 
-    if (cursor->more()) {
-        bson_to_lua(L, cursor->next());
-    } else {
+    try {
+        if (luacursor->more()) {
+            push_document(L, luacursor, luacursor->next(), keys, into);
+        } else {
+            lua_pushnil(L);
+        }
+    } catch (std::exception &e) {
         lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CURSOR,
+                        "results", e.what());
+        return 2;
     }
 
     return 1;
 }
 
 /*
- * iter_func = cursor:results()
+ * docs,err = cursor:next_batch([n[, wait]])
+ *    returns an array with up to n documents, or with the rest of the
+ *    current batch when n is not given. When wait is false (default = true)
+ *    only documents already received are returned and no getMore is issued.
+ *    The array is empty once the cursor is exhausted.
+ */
+static int cursor_next_batch(lua_State *L) {
+    LuaCursor *luacursor = userdata_to_luacursor(L, 1);
+    int n = luaL_optint(L, 2, 0);
+    bool wait = lua_isnoneornil(L, 3) ? true : lua_toboolean(L, 3);
+    int keys = push_key_cache(L, luacursor, 1);
+
+    try {
+        int prealloc = luacursor->objs_left_in_batch();
+        if (n > 0 && prealloc > n) prealloc = n;
+        lua_createtable(L, prealloc, 0);
+
+        int i = 0;
+        while (n <= 0 || i < n) {
+            if (!luacursor->more_in_current_batch()) {
+                // a getMore is needed, without n only the first batch waits
+                if (!wait || (n <= 0 && i > 0) || !luacursor->more())
+                    break;
+            }
+            push_document(L, luacursor, luacursor->next(), keys);
+            lua_rawseti(L, -2, ++i);
+        }
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CURSOR,
+                        "next_batch", e.what());
+        return 2;
+    }
+
+    return 1;
+}
+
+/*
+ * columns,count,err = cursor:columns({field1, ...}[, options])
+ *    returns a table with one array per field, indexed by field name, and
+ *    the number of rows read. Fields may be dotted paths ("a.b.c").
+ *    accepts an optional table of options:
+ *       limit            maximum number of rows (default = all)
+ *       missing          value stored for absent fields (default = nil)
+ */
+static int cursor_columns(lua_State *L) {
+    LuaCursor *luacursor = userdata_to_luacursor(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    int limit = 0;
+    int missing = 0; // stack index of the sentinel
+    if (lua_type(L, 3) == LUA_TTABLE) {
+        lua_getfield(L, 3, "limit");
+        limit = luaL_optint(L, -1, 0);
+        lua_pop(L, 1);
+        lua_getfield(L, 3, "missing");
+        missing = lua_gettop(L);
+    }
+
+    // the arguments are checked before the field names are copied, a Lua
+    // error would not destroy the vector
+    size_t nfields = lua_rawlen(L, 2);
+    for (size_t i = 1; i <= nfields; ++i) {
+        lua_rawgeti(L, 2, i);
+        if (!lua_isstring(L, -1))
+            luaL_argerror(L, 2, "array of field names expected");
+        lua_pop(L, 1);
+    }
+    luaL_checkstack(L, nfields + 2, "too many fields");
+
+    std::vector<std::string> fields;
+    fields.reserve(nfields);
+    for (size_t i = 1; i <= nfields; ++i) {
+        lua_rawgeti(L, 2, i);
+        fields.push_back(lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+
+    int prealloc = luacursor->objs_left_in_batch();
+    if (limit > 0 && prealloc > limit) prealloc = limit;
+
+    lua_createtable(L, 0, nfields);
+    int result = lua_gettop(L);
+    // the column arrays stay on the stack, right above the result table
+    for (size_t i = 0; i < nfields; ++i) {
+        lua_createtable(L, prealloc, 0);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, result, fields[i].c_str());
+    }
+
+    int row = 0;
+    try {
+        while ((limit <= 0 || row < limit) && luacursor->more()) {
+            BSONObj obj = luacursor->next();
+            ++row;
+            for (size_t i = 0; i < nfields; ++i) {
+                BSONElement elem = obj.getFieldDotted(fields[i]);
+                if (!elem.eoo())
+                    lua_push_value(L, elem);
+                else if (missing)
+                    lua_pushvalue(L, missing);
+                else
+                    lua_pushnil(L);
+                lua_rawseti(L, result + 1 + i, row);
+            }
+        }
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CURSOR,
+                        "columns", e.what());
+        return 3;
+    }
+
+    lua_settop(L, result);
+    lua_pushinteger(L, row);
+    return 2;
+}
+
+/*
+ * iter_func = cursor:results([options])
+ *    accepts an optional table of options:
+ *       reuse            every document is decoded into the same table, as
+ *                        with cursor:next(t). Rows must not be kept from
+ *                        one iteration to the next (default = false)
  */
 static int cursor_results(lua_State *L) {
-    lua_pushcclosure(L, result_iterator, 1);
+    bool reuse = false;
+    if (lua_type(L, 2) == LUA_TTABLE) {
+        lua_getfield(L, 2, "reuse");
+        reuse = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+
+    lua_settop(L, 1);
+    if (reuse)
+        lua_newtable(L);
+    lua_pushcclosure(L, result_iterator, reuse ? 2 : 1);
     return 1;
 }
 
@@ -89,13 +736,20 @@ static int cursor_results(lua_State *L) {
  *    pass true to call moreInCurrentBatch (mongo >=1.5)
  */
 static int cursor_has_more(lua_State *L) {
-    DBClientCursor *cursor = userdata_to_cursor(L, 1);
+    LuaCursor *luacursor = userdata_to_luacursor(L, 1);
 
     bool in_current_batch = lua_toboolean(L, 2);
-    if (in_current_batch)
-        lua_pushboolean(L, cursor->moreInCurrentBatch());
-    else
-        lua_pushboolean(L, cursor->more());
+    try {
+        if (in_current_batch)
+            lua_pushboolean(L, luacursor->more_in_current_batch());
+        else
+            lua_pushboolean(L, luacursor->more());
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CURSOR,
+                        "has_more", e.what());
+        return 2;
+    }
 
     return 1;
 }
@@ -104,8 +758,23 @@ static int cursor_has_more(lua_State *L) {
  * it_count = cursor:itcount()
  */
 static int cursor_itcount(lua_State *L) {
-    DBClientCursor *cursor = userdata_to_cursor(L, 1);
-    lua_pushinteger(L, cursor->itcount());
+    LuaCursor *luacursor = userdata_to_luacursor(L, 1);
+    int count = 0;
+
+    try {
+        if (luacursor->prefetcher) {
+            for (; luacursor->more(); ++count) luacursor->next();
+        } else {
+            count = luacursor->cursor->itcount();
+        }
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CURSOR,
+                        "itcount", e.what());
+        return 2;
+    }
+
+    lua_pushinteger(L, count);
     return 1;
 }
 
@@ -113,8 +782,8 @@ static int cursor_itcount(lua_State *L) {
  * is_dead = cursor:is_dead()
  */
 static int cursor_is_dead(lua_State *L) {
-    DBClientCursor *cursor = userdata_to_cursor(L, 1);
-    lua_pushboolean(L, cursor->isDead());
+    LuaCursor *luacursor = userdata_to_luacursor(L, 1);
+    lua_pushboolean(L, luacursor->is_dead());
     return 1;
 }
 
@@ -131,9 +800,9 @@ static int cursor_is_tailable(lua_State *L) {
  * has_result_flag = cursor:has_result_flag()
  */
 static int cursor_has_result_flag(lua_State *L) {
-    DBClientCursor *cursor = userdata_to_cursor(L, 1);
+    LuaCursor *luacursor = userdata_to_luacursor(L, 1);
     int flag = lua_tointeger(L, 2);
-    lua_pushboolean(L, cursor->hasResultFlag(flag));
+    lua_pushboolean(L, luacursor->has_result_flag(flag));
     return 1;
 }
 
@@ -141,16 +810,32 @@ static int cursor_has_result_flag(lua_State *L) {
  * id = cursor:get_id()
  */
 static int cursor_get_id(lua_State *L) {
-    DBClientCursor *cursor = userdata_to_cursor(L, 1);
-    lua_pushnumber(L, cursor->getCursorId());
+    LuaCursor *luacursor = userdata_to_luacursor(L, 1);
+    lua_pushnumber(L, luacursor->cursor_id());
     return 1;
 }
+/*
+ * stats_table = cursor:stats()
+ *    prefetch         number of batches fetched ahead (0 = no prefetch)
+ *    wait_time        seconds spent waiting for batches from the server
+ */
+static int cursor_stats(lua_State *L) {
+    LuaCursor *luacursor = userdata_to_luacursor(L, 1);
+
+    lua_createtable(L, 0, 2);
+    LUA_PUSH_ATTRIB_INT("prefetch", luacursor->prefetch);
+    LUA_PUSH_ATTRIB_FLOAT("wait_time", luacursor->wait_time);
+
+    return 1;
+}
+
 /*
  * __gc
  */
 static int cursor_gc(lua_State *L) {
-    DBClientCursor *cursor = userdata_to_cursor(L, 1);
-    delete cursor;
+    LuaCursor **luacursor = (LuaCursor **)luaL_checkudata(L, 1, LUAMONGO_CURSOR);
+    delete *luacursor;
+    *luacursor = NULL;
     return 0;
 }
 
@@ -166,6 +851,8 @@ static int cursor_tostring(lua_State *L) {
 int mongo_cursor_register(lua_State *L) {
     static const luaL_Reg cursor_methods[] = {
         {"next", cursor_next},
+        {"next_batch", cursor_next_batch},
+        {"columns", cursor_columns},
         {"results", cursor_results},
         {"has_more", cursor_has_more},
         {"itcount", cursor_itcount},
@@ -173,6 +860,7 @@ int mongo_cursor_register(lua_State *L) {
         {"is_tailable", cursor_is_tailable},
         {"has_result_flag", cursor_has_result_flag},
         {"get_id", cursor_get_id},
+        {"stats", cursor_stats},
         {NULL, NULL}
     };
 
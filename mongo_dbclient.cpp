@@ -1,6 +1,7 @@
 #include <client/dbclient.h>
 #include <string>
 #include <list>
+#include <algorithm>
 #include "utils.h"
 #include "common.h"
 
@@ -8,12 +9,31 @@ using namespace mongo;
 
 extern int cursor_create(lua_State *L, DBClientBase *connection, const char *ns,
                          const Query &query, int nToReturn, int nToSkip,
-                         const BSONObj *fieldsToReturn, int queryOptions, int batchSize);
+                         const BSONObj *fieldsToReturn, int queryOptions, int batchSize,
+                         int options);
+extern int cursor_push(lua_State *L, std::auto_ptr<DBClientCursor> autocursor);
+extern void connection_add_user(lua_State *L, int connection, int user);
+extern bool connection_busy(const DBClientBase *connection);
 
 extern void lua_to_bson(lua_State *L, int stackpos, BSONObj &obj);
+extern bool lua_arg_to_bson(lua_State *L, int stackpos, BSONObj &obj);
 extern void bson_to_lua(lua_State *L, const BSONObj &obj);
 extern void lua_push_value(lua_State *L, const BSONElement &elem);
+extern BSONObj json_to_bson(const char *json);
 
+// room left in a message for the insert command around the documents
+static const int INSERT_BATCH_OVERHEAD = 16 * 1024;
+
+
+namespace {
+// the thread of a prefetching cursor owns the connection until it is done
+DBClientBase* check_idle(lua_State *L, DBClientBase *connection)
+{
+  if (connection_busy(connection))
+    luaL_error(L, LUAMONGO_ERR_PREFETCHING);
+  return connection;
+}
+} // anonymous namespace
 
 DBClientBase* userdata_to_dbclient(lua_State *L, int stackpos)
 {
@@ -30,7 +50,7 @@ DBClientBase* userdata_to_dbclient(lua_State *L, int stackpos)
         {
           DBClientConnection *connection = *((DBClientConnection **)ud);
           lua_pop(L, 2);
-          return connection;
+          return check_idle(L, connection);
         }
       lua_pop(L, 2);
     }
@@ -45,7 +65,7 @@ DBClientBase* userdata_to_dbclient(lua_State *L, int stackpos)
         {
           DBClientReplicaSet *replicaset = *((DBClientReplicaSet **)ud);
           lua_pop(L, 2); // remove both metatables
-          return replicaset;
+          return check_idle(L, replicaset);
         }
       lua_pop(L, 2);
     }
@@ -76,7 +96,7 @@ static int dbclient_create_index(lua_State *L) {
       int type = lua_type(L, 3);
       if (type == LUA_TSTRING) {
 	  const char *jsonstr = luaL_checkstring(L, 3);
-	  fields = fromjson(jsonstr);
+	  fields = json_to_bson(jsonstr);
       } else if (type == LUA_TTABLE) {
 	  lua_to_bson(L, 3, fields);
       } else {
@@ -87,7 +107,7 @@ static int dbclient_create_index(lua_State *L) {
       BSONObj more_options_bson;
       switch( lua_type(L, 4) ) {
       case LUA_TSTRING:
-	  more_options_bson = fromjson( luaL_checkstring(L, 4) );
+	  more_options_bson = json_to_bson( luaL_checkstring(L, 4) );
 	  break;
       case LUA_TTABLE:
 	  lua_to_bson(L, 4, more_options_bson);
@@ -181,7 +201,7 @@ static int dbclient_get_server_address(lua_State *L) {
 }
 
 /*
- * count,err = db:count(ns, lua_table or json_str)
+ * count,err = db:count(ns, lua_table or json_str or bson)
  */
 static int dbclient_count(lua_State *L) {
   DBClientBase *dbclient = userdata_to_dbclient(L, 1);
@@ -190,13 +210,7 @@ static int dbclient_count(lua_State *L) {
   int count = 0;
   try {
     BSONObj query;
-    int type = lua_type(L, 3);
-    if (type == LUA_TSTRING) {
-      const char *jsonstr = luaL_checkstring(L, 3);
-      query = fromjson(jsonstr);
-    } else if (type == LUA_TTABLE) {
-      lua_to_bson(L, 3, query);
-    }
+    lua_arg_to_bson(L, 3, query);
     count = dbclient->count(ns, query);
   } catch (std::exception &e) {
     lua_pushnil(L);
@@ -209,25 +223,21 @@ static int dbclient_count(lua_State *L) {
 }
 
 /*
- * ok,err = db:insert(ns, lua_table or json_str)
+ * ok,err = db:insert(ns, lua_table or json_str or bson)
+ *    bson is a mongo.BSON or a Lua string with raw BSON bytes, both are sent
+ *    without conversion
  */
 static int dbclient_insert(lua_State *L) {
   DBClientBase *dbclient = userdata_to_dbclient(L, 1);
   const char *ns = luaL_checkstring(L, 2);
 
   try {
-    int type = lua_type(L, 3);
-    if (type == LUA_TSTRING) {
-      const char *jsonstr = luaL_checkstring(L, 3);
-      dbclient->insert(ns, fromjson(jsonstr));
-    } else if (type == LUA_TTABLE) {
-      BSONObj data;
-      lua_to_bson(L, 3, data);
-
-      dbclient->insert(ns, data);
-    } else {
+    BSONObj data;
+    if (!lua_arg_to_bson(L, 3, data)) {
       throw(LUAMONGO_REQUIRES_JSON_OR_TABLE);
     }
+
+    dbclient->insert(ns, data);
   } catch (std::exception &e) {
     lua_pushboolean(L, 0);
     lua_pushfstring(L, LUAMONGO_ERR_INSERT_FAILED, e.what());
@@ -243,39 +253,130 @@ static int dbclient_insert(lua_State *L) {
 }
 
 /*
- * ok,err = db:insert_batch(ns, lua_array_of_tables)
+ * sends the pending documents of db:insert_batch
+ */
+static void insert_batch_flush(DBClientBase *dbclient, const char *ns,
+                               std::vector<BSONObj> &vdata, size_t &inserted) {
+  if (vdata.empty())
+    return;
+  dbclient->insert(ns, vdata);
+  inserted += vdata.size();
+  vdata.clear();
+}
+
+/*
+ * n,err,inserted,index = db:insert_batch(ns, lua_array or iterator)
+ *    every element is a lua_table, json_str or bson, as in db:insert. The
+ *    documents are given as an array or by an iterator function returning one
+ *    document per call and nil at the end. They are encoded and sent in
+ *    batches bounded by the server's maxWriteBatchSize and
+ *    maxMessageSizeBytes, so an iterator inserts any number of documents in
+ *    constant memory.
+ *    Returns the number of inserted documents. On failure returns false, the
+ *    error, the number of documents inserted and the index of the first
+ *    document which was not.
  */
 static int dbclient_insert_batch(lua_State *L) {
   DBClientBase *dbclient = userdata_to_dbclient(L, 1);
   const char *ns = luaL_checkstring(L, 2);
-  luaL_checktype(L, 3, LUA_TTABLE);
+  bool iterator = lua_type(L, 3) == LUA_TFUNCTION;
+  if (!iterator)
+    luaL_checktype(L, 3, LUA_TTABLE);
+  lua_settop(L, 3);
+
+  std::vector<BSONObj> vdata;
+  const char *err = NULL;
+  size_t inserted = 0;
+  size_t failing = 1;
 
   try {
-    std::vector<BSONObj> vdata;
-    size_t tlen = lua_rawlen(L, 3) + 1;
-    for (size_t i = 1; i < tlen; ++i) {
-      vdata.push_back(BSONObj());
-      lua_rawgeti(L, 3, i);
-      lua_to_bson(L, 4, vdata.back());
+    size_t max_count = dbclient->getMaxWriteBatchSize();
+    size_t max_bytes = dbclient->getMaxMessageSizeBytes() - INSERT_BATCH_OVERHEAD;
+    size_t tlen = iterator ? 0 : lua_rawlen(L, 3);
+    size_t bytes = 0;
+    vdata.reserve(iterator ? max_count : std::min(tlen, max_count));
+
+    for (size_t i = 1; ; ++i) {
+      failing = i;
+      if (iterator) {
+        lua_pushvalue(L, 3);
+        if (lua_pcall(L, 0, 1, 0) != 0) {
+          err = lua_tostring(L, -1);
+          break;
+        }
+        if (lua_isnil(L, -1)) {
+          break;
+        }
+      } else if (i > tlen) {
+        break;
+      } else {
+        lua_rawgeti(L, 3, i);
+      }
+
+      BSONObj obj;
+      if (!lua_arg_to_bson(L, -1, obj)) {
+        err = LUAMONGO_REQUIRES_JSON_OR_TABLE;
+        break;
+      }
+      if (iterator) {
+        // raw BSON returned by the iterator is not referenced anywhere else
+        obj = obj.getOwned();
+      }
       lua_pop(L, 1);
+
+      if (!vdata.empty() &&
+          (vdata.size() >= max_count || bytes + obj.objsize() > max_bytes)) {
+        failing = inserted + 1;
+        insert_batch_flush(dbclient, ns, vdata, inserted);
+        bytes = 0;
+      }
+      vdata.push_back(obj);
+      bytes += obj.objsize();
+    }
+
+    // send what was read before the end or the failing document
+    size_t index = failing;
+    failing = inserted + 1;
+    insert_batch_flush(dbclient, ns, vdata, inserted);
+    failing = index;
+  } catch (OperationException &e) {
+    BSONElement index = e.getErrorInfo()["index"];
+    if (index.isNumber()) {
+      inserted += index.numberInt();
+      failing = inserted + 1;
     }
-    dbclient->insert(ns, vdata);
+    err = e.what();
   } catch (std::exception &e) {
+    err = e.what();
+  } catch (const char *e) {
+    err = e;
+  }
+
+  if (err) {
     lua_pushboolean(L, 0);
-    lua_pushfstring(L, LUAMONGO_ERR_INSERT_FAILED, e.what());
-    return 2;
-  } catch (const char *err) {
-    lua_pushboolean(L, 0);
-    lua_pushstring(L, err);
-    return 2;
+    lua_pushfstring(L, LUAMONGO_ERR_INSERT_FAILED, err);
+    lua_pushinteger(L, inserted);
+    lua_pushinteger(L, failing);
+    return 4;
   }
 
-  lua_pushboolean(L, 1);
+  lua_pushinteger(L, inserted);
   return 1;
 }
 
 /*
- * cursor,err = db:query(ns, lua_table or json_str or query_obj, limit, skip, lua_table or json_str, options, batchsize)
+ * cursor,err = db:query(ns, lua_table or json_str or bson or query_obj, limit, skip, lua_table or json_str or bson, options, batchsize)
+ *    options is either a number with mongo.Query.Options flags or a table:
+ *       query_options    mongo.Query.Options flags (default = 0)
+ *       lazy             return mongo.BSON documents instead of tables (default = false)
+ *       key_cache        keep the field names of the last document to push
+ *                        them again for documents of the same shape
+ *                        (default = true)
+ *       prefetch         number of batches fetched ahead by a native thread
+ *                        (default = 0, ignored for tailable cursors). Other
+ *                        calls on the connection raise an error until the
+ *                        cursor is exhausted or collected. Fails when the
+ *                        connection has other open cursors or GridFS objects
  */
 static int dbclient_query(lua_State *L) {
   int n = lua_gettop(L);
@@ -286,14 +387,10 @@ static int dbclient_query(lua_State *L) {
   Query query;
   if (!lua_isnoneornil(L, 3)) {
     try {
-      int type = lua_type(L, 3);
-      if (type == LUA_TSTRING) {
-        query = fromjson(luaL_checkstring(L, 3));
-      } else if (type == LUA_TTABLE) {
-        BSONObj obj;
-        lua_to_bson(L, 3, obj);
+      BSONObj obj;
+      if (lua_arg_to_bson(L, 3, obj)) {
         query = obj;
-      } else if (type == LUA_TUSERDATA) {
+      } else if (lua_type(L, 3) == LUA_TUSERDATA) {
         void *uq = 0;
 
         uq = luaL_checkudata(L, 3, LUAMONGO_QUERY);
@@ -317,24 +414,37 @@ static int dbclient_query(lua_State *L) {
 
   const BSONObj *fieldsToReturn = NULL;
   if (!lua_isnoneornil(L, 6)) {
-    int type = lua_type(L, 6);
-
-    if (type == LUA_TSTRING) {
-      fieldsToReturn = new BSONObj(luaL_checkstring(L, 6));
-    } else if (type == LUA_TTABLE) {
+    try {
       BSONObj obj;
-      lua_to_bson(L, 6, obj);
+      if (!lua_arg_to_bson(L, 6, obj)) {
+        throw(LUAMONGO_REQUIRES_JSON_OR_TABLE);
+      }
       fieldsToReturn = new BSONObj(obj);
-    } else {
-      throw(LUAMONGO_REQUIRES_JSON_OR_TABLE);
+    } catch (std::exception &e) {
+      lua_pushnil(L);
+      lua_pushfstring(L, LUAMONGO_ERR_QUERY_FAILED, e.what());
+      return 2;
+    } catch (const char *err) {
+      lua_pushnil(L);
+      lua_pushstring(L, err);
+      return 2;
     }
   }
 
-  int queryOptions = luaL_optint(L, 7, 0);
+  int queryOptions = 0;
+  int options = 0;
+  if (lua_type(L, 7) == LUA_TTABLE) {
+    lua_getfield(L, 7, "query_options");
+    queryOptions = luaL_optint(L, -1, 0);
+    lua_pop(L, 1);
+    options = 7;
+  } else {
+    queryOptions = luaL_optint(L, 7, 0);
+  }
   int batchSize = luaL_optint(L, 8, 0);
 
   int res = cursor_create(L, dbclient, ns, query, nToReturn, nToSkip,
-                          fieldsToReturn, queryOptions, batchSize);
+                          fieldsToReturn, queryOptions, batchSize, options);
 
   if (fieldsToReturn) {
     delete fieldsToReturn;
@@ -344,7 +454,7 @@ static int dbclient_query(lua_State *L) {
 }
 
 /**
- * lua_table,err = db:find_one(ns, lua_table or json_str or query_obj, lua_table or json_str, options)
+ * lua_table,err = db:find_one(ns, lua_table or json_str or bson or query_obj, lua_table or json_str or bson, options)
  */
 static int dbclient_find_one(lua_State *L) {
   int n = lua_gettop(L);
@@ -355,14 +465,10 @@ static int dbclient_find_one(lua_State *L) {
   Query query;
   if (!lua_isnoneornil(L, 3)) {
     try {
-      int type = lua_type(L, 3);
-      if(type == LUA_TSTRING) {
-        query = fromjson(luaL_checkstring(L, 3));
-      } else if (type == LUA_TTABLE) {
-        BSONObj obj;
-        lua_to_bson(L, 3, obj);
+      BSONObj obj;
+      if (lua_arg_to_bson(L, 3, obj)) {
         query = obj;
-      } else if (type == LUA_TUSERDATA) {
+      } else if (lua_type(L, 3) == LUA_TUSERDATA) {
         void *uq = 0;
                 
         uq = luaL_checkudata(L, 3, LUAMONGO_QUERY);
@@ -383,16 +489,20 @@ static int dbclient_find_one(lua_State *L) {
 
   const BSONObj *fieldsToReturn = NULL;
   if (!lua_isnoneornil(L, 4)) {
-    int type = lua_type(L, 4);
-
-    if (type == LUA_TSTRING) {
-      fieldsToReturn = new BSONObj(luaL_checkstring(L, 4));
-    } else if (type == LUA_TTABLE) {
+    try {
       BSONObj obj;
-      lua_to_bson(L, 4, obj);
+      if (!lua_arg_to_bson(L, 4, obj)) {
+        throw(LUAMONGO_REQUIRES_JSON_OR_TABLE);
+      }
       fieldsToReturn = new BSONObj(obj);
-    } else {
-      throw(LUAMONGO_REQUIRES_JSON_OR_TABLE);
+    } catch (std::exception &e) {
+      lua_pushnil(L);
+      lua_pushfstring(L, LUAMONGO_ERR_FIND_ONE_FAILED, e.what());
+      return 2;
+    } catch (const char *err) {
+      lua_pushnil(L);
+      lua_pushstring(L, err);
+      return 2;
     }
   }
 
@@ -415,7 +525,7 @@ static int dbclient_find_one(lua_State *L) {
 }
 
 /*
- * ok,err = db:remove(ns, lua_table or json_str or query_obj)
+ * ok,err = db:remove(ns, lua_table or json_str or bson or query_obj)
  */
 static int dbclient_remove(lua_State *L) {
   DBClientBase *dbclient = userdata_to_dbclient(L, 1);
@@ -425,13 +535,8 @@ static int dbclient_remove(lua_State *L) {
     int type = lua_type(L, 3);
     bool justOne = lua_toboolean(L, 4);
 
-    if (type == LUA_TSTRING) {
-      const char *jsonstr = luaL_checkstring(L, 3);
-      dbclient->remove(ns, fromjson(jsonstr), justOne);
-    } else if (type == LUA_TTABLE) {
-      BSONObj data;
-      lua_to_bson(L, 3, data);
-
+    BSONObj data;
+    if (lua_arg_to_bson(L, 3, data)) {
       dbclient->remove(ns, data, justOne);
     } else if (type == LUA_TUSERDATA) {
       Query query;
@@ -459,7 +564,7 @@ static int dbclient_remove(lua_State *L) {
 }
 
 /*
- * ok,err = db:update(ns, lua_table or json_str or query_obj, lua_table or json_str, upsert, multi)
+ * ok,err = db:update(ns, lua_table or json_str or bson or query_obj, lua_table or json_str or bson, upsert, multi)
  */
 static int dbclient_update(lua_State *L) {
   DBClientBase *dbclient = userdata_to_dbclient(L, 1);
@@ -467,21 +572,15 @@ static int dbclient_update(lua_State *L) {
 
   try {
     int type_query = lua_type(L, 3);
-    int type_obj = lua_type(L, 4);
 
     bool upsert = lua_toboolean(L, 5);
     bool multi = lua_toboolean(L, 6);
 
     Query query;
     BSONObj obj;
+    BSONObj q;
 
-    if (type_query == LUA_TSTRING) {
-      const char *jsonstr = luaL_checkstring(L, 3);
-      query = fromjson(jsonstr);
-    } else if (type_query == LUA_TTABLE) {
-      BSONObj q;
-
-      lua_to_bson(L, 3, q);
+    if (lua_arg_to_bson(L, 3, q)) {
       query = q;
     } else if (type_query == LUA_TUSERDATA) {
       void *uq = 0;
@@ -492,12 +591,7 @@ static int dbclient_update(lua_State *L) {
       throw(LUAMONGO_REQUIRES_QUERY);
     }
 
-    if (type_obj == LUA_TSTRING) {
-      const char *jsonstr = luaL_checkstring(L, 4);
-      obj = fromjson(jsonstr);
-    } else if (type_obj == LUA_TTABLE) {
-      lua_to_bson(L, 4, obj);
-    } else {
+    if (!lua_arg_to_bson(L, 4, obj)) {
       throw(LUAMONGO_REQUIRES_JSON_OR_TABLE);
     }
 
@@ -516,6 +610,188 @@ static int dbclient_update(lua_State *L) {
   return 1;
 }
 
+template <class Builder>
+static void bulk_append_update(Builder builder, const BSONObj &obj, bool multi) {
+  // a document without update operators replaces the matched one
+  if (!obj.isEmpty() && obj.firstElementFieldName()[0] != '$') {
+    builder.replaceOne(obj);
+  } else if (multi) {
+    builder.update(obj);
+  } else {
+    builder.updateOne(obj);
+  }
+}
+
+/*
+ * appends the operation table at stackpos to the bulk builder
+ */
+static void bulk_append(lua_State *L, BulkOperationBuilder &bulk, int stackpos) {
+  if (lua_type(L, stackpos) != LUA_TTABLE) {
+    throw(LUAMONGO_REQUIRES_BULK_OP);
+  }
+
+  // documents kept as raw BSON stay referenced by the ops table
+  lua_getfield(L, stackpos, "insert");
+  if (!lua_isnil(L, -1)) {
+    BSONObj obj;
+    if (!lua_arg_to_bson(L, -1, obj)) {
+      throw(LUAMONGO_REQUIRES_JSON_OR_TABLE);
+    }
+    bulk.insert(obj);
+    lua_pop(L, 1);
+    return;
+  }
+  lua_pop(L, 1);
+
+  lua_getfield(L, stackpos, "update");
+  if (lua_type(L, -1) == LUA_TTABLE) {
+    BSONObj q;
+    BSONObj obj;
+    lua_rawgeti(L, -1, 1);
+    lua_rawgeti(L, -2, 2);
+    if (!lua_arg_to_bson(L, -2, q) || !lua_arg_to_bson(L, -1, obj)) {
+      throw(LUAMONGO_REQUIRES_JSON_OR_TABLE);
+    }
+    lua_rawgeti(L, -3, 3);
+    bool upsert = lua_toboolean(L, -1);
+    lua_rawgeti(L, -4, 4);
+    bool multi = lua_toboolean(L, -1);
+
+    if (upsert) {
+      bulk_append_update(bulk.find(q).upsert(), obj, multi);
+    } else {
+      bulk_append_update(bulk.find(q), obj, multi);
+    }
+    lua_pop(L, 5);
+    return;
+  }
+  lua_pop(L, 1);
+
+  lua_getfield(L, stackpos, "remove");
+  if (lua_type(L, -1) == LUA_TTABLE) {
+    BSONObj q;
+    lua_rawgeti(L, -1, 1);
+    if (!lua_arg_to_bson(L, -1, q)) {
+      throw(LUAMONGO_REQUIRES_JSON_OR_TABLE);
+    }
+    lua_rawgeti(L, -2, 2);
+    if (lua_toboolean(L, -1)) {
+      bulk.find(q).removeOne();
+    } else {
+      bulk.find(q).remove();
+    }
+    lua_pop(L, 3);
+    return;
+  }
+
+  throw(LUAMONGO_REQUIRES_BULK_OP);
+}
+
+/*
+ * result,err = db:bulk_write(ns, ops[, {ordered = true}])
+ *    ops is an array of operations, each one of
+ *       {insert = doc}
+ *       {update = {query, doc, upsert, multi}}
+ *       {remove = {query, justOne}}
+ *    where documents and queries are Lua tables, JSON strings or BSON. The
+ *    operations are sent in as few write commands as the server's
+ *    maxWriteBatchSize and maxBsonObjectSize allow. An ordered bulk write
+ *    stops at the first failing operation.
+ *
+ *    result holds the counts nInserted, nUpserted, nMatched, nModified and
+ *    nRemoved, the upserted _ids indexed by operation (upserted[i]) and the
+ *    failed operations as errors = {{index = i, code = n, errmsg = s}, ...}.
+ *    When an operation failed err is the message of the first error.
+ */
+static int dbclient_bulk_write(lua_State *L) {
+  DBClientBase *dbclient = userdata_to_dbclient(L, 1);
+  const char *ns = luaL_checkstring(L, 2);
+  luaL_checktype(L, 3, LUA_TTABLE);
+
+  bool ordered = true;
+  if (lua_type(L, 4) == LUA_TTABLE) {
+    lua_getfield(L, 4, "ordered");
+    ordered = lua_isnil(L, -1) ? true : lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+
+  WriteResult result;
+  try {
+    BulkOperationBuilder bulk(dbclient, ns, ordered);
+
+    size_t tlen = lua_rawlen(L, 3) + 1;
+    for (size_t i = 1; i < tlen; ++i) {
+      lua_rawgeti(L, 3, i);
+      bulk_append(L, bulk, lua_gettop(L));
+      lua_pop(L, 1);
+    }
+
+    if (tlen > 1) {
+      bulk.execute(NULL, &result);
+    }
+  } catch (OperationException &e) {
+    // failed operations are reported through the write result
+  } catch (std::exception &e) {
+    lua_pushnil(L);
+    lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_DBCLIENT, "bulk_write", e.what());
+    return 2;
+  } catch (const char *err) {
+    lua_pushnil(L);
+    lua_pushstring(L, err);
+    return 2;
+  }
+
+  lua_newtable(L);
+  LUA_PUSH_ATTRIB_INT("nInserted", result.nInserted());
+  LUA_PUSH_ATTRIB_INT("nUpserted", result.nUpserted());
+  LUA_PUSH_ATTRIB_INT("nMatched", result.nMatched());
+  if (result.hasModifiedCount()) {
+    LUA_PUSH_ATTRIB_INT("nModified", result.nModified());
+  }
+  LUA_PUSH_ATTRIB_INT("nRemoved", result.nRemoved());
+
+  const std::vector<BSONObj> &upserted = result.upserted();
+  lua_createtable(L, 0, upserted.size());
+  for (size_t i = 0; i < upserted.size(); ++i) {
+    lua_push_value(L, upserted[i]["_id"]);
+    lua_rawseti(L, -2, upserted[i]["index"].numberInt() + 1);
+  }
+  lua_setfield(L, -2, "upserted");
+
+  const std::vector<BSONObj> &errors = result.writeErrors();
+  lua_createtable(L, errors.size(), 0);
+  for (size_t i = 0; i < errors.size(); ++i) {
+    lua_createtable(L, 0, 3);
+    LUA_PUSH_ATTRIB_INT("index", errors[i]["index"].numberInt() + 1);
+    LUA_PUSH_ATTRIB_INT("code", errors[i]["code"].numberInt());
+    LUA_PUSH_ATTRIB_STRING("errmsg", errors[i]["errmsg"].str().c_str());
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, "errors");
+
+  const std::vector<BSONObj> &wc_errors = result.writeConcernErrors();
+  if (!wc_errors.empty()) {
+    lua_createtable(L, wc_errors.size(), 0);
+    for (size_t i = 0; i < wc_errors.size(); ++i) {
+      bson_to_lua(L, wc_errors[i]);
+      lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "writeConcernErrors");
+  }
+
+  if (!errors.empty()) {
+    lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_DBCLIENT, "bulk_write",
+                    errors[0]["errmsg"].str().c_str());
+    return 2;
+  } else if (!wc_errors.empty()) {
+    lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_DBCLIENT, "bulk_write",
+                    wc_errors[0]["errmsg"].str().c_str());
+    return 2;
+  }
+
+  return 1;
+}
+
 /*
  * ok,err = db:drop_collection(ns)
  */
@@ -549,7 +825,7 @@ static int dbclient_drop_index_by_fields(lua_State *L) {
     int type = lua_type(L, 3);
     if (type == LUA_TSTRING) {
       const char *jsonstr = luaL_checkstring(L, 3);
-      keys = fromjson(jsonstr);
+      keys = json_to_bson(jsonstr);
     } else if (type == LUA_TTABLE) {
       lua_to_bson(L, 3, keys);
     } else {
@@ -694,7 +970,7 @@ static int dbclient_gen_index_name(lua_State *L) {
     int type = lua_type(L, 2);
     if (type == LUA_TSTRING) {
       const char *jsonstr = luaL_checkstring(L, 2);
-      name = dbclient->genIndexName(fromjson(jsonstr));
+      name = dbclient->genIndexName(json_to_bson(jsonstr));
     } else if (type == LUA_TTABLE) {
       BSONObj data;
       lua_to_bson(L, 2, data);
@@ -726,22 +1002,12 @@ static int dbclient_enumerate_indexes(lua_State *L) {
   const char *ns = luaL_checkstring(L, 2);
 
   std::auto_ptr<DBClientCursor> autocursor = dbclient->enumerateIndexes(ns);
-  
-  if (!autocursor.get()) {
-    lua_pushnil(L);
-    lua_pushstring(L, LUAMONGO_ERR_CONNECTION_LOST);
-    return 2;
-  }
 
-  DBClientCursor **cursor =
-    (DBClientCursor **)lua_newuserdata(L, sizeof(DBClientCursor *));
-  *cursor = autocursor.get();
-  autocursor.release();
+  int resultcount = cursor_push(L, autocursor);
+  if (resultcount == 1)
+    connection_add_user(L, 1, -1);
 
-  luaL_getmetatable(L, LUAMONGO_CURSOR);
-  lua_setmetatable(L, -2);
-
-  return 1;
+  return resultcount;
 }
 
 /*
@@ -761,7 +1027,7 @@ static int dbclient_mapreduce(lua_State *L) {
       int type = lua_type(L, 5);
       if (type == LUA_TSTRING) {
         const char *jsonstr = luaL_checkstring(L, 5);
-        query = fromjson(jsonstr);
+        query = json_to_bson(jsonstr);
       } else if (type == LUA_TTABLE) {
         lua_to_bson(L, 5, query);
       } else {
@@ -858,7 +1124,7 @@ static int dbclient_run_command(lua_State *L) {
     int type = lua_type(L, 3);
     if (type == LUA_TSTRING) {
       const char *jsonstr = luaL_checkstring(L, 3);
-      command = fromjson(jsonstr);
+      command = json_to_bson(jsonstr);
     } else if (type == LUA_TTABLE) {
       BSONObj com_temp;
       lua_to_bson(L, 3, com_temp);
@@ -960,6 +1226,7 @@ static int dbclient_get_collections(lua_State *L) {
 // Method registration table for DBClients
 extern const luaL_Reg dbclient_methods[] = {
   {"auth", dbclient_auth},
+  {"bulk_write", dbclient_bulk_write},
   {"count", dbclient_count},
   {"drop_collection", dbclient_drop_collection},
   {"drop_index_by_fields", dbclient_drop_index_by_fields},
@@ -969,14 +1236,11 @@ extern const luaL_Reg dbclient_methods[] = {
   {"eval", dbclient_eval},
   {"exists", dbclient_exists},
   {"find_one", dbclient_find_one},
-  {"gen_index_name", dbclient_gen_index_name},
   {"enumerate_indexes", dbclient_enumerate_indexes},
   {"get_last_error", dbclient_get_last_error},
   {"get_last_error_detailed", dbclient_get_last_error_detailed},
-  {"get_server_address", dbclient_get_server_address},
   {"insert", dbclient_insert},
   {"insert_batch", dbclient_insert_batch},
-  {"is_failed", dbclient_is_failed},
   {"mapreduce", dbclient_mapreduce},
   {"query", dbclient_query},
   {"reindex", dbclient_reindex},
@@ -989,4 +1253,12 @@ extern const luaL_Reg dbclient_methods[] = {
   {NULL, NULL}
 };
 
+// methods answered without a round trip, left out of mongo.stats()
+extern const luaL_Reg dbclient_local_methods[] = {
+  {"gen_index_name", dbclient_gen_index_name},
+  {"get_server_address", dbclient_get_server_address},
+  {"is_failed", dbclient_is_failed},
+  {NULL, NULL}
+};
+
 
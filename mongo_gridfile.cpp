@@ -1,14 +1,31 @@
 #include <iostream>
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <boost/thread/thread.hpp>
 #include <client/dbclient.h>
 #include <client/gridfs.h>
+#include <util/md5.hpp>
 #include "utils.h"
 #include "common.h"
 
 using namespace mongo;
 
 extern void bson_to_lua(lua_State *L, const BSONObj &obj);
-extern void push_bsontype_table(lua_State* L, mongo::BSONType bsontype);
+extern void date_create(lua_State *L, long long ms);
 extern void lua_push_value(lua_State *L, const BSONElement &elem);
+extern int gridfilereader_create(lua_State *L, const GridFile &gf, int gridfile);
+extern DBClientBase* gridfs_connection(lua_State *L, int index, std::string &chunks_ns);
+extern DBClientBase* userdata_to_dbclient(lua_State *L, int stackpos);
+extern GridFSCodec gridfile_codec(const GridFile &gridfile);
+extern const char *gridfs_decode_chunk(GridFSCodec codec, int n, const char *data, int stored,
+                                       int len, std::string &out);
 
 namespace {
     inline GridFile* userdata_to_gridfile(lua_State* L, int index) {
@@ -19,9 +36,263 @@ namespace {
 
         return gridfile;
     }
+
+    /*
+     * returns the connection of the GridFS of the GridFile userdata at index
+     * and the namespace of its chunks collection in chunks_ns
+     */
+    DBClientBase* file_connection(lua_State *L, int index, std::string &chunks_ns) {
+        lua_getuservalue(L, index);
+        lua_rawgeti(L, -1, 1);
+        DBClientBase *connection = gridfs_connection(L, lua_gettop(L), chunks_ns);
+        lua_pop(L, 2);
+
+        return connection;
+    }
+
+    /*
+     * length of chunk n of a file, only the last one is shorter than the
+     * chunk size
+     */
+    inline int chunk_length(long long length, long long chunk_size, int n) {
+        return static_cast<int>(std::min(chunk_size, length - n * chunk_size));
+    }
+
+    /*
+     * queries the chunks first to last of the file, sorted by n and with
+     * only their number and data
+     */
+    std::auto_ptr<DBClientCursor> query_chunks(DBClientBase *connection,
+                                               const std::string &chunks_ns,
+                                               const BSONElement &files_id,
+                                               int first, int last) {
+        BSONObjBuilder query;
+        query.appendAs(files_id, "files_id");
+        BSONObjBuilder n(query.subobjStart("n"));
+        n.append("$gte", first);
+        n.append("$lte", last);
+        n.done();
+
+        BSONObjBuilder fields;
+        fields.append("n", 1);
+        fields.append("data", 1);
+        BSONObj fields_obj = fields.obj();
+
+        std::auto_ptr<DBClientCursor> cursor = connection->query(
+            chunks_ns, Query(query.obj()).sort("n"), 0, 0, &fields_obj);
+        if (!cursor.get())
+            throw std::runtime_error(LUAMONGO_ERR_CONNECTION_LOST);
+
+        return cursor;
+    }
+
+    /*
+     * returns the len bytes of the file held by the next chunk of a
+     * query_chunks() cursor, kept in chunk or decompressed into decoded,
+     * throwing unless it is chunk n
+     */
+    const char *next_chunk(DBClientCursor *cursor, int n, int len, GridFSCodec codec,
+                           BSONObj &chunk, std::string &decoded) {
+        int stored = -1;
+        const char *data = 0;
+
+        if (cursor->more()) {
+            chunk = cursor->next();
+            if (chunk["n"].numberInt() == n)
+                data = chunk["data"].binDataClean(stored);
+        }
+
+        return gridfs_decode_chunk(codec, n, data, stored, len, decoded);
+    }
+
+    /*
+     * appends the bytes [begin, end) of the file to out, fetching the chunks
+     * holding them with a single query on files_id and n
+     */
+    void read_range(const GridFile &gridfile, DBClientBase *connection,
+                    const std::string &chunks_ns, long long begin, long long end,
+                    std::string &out) {
+        long long length = gridfile.getContentLength();
+        long long chunk_size = gridfile.getChunkSize();
+        if (chunk_size <= 0)
+            throw std::runtime_error("invalid chunk size");
+
+        int first = static_cast<int>(begin / chunk_size);
+        int last = static_cast<int>((end - 1) / chunk_size);
+
+        GridFSCodec codec = gridfile_codec(gridfile);
+        std::auto_ptr<DBClientCursor> cursor = query_chunks(
+            connection, chunks_ns, gridfile.getFileField("_id"), first, last);
+
+        std::string decoded;
+        out.reserve(out.size() + static_cast<size_t>(end - begin));
+        for (int n = first; n <= last; ++n) {
+            BSONObj chunk;
+            int len = chunk_length(length, chunk_size, n);
+            const char *data = next_chunk(cursor.get(), n, len, codec, chunk, decoded);
+
+            long long start = n * chunk_size;
+            long long from = std::max(begin, start) - start;
+            long long to = std::min(end, start + len) - start;
+            out.append(data + from, static_cast<size_t>(to - from));
+        }
+    }
+
+    void write_at(int fd, const char *data, size_t len, off_t offset) {
+        while (len > 0) {
+            ssize_t written = pwrite(fd, data, len, offset);
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw std::runtime_error(strerror(errno));
+            }
+            data += written;
+            len -= written;
+            offset += written;
+        }
+    }
+
+    // Fetches a contiguous range of chunks with one query on its own
+    // connection and writes each one at its offset of the file
+    struct ChunkWriter {
+        DBClientBase *connection;
+        const std::string *chunks_ns;
+        BSONElement files_id;
+        long long length;
+        long long chunk_size;
+        GridFSCodec codec;
+        int first;
+        int last;
+        int fd;
+        std::string error;
+
+        void run() {
+            try {
+                std::auto_ptr<DBClientCursor> cursor = query_chunks(
+                    connection, *chunks_ns, files_id, first, last);
+                std::string decoded;
+                for (int n = first; n <= last; ++n) {
+                    BSONObj chunk;
+                    int len = chunk_length(length, chunk_size, n);
+                    const char *data = next_chunk(cursor.get(), n, len, codec, chunk, decoded);
+                    write_at(fd, data, len, static_cast<off_t>(n * chunk_size));
+                }
+            } catch (std::exception &e) {
+                error = e.what();
+            }
+        }
+    };
+
+    std::string file_md5(const char *path) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error(strerror(errno));
+
+        md5_state_t state;
+        md5_init(&state);
+        char buf[64 * 1024];
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) != 0) {
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                close(fd);
+                throw std::runtime_error(strerror(errno));
+            }
+            md5_append(&state, (const md5_byte_t *)buf, static_cast<int>(n));
+        }
+        close(fd);
+
+        md5digest digest;
+        md5_finish(&state, digest);
+        return digestToString(digest);
+    }
+
+    /*
+     * writes the file to path splitting its chunks in contiguous ranges, one
+     * per connection, each of them fetched and written by its own thread.
+     * Checks the length of the written file, and its md5 with check_md5
+     */
+    void parallel_write(const GridFile &gridfile, const std::vector<DBClientBase *> &connections,
+                        const std::string &chunks_ns, const char *path, bool check_md5) {
+        long long length = gridfile.getContentLength();
+        long long chunk_size = gridfile.getChunkSize();
+        int num_chunks = length > 0 ? gridfile.getNumChunks() : 0;
+        if (num_chunks > 0 && chunk_size <= 0)
+            throw std::runtime_error("invalid chunk size");
+        GridFSCodec codec = gridfile_codec(gridfile);
+
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0)
+            throw std::runtime_error(std::string(path) + ": " + strerror(errno));
+
+        int workers = std::min(static_cast<int>(connections.size()), num_chunks);
+        int per_worker = workers > 0 ? (num_chunks + workers - 1) / workers : 0;
+        std::vector<ChunkWriter> writers(workers);
+        for (int i = 0; i < workers; ++i) {
+            ChunkWriter &w = writers[i];
+            w.connection = connections[i];
+            w.chunks_ns = &chunks_ns;
+            w.files_id = gridfile.getFileField("_id");
+            w.length = length;
+            w.chunk_size = chunk_size;
+            w.codec = codec;
+            w.first = i * per_worker;
+            w.last = std::min(num_chunks, (i + 1) * per_worker) - 1;
+            w.fd = fd;
+        }
+
+        // the calling thread takes the first range
+        std::vector<boost::thread *> threads;
+        for (int i = 1; i < workers; ++i) {
+            if (writers[i].first > writers[i].last)
+                continue;
+            try {
+                threads.push_back(new boost::thread(&ChunkWriter::run, &writers[i]));
+            } catch (std::exception &e) {
+                writers[i].error = e.what();
+            }
+        }
+        if (workers > 0)
+            writers[0].run();
+        for (size_t i = 0; i < threads.size(); ++i) {
+            threads[i]->join();
+            delete threads[i];
+        }
+
+        struct stat st;
+        bool stat_ok = fstat(fd, &st) == 0;
+        close(fd);
+
+        for (int i = 0; i < workers; ++i) {
+            if (!writers[i].error.empty())
+                throw std::runtime_error(writers[i].error);
+        }
+
+        if (!stat_ok || st.st_size != length) {
+            std::stringstream ss;
+            ss << "wrote " << (stat_ok ? static_cast<long long>(st.st_size) : 0LL)
+               << " bytes of " << length;
+            throw std::runtime_error(ss.str());
+        }
+
+        if (check_md5) {
+            std::string md5 = gridfile.getMD5();
+            if (md5.empty())
+                throw std::runtime_error("the file has no md5 to check");
+            if (file_md5(path) != md5)
+                throw std::runtime_error("md5 of the written file does not match");
+        }
+    }
 }
 
-int gridfile_create(lua_State *L, GridFile gf) {
+/*
+ * gridfs is the stack index of the GridFS userdata the file was found in,
+ * which is kept referenced as the GridFile points to it
+ */
+int gridfile_create(lua_State *L, GridFile gf, int gridfs) {
+    gridfs = gridfs < 0 ? lua_gettop(L) + gridfs + 1 : gridfs;
+
     GridFile **gridfile = (GridFile **)lua_newuserdata(L, sizeof(GridFile **));
 
     *gridfile = new GridFile(gf);
@@ -29,6 +300,11 @@ int gridfile_create(lua_State *L, GridFile gf) {
     luaL_getmetatable(L, LUAMONGO_GRIDFILE);
     lua_setmetatable(L, -2);
 
+    lua_createtable(L, 1, 0);
+    lua_pushvalue(L, gridfs);
+    lua_rawseti(L, -2, 1);
+    lua_setuservalue(L, -2);
+
     return 1;
 }
 
@@ -42,6 +318,19 @@ static int gridfile_chunk(lua_State *L) {
 
     try {
         GridFSChunk c = gridfile->getChunk(num);
+        GridFSCodec codec = gridfile_codec(*gridfile);
+        if (codec != GRIDFS_CODEC_NONE) {
+            // the chunk userdata holds the data of the file
+            int stored;
+            const char *data = c.data(stored);
+            std::string decoded;
+            int len = chunk_length(gridfile->getContentLength(), gridfile->getChunkSize(), num);
+            data = gridfs_decode_chunk(codec, num, data, stored, len, decoded);
+
+            BSONObjBuilder file;
+            file.appendAs(gridfile->getFileField("_id"), "_id");
+            c = GridFSChunk(file.obj(), num, data, len);
+        }
         GridFSChunk *chunk_ptr = new GridFSChunk(c);
 
         GridFSChunk **chunk = (GridFSChunk **)lua_newuserdata(L, sizeof(GridFSChunk *));
@@ -158,25 +447,140 @@ static int gridfile_upload_date(lua_State *L) {
 
     Date_t upload_date = gridfile->getUploadDate();
 
-    push_bsontype_table(L, mongo::Date);
-    lua_pushnumber(L, upload_date);
-    lua_rawseti(L, -2, 1);
+    date_create(L, static_cast<long long>(upload_date.millis));
 
     return 1;
 }
 
 /*
- * success,err = gridfile:write(filename)
+ * err = gridfile_write_connections(gridfile, filename, check_md5, pool,
+ *                                  parallel, acquired)
+ *    the write of gridfile:write with options, run in a protected call.
+ *    Up to parallel connections are acquired from pool into the array
+ *    acquired, for the caller to release them. Returns nil or the message
+ *    of a failed write
  */
-static int gridfile_write(lua_State *L) {
+static int gridfile_write_connections(lua_State *L) {
     GridFile *gridfile = userdata_to_gridfile(L, 1);
-    const char *where = luaL_checkstring(L, 2);
+    const char *where = lua_tostring(L, 2);
+    bool check_md5 = lua_toboolean(L, 3);
+    int parallel = lua_tointeger(L, 5);
+
+    if (parallel > 1) {
+        for (int i = 1; i <= parallel; ++i) {
+            lua_getfield(L, 4, "acquire");
+            lua_pushvalue(L, 4);
+            lua_call(L, 1, 1);
+            if (lua_isnil(L, -1)) {
+                lua_pop(L, 1);
+                break;
+            }
+            lua_rawseti(L, 6, i);
+        }
+    }
+
+    // the Lua errors are raised before any C++ object holds memory,
+    // chunks_ns is only set once the connection of the GridFS is checked
+    int acquired = lua_rawlen(L, 6);
+    for (int i = 1; i <= acquired; ++i) {
+        lua_rawgeti(L, 6, i);
+        userdata_to_dbclient(L, -1);
+        lua_pop(L, 1);
+    }
+    std::string chunks_ns;
+    DBClientBase *connection = file_connection(L, 1, chunks_ns);
+
+    std::vector<DBClientBase *> connections;
+    for (int i = 1; i <= acquired; ++i) {
+        lua_rawgeti(L, 6, i);
+        connections.push_back(userdata_to_dbclient(L, -1));
+        lua_pop(L, 1);
+    }
+    if (connections.empty())
+        connections.push_back(connection);
 
     try {
-        gridfile->write(where);
+        parallel_write(*gridfile, connections, chunks_ns, where, check_md5);
     } catch (std::exception &e) {
-        lua_pushboolean(L, 0);
         lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_GRIDFILE, "write", e.what());
+        return 1;
+    }
+
+    lua_pushnil(L);
+    return 1;
+}
+
+/*
+ * success,err = gridfile:write(filename[, options])
+ *    accepts an optional table of options, with which the chunks are
+ *    written at their offset as they arrive and the length of the written
+ *    file is checked:
+ *       parallel   number of chunk ranges fetched at the same time, each on
+ *                  a connection acquired from pool (default = 1)
+ *       pool       mongo.Pool lending the connections of a parallel write,
+ *                  required when parallel is above 1. Without it the
+ *                  connection of the GridFS is used alone
+ *       md5        checks the md5 of the written file (default = false)
+ */
+static int gridfile_write(lua_State *L) {
+    GridFile *gridfile = userdata_to_gridfile(L, 1);
+    const char *where = luaL_checkstring(L, 2);
+
+    if (lua_isnoneornil(L, 3)) {
+        try {
+            // compressed files are written by parallel_write
+            if (gridfile_codec(*gridfile) == GRIDFS_CODEC_NONE) {
+                gridfile->write(where);
+                lua_pushboolean(L, 1);
+                return 1;
+            }
+        } catch (std::exception &e) {
+            lua_pushboolean(L, 0);
+            lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_GRIDFILE, "write", e.what());
+            return 2;
+        }
+        lua_settop(L, 2);
+        lua_newtable(L);
+    }
+
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_getfield(L, 3, "parallel");
+    int parallel = luaL_optint(L, -1, 1);
+    lua_getfield(L, 3, "md5");
+    bool check_md5 = lua_toboolean(L, -1);
+    lua_getfield(L, 3, "pool");
+    bool pool = !lua_isnil(L, -1);
+    luaL_argcheck(L, parallel <= 1 || pool, 3, "parallel requires a pool");
+    int pool_index = lua_gettop(L);
+
+    // the connections acquired from the pool are recorded in a table as
+    // soon as they are, and released whatever happens to the write
+    lua_newtable(L);
+    int acquired = lua_gettop(L);
+
+    lua_pushcfunction(L, gridfile_write_connections);
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, 2);
+    lua_pushboolean(L, check_md5);
+    lua_pushvalue(L, pool_index);
+    lua_pushinteger(L, pool ? parallel : 0);
+    lua_pushvalue(L, acquired);
+    int status = lua_pcall(L, 6, 1, 0);
+
+    int n = lua_rawlen(L, acquired);
+    for (int i = 1; i <= n; ++i) {
+        lua_getfield(L, pool_index, "release");
+        lua_pushvalue(L, pool_index);
+        lua_rawgeti(L, acquired, i);
+        lua_call(L, 2, 0);
+    }
+
+    if (status != 0)
+        return lua_error(L);
+
+    if (!lua_isnil(L, -1)) {
+        lua_pushboolean(L, 0);
+        lua_insert(L, -2);
         return 2;
     }
 
@@ -187,24 +591,84 @@ static int gridfile_write(lua_State *L) {
 
 /*
  * string = gridfile:data()
+ *    the chunks are fetched with a single query and decompressed straight
+ *    into a buffer of the length of the file
  */
 static int gridfile_data(lua_State *L) {
     GridFile *gridfile = userdata_to_gridfile(L, 1);
 
-    std::stringstream data(std::stringstream::out | std::stringstream::binary);
+    std::string data;
     try {
-        gridfile->write(data);
+        long long length = gridfile->getContentLength();
+        if (length > 0) {
+            std::string chunks_ns;
+            DBClientBase *connection = file_connection(L, 1, chunks_ns);
+            read_range(*gridfile, connection, chunks_ns, 0, length, data);
+        }
     } catch (std::exception &e) {
         lua_pushboolean(L, 0);
         lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_GRIDFILE, "data", e.what());
         return 2;
     }
 
-    std::string data_str = data.str();
-    lua_pushlstring (L, data_str.c_str(), data_str.length());
+    lua_pushlstring (L, data.data(), data.length());
     return 1;
 }
 
+/*
+ * string, err = gridfile:range(offset[, length])
+ *    returns length bytes from the 0-based offset (the rest of the file by
+ *    default), fewer when the range goes past the end of the file. Only
+ *    the chunks holding them are fetched, with a single query
+ */
+static int gridfile_range(lua_State *L) {
+    GridFile *gridfile = userdata_to_gridfile(L, 1);
+    long long offset = static_cast<long long>(luaL_checknumber(L, 2));
+    long long length = gridfile->getContentLength();
+    long long size = static_cast<long long>(luaL_optnumber(L, 3, static_cast<lua_Number>(length)));
+
+    luaL_argcheck(L, offset >= 0, 2, "negative offset");
+    luaL_argcheck(L, size >= 0, 3, "negative length");
+
+    long long end = std::min(length, offset + std::min(size, length));
+    std::string data;
+    try {
+        if (offset < end) {
+            std::string chunks_ns;
+            DBClientBase *connection = file_connection(L, 1, chunks_ns);
+            read_range(*gridfile, connection, chunks_ns, offset, end, data);
+        }
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_GRIDFILE, "range", e.what());
+        return 2;
+    }
+
+    lua_pushlstring(L, data.data(), data.size());
+    return 1;
+}
+
+/*
+ * reader, err = gridfile:reader()
+ *    returns a mongo.GridFileReader with read(), lines(), seek() and close()
+ *    methods as Lua files have, fetching the chunks one at a time while
+ *    reading
+ */
+static int gridfile_reader(lua_State *L) {
+    GridFile *gridfile = userdata_to_gridfile(L, 1);
+    int resultcount = 1;
+
+    try {
+        resultcount = gridfilereader_create(L, *gridfile, 1);
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_GRIDFILE, "reader", e.what());
+        resultcount = 2;
+    }
+
+    return resultcount;
+}
+
 /*
  * __gc
  */
@@ -230,6 +694,14 @@ static int gridfile_tostring(lua_State *L) {
 int mongo_gridfile_register(lua_State *L) {
     static const luaL_Reg gridfile_methods[] = {
         {"chunk", gridfile_chunk},
+        {"write", gridfile_write},
+        {"data", gridfile_data},
+        {"range", gridfile_range},
+        {NULL, NULL}
+    };
+
+    // getters of the files document, left out of mongo.stats()
+    static const luaL_Reg gridfile_local_methods[] = {
         {"chunk_size", gridfile_chunk_size},
         {"content_length", gridfile_content_length},
         {"exists", gridfile_exists},
@@ -239,8 +711,7 @@ int mongo_gridfile_register(lua_State *L) {
         {"metadata", gridfile_metadata},
         {"num_chunks", gridfile_num_chunks},
         {"upload_date", gridfile_upload_date},
-        {"write", gridfile_write},
-        {"data", gridfile_data},
+        {"reader", gridfile_reader},
         {NULL, NULL}
     };
 
@@ -250,7 +721,8 @@ int mongo_gridfile_register(lua_State *L) {
 
     luaL_newmetatable(L, LUAMONGO_GRIDFILE);
     //luaL_register(L, 0, gridfile_methods);
-    luaL_setfuncs(L, gridfile_methods, 0);
+    stats_setfuncs(L, gridfile_methods, "gridfile.", false);
+    luaL_setfuncs(L, gridfile_local_methods, 0);
     lua_pushvalue(L,-1);
     lua_setfield(L, -2, "__index");
 
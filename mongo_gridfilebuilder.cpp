@@ -3,25 +3,49 @@
 #include "utils.h"
 #include "common.h"
 
-// FIXME: client pointer is keep, review Lua binding in order to avoid
-// unexpected garbage collection of DBClientBase
-
 using namespace mongo;
 
+struct ChunkStream;
+
 extern void lua_to_bson(lua_State *L, int stackpos, BSONObj &obj);
 extern void bson_to_lua(lua_State *L, const BSONObj &obj);
-extern int gridfile_create(lua_State *L, GridFile gf);
+extern int gridfile_create(lua_State *L, GridFile gf, int gridfs);
 extern DBClientBase* userdata_to_dbclient(lua_State *L, int stackpos);
 extern GridFS* userdata_to_gridfs(lua_State* L, int index);
+extern ChunkStream* chunkstream_compressed(lua_State *L, int index);
+extern void chunkstream_append(ChunkStream *stream, const char *data, size_t len);
+extern BSONObj chunkstream_finish(ChunkStream *stream, const std::string &remote,
+                                  const std::string &content_type);
+extern void chunkstream_abort(ChunkStream *stream);
+extern void chunkstream_delete(ChunkStream *stream);
+
+// The GridFileBuilder of the driver, or the chunk stream of mongo_gridfs.cpp
+// when the GridFS compresses its files. The builder userdata references the
+// GridFS userdata, which keeps the connection. The compressed chunks of a
+// builder collected without build() are removed.
+struct LuaGridFileBuilder {
+    GridFileBuilder *builder;
+    ChunkStream *stream;
+
+    LuaGridFileBuilder() : builder(0), stream(0) {}
+
+    ~LuaGridFileBuilder() {
+	delete builder;
+	if (stream) {
+	    chunkstream_abort(stream);
+	    chunkstream_delete(stream);
+	}
+    }
+};
 
 namespace {
-    inline GridFileBuilder* userdata_to_gridfilebuilder(lua_State* L,
-							int index) {
+    inline LuaGridFileBuilder* userdata_to_gridfilebuilder(lua_State* L,
+							   int index) {
 	void *ud = 0;
     
 	ud = luaL_checkudata(L, index, LUAMONGO_GRIDFILEBUILDER);
-	GridFileBuilder *gridfilebuilder;
-	gridfilebuilder = *((GridFileBuilder **)ud);
+	LuaGridFileBuilder *gridfilebuilder;
+	gridfilebuilder = *((LuaGridFileBuilder **)ud);
     
 	return gridfilebuilder;
     }
@@ -35,11 +59,21 @@ static int gridfilebuilder_new(lua_State *L) {
     GridFS *gridfs = userdata_to_gridfs(L, 1);
   
     try {
-	GridFileBuilder **builder;
-	builder = (GridFileBuilder **)lua_newuserdata(L, sizeof(GridFileBuilder *));
-	*builder = new GridFileBuilder(gridfs);
+	std::auto_ptr<LuaGridFileBuilder> luabuilder(new LuaGridFileBuilder());
+	luabuilder->stream = chunkstream_compressed(L, 1);
+	if (!luabuilder->stream)
+	    luabuilder->builder = new GridFileBuilder(gridfs);
+
+	LuaGridFileBuilder **builder;
+	builder = (LuaGridFileBuilder **)lua_newuserdata(L, sizeof(LuaGridFileBuilder *));
+	*builder = luabuilder.release();
 	luaL_getmetatable(L, LUAMONGO_GRIDFILEBUILDER);
 	lua_setmetatable(L, -2);
+
+	lua_createtable(L, 1, 0);
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, 1);
+	lua_setuservalue(L, -2);
     } catch (std::exception &e) {
 	lua_pushnil(L);
 	lua_pushfstring(L, LUAMONGO_ERR_CONNECTION_FAILED, e.what());
@@ -51,15 +85,20 @@ static int gridfilebuilder_new(lua_State *L) {
 
 /*
  * ok, err = builder:append(data_string)
+ *    with a compressed GridFS, the chunks stored so far are removed when an
+ *    append fails and the builder can not be used anymore
  */
 static int gridfilebuilder_append(lua_State *L) {
-    GridFileBuilder *builder;
+    LuaGridFileBuilder *builder;
     builder = userdata_to_gridfilebuilder(L, 1);
     int resultcount = 1;
     try {
 	size_t length = 0;
 	const char *data = luaL_checklstring(L, 2, &length);
-	builder->appendChunk(data, length);
+	if (builder->stream)
+	    chunkstream_append(builder->stream, data, length);
+	else
+	    builder->builder->appendChunk(data, length);
 	lua_pushboolean(L, 1);
     } catch (std::exception &e) {
 	lua_pushnil(L);
@@ -75,12 +114,16 @@ static int gridfilebuilder_append(lua_State *L) {
  */
 static int gridfilebuilder_build(lua_State *L) {
     int resultcount = 1;
-    GridFileBuilder *builder;
+    LuaGridFileBuilder *builder;
     builder = userdata_to_gridfilebuilder(L, 1);
     const char *remote = luaL_checkstring(L, 2);
     const char *content_type = luaL_optstring(L, 3, "");
     try {
-	BSONObj res = builder->buildFile(remote, content_type);
+	BSONObj res;
+	if (builder->stream)
+	    res = chunkstream_finish(builder->stream, remote, content_type);
+	else
+	    res = builder->builder->buildFile(remote, content_type);
 	bson_to_lua(L, res);
     } catch (std::exception &e) {
 	lua_pushnil(L);
@@ -95,7 +138,7 @@ static int gridfilebuilder_build(lua_State *L) {
  * __gc
  */
 static int gridfilebuilder_gc(lua_State *L) {
-    GridFileBuilder *builder;
+    LuaGridFileBuilder *builder;
     builder = userdata_to_gridfilebuilder(L, 1);
   
     delete builder;
@@ -107,7 +150,7 @@ static int gridfilebuilder_gc(lua_State *L) {
  * __tostring
  */
 static int gridfilebuilder_tostring(lua_State *L) {
-    GridFileBuilder *builder;
+    LuaGridFileBuilder *builder;
     builder = userdata_to_gridfilebuilder(L, 1);
     
     lua_pushfstring(L, "%s: %p", LUAMONGO_GRIDFILEBUILDER, builder);
@@ -130,7 +173,7 @@ int mongo_gridfilebuilder_register(lua_State *L) {
 
     luaL_newmetatable(L, LUAMONGO_GRIDFILEBUILDER);
     //luaL_register(L, 0, gridfs_methods);
-    luaL_setfuncs(L, gridfilebuilder_methods, 0);
+    stats_setfuncs(L, gridfilebuilder_methods, "gridfilebuilder.", false);
     lua_pushvalue(L,-1);
     lua_setfield(L, -2, "__index");
 
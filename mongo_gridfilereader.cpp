@@ -0,0 +1,390 @@
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <string.h>
+#include <sys/time.h>
+#include <client/dbclient.h>
+#include <client/gridfs.h>
+#include "utils.h"
+#include "common.h"
+
+using namespace mongo;
+
+extern GridFSCodec gridfile_codec(const GridFile &gridfile);
+extern const char *gridfs_decode_chunk(GridFSCodec codec, int n, const char *data, int stored,
+                                       int len, std::string &out);
+
+namespace {
+double now() {
+    struct timeval wop;
+    gettimeofday(&wop, 0);
+    return static_cast<double>(wop.tv_sec) +
+        static_cast<double>(wop.tv_usec)*1e-6;
+}
+} // anonymous namespace
+
+// A GridFile read as a stream. Only the chunk holding the current position
+// is kept in memory (with its decompressed data for compressed files),
+// chunks are fetched from fs.chunks as the position moves into them, so
+// memory use does not depend on the size of the file.
+struct GridFileReader {
+    GridFile file;
+    long long length;
+    long long chunk_size;
+    GridFSCodec codec;
+    long long pos;
+    int current;        // number of the chunk in memory, -1 for none
+    GridFSChunk *chunk;
+    const char *bytes;  // data of the file held by the current chunk
+    int bytes_len;
+    std::string decoded;
+    bool closed;
+
+    GridFileReader(const GridFile &gf)
+        : file(gf), length(gf.getContentLength()), chunk_size(gf.getChunkSize()),
+          codec(gridfile_codec(gf)), pos(0), current(-1), chunk(0), bytes(0),
+          bytes_len(0), closed(false) {}
+
+    ~GridFileReader() {
+        release();
+    }
+
+    void release() {
+        delete chunk;
+        chunk = 0;
+        current = -1;
+    }
+
+    /*
+     * returns the bytes of the file from pos to the end of its chunk, or
+     * sets avail to 0 at the end of the file
+     */
+    const char *data(int &avail) {
+        avail = 0;
+        if (pos >= length)
+            return 0;
+        if (chunk_size <= 0)
+            throw std::runtime_error("invalid chunk size");
+
+        int n = static_cast<int>(pos / chunk_size);
+        if (n != current) {
+            release();
+            chunk = fetch(n);
+
+            int stored;
+            const char *stored_data = chunk->data(stored);
+            bytes_len = static_cast<int>(std::min(chunk_size, length - n * chunk_size));
+            bytes = gridfs_decode_chunk(codec, n, stored_data, stored, bytes_len, decoded);
+            current = n;
+        }
+
+        int offset = static_cast<int>(pos - n * chunk_size);
+        avail = bytes_len - offset;
+        return bytes + offset;
+    }
+
+    GridFSChunk *fetch(int n) {
+        if (!LUAMONGO_STATS_ENABLED)
+            return new GridFSChunk(file.getChunk(n));
+
+        double t0 = now();
+        try {
+            GridFSChunk *c = new GridFSChunk(file.getChunk(n));
+            stats_record("gridfilereader.chunk", "", now() - t0, false);
+            return c;
+        } catch (...) {
+            stats_record("gridfilereader.chunk", "", now() - t0, true);
+            throw;
+        }
+    }
+};
+
+namespace {
+    inline GridFileReader* userdata_to_gridfilereader(lua_State* L, int index) {
+        void *ud = 0;
+
+        ud = luaL_checkudata(L, index, LUAMONGO_GRIDFILEREADER);
+        GridFileReader *reader = *((GridFileReader **)ud);
+
+        return reader;
+    }
+
+    inline GridFileReader* check_open(lua_State *L, int index) {
+        GridFileReader *reader = userdata_to_gridfilereader(L, index);
+
+        if (reader->closed)
+            luaL_error(L, LUAMONGO_ERR_CLOSED, LUAMONGO_GRIDFILEREADER);
+
+        return reader;
+    }
+
+    /*
+     * pushes up to n bytes, the rest of the file when n < 0, or nil when
+     * the reader is at the end of the file
+     */
+    void read_bytes(lua_State *L, GridFileReader *reader, long long n) {
+        if (reader->pos >= reader->length && n != -1) {
+            lua_pushnil(L);
+            return;
+        }
+
+        luaL_Buffer b;
+        luaL_buffinit(L, &b);
+        while (n != 0) {
+            int avail;
+            const char *p = reader->data(avail);
+            if (!avail)
+                break;
+            if (n > 0 && avail > n)
+                avail = static_cast<int>(n);
+            luaL_addlstring(&b, p, avail);
+            reader->pos += avail;
+            if (n > 0)
+                n -= avail;
+        }
+        luaL_pushresult(&b);
+    }
+
+    /*
+     * pushes the next line, with its end of line when keep_eol is true, or
+     * nil when the reader is at the end of the file
+     */
+    void read_line(lua_State *L, GridFileReader *reader, bool keep_eol) {
+        if (reader->pos >= reader->length) {
+            lua_pushnil(L);
+            return;
+        }
+
+        luaL_Buffer b;
+        luaL_buffinit(L, &b);
+        for (;;) {
+            int avail;
+            const char *p = reader->data(avail);
+            if (!avail)
+                break;
+            const char *eol = (const char *)memchr(p, '\n', avail);
+            int len = eol ? static_cast<int>(eol - p) + 1 : avail;
+            luaL_addlstring(&b, p, (eol && !keep_eol) ? len - 1 : len);
+            reader->pos += len;
+            if (eol)
+                break;
+        }
+        luaL_pushresult(&b);
+    }
+
+    /*
+     * pushes the result of one io.read() format, returns false when it is nil
+     */
+    bool read_format(lua_State *L, GridFileReader *reader, int index) {
+        if (lua_type(L, index) == LUA_TNUMBER) {
+            lua_Number n = lua_tonumber(L, index);
+            read_bytes(L, reader, n < 0 ? 0 : static_cast<long long>(n));
+        } else {
+            const char *format = luaL_checkstring(L, index);
+            if (*format == '*')
+                ++format;
+            switch (*format) {
+            case 'l':
+                read_line(L, reader, false);
+                break;
+            case 'L':
+                read_line(L, reader, true);
+                break;
+            case 'a':
+                read_bytes(L, reader, -1);
+                break;
+            default:
+                return luaL_argerror(L, index, "invalid format");
+            }
+        }
+        return !lua_isnil(L, -1);
+    }
+} // anonymous namespace
+
+/*
+ * reader = gridfilereader_create(L, gridfile, index)
+ *    index is the stack index of the GridFile userdata, which is kept
+ *    referenced by the reader
+ */
+int gridfilereader_create(lua_State *L, const GridFile &gf, int gridfile) {
+    gridfile = gridfile < 0 ? lua_gettop(L) + gridfile + 1 : gridfile;
+
+    GridFileReader **reader = (GridFileReader **)lua_newuserdata(L, sizeof(GridFileReader *));
+
+    *reader = new GridFileReader(gf);
+
+    luaL_getmetatable(L, LUAMONGO_GRIDFILEREADER);
+    lua_setmetatable(L, -2);
+
+    lua_createtable(L, 1, 0);
+    lua_pushvalue(L, gridfile);
+    lua_rawseti(L, -2, 1);
+    lua_setuservalue(L, -2);
+
+    return 1;
+}
+
+/*
+ * ... = reader:read([format, ...])
+ *    formats are those of io.read(): a number of bytes, "*l", "*L" or "*a"
+ *    (the "*" is optional), reading a line by default. Returns nil at the
+ *    end of the file, or nil and an error message when a chunk could not
+ *    be fetched
+ */
+static int gridfilereader_read(lua_State *L) {
+    GridFileReader *reader = check_open(L, 1);
+    int nargs = lua_gettop(L) - 1;
+    int resultcount = 0;
+
+    try {
+        if (nargs == 0) {
+            read_line(L, reader, false);
+            resultcount = 1;
+        } else {
+            luaL_checkstack(L, nargs, "too many arguments");
+            for (int i = 2; i <= nargs + 1; ++i) {
+                ++resultcount;
+                if (!read_format(L, reader, i))
+                    break;
+            }
+        }
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_GRIDFILEREADER, "read", e.what());
+        return 2;
+    }
+
+    return resultcount;
+}
+
+/*
+ * line iterator returned by reader:lines()
+ */
+static int gridfilereader_lines_iter(lua_State *L) {
+    GridFileReader *reader = check_open(L, lua_upvalueindex(1));
+
+    try {
+        read_line(L, reader, false);
+        return 1;
+    } catch (std::exception &e) {
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_GRIDFILEREADER, "lines", e.what());
+    }
+
+    return lua_error(L);
+}
+
+/*
+ * for line in reader:lines() do ... end
+ *    iterates over the lines from the current position, raising an error
+ *    when a chunk could not be fetched
+ */
+static int gridfilereader_lines(lua_State *L) {
+    check_open(L, 1);
+
+    lua_pushvalue(L, 1);
+    lua_pushcclosure(L, gridfilereader_lines_iter, 1);
+
+    return 1;
+}
+
+/*
+ * pos, err = reader:seek([whence[, offset]])
+ *    whence is "set", "cur" (default) or "end", as in file:seek(). Chunks
+ *    are only fetched by the next read
+ */
+static int gridfilereader_seek(lua_State *L) {
+    static const char *const modes[] = {"set", "cur", "end", NULL};
+    GridFileReader *reader = check_open(L, 1);
+    int whence = luaL_checkoption(L, 2, "cur", modes);
+    long long offset = static_cast<long long>(luaL_optnumber(L, 3, 0));
+
+    long long base = whence == 0 ? 0 : (whence == 1 ? reader->pos : reader->length);
+    if (base + offset < 0) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_GRIDFILEREADER, "seek",
+                        "position before the start of the file");
+        return 2;
+    }
+
+    reader->pos = base + offset;
+    lua_pushnumber(L, static_cast<lua_Number>(reader->pos));
+
+    return 1;
+}
+
+/*
+ * ok = reader:close()
+ *    releases the chunk in memory, the reader can not be used anymore
+ */
+static int gridfilereader_close(lua_State *L) {
+    GridFileReader *reader = check_open(L, 1);
+
+    reader->release();
+    std::string().swap(reader->decoded);
+    reader->closed = true;
+    lua_pushboolean(L, 1);
+
+    return 1;
+}
+
+/*
+ * __gc
+ */
+static int gridfilereader_gc(lua_State *L) {
+    GridFileReader *reader = userdata_to_gridfilereader(L, 1);
+
+    delete reader;
+
+    return 0;
+}
+
+/*
+ * __tostring
+ */
+static int gridfilereader_tostring(lua_State *L) {
+    GridFileReader *reader = userdata_to_gridfilereader(L, 1);
+
+    if (reader->closed)
+        lua_pushfstring(L, "%s (closed)", LUAMONGO_GRIDFILEREADER);
+    else
+        lua_pushfstring(L, "%s: %p", LUAMONGO_GRIDFILEREADER, reader);
+
+    return 1;
+}
+
+int mongo_gridfilereader_register(lua_State *L) {
+    static const luaL_Reg gridfilereader_methods[] = {
+        {"read", gridfilereader_read},
+        {"lines", gridfilereader_lines},
+        {"seek", gridfilereader_seek},
+        {"close", gridfilereader_close},
+        {NULL, NULL}
+    };
+
+    static const luaL_Reg gridfilereader_class_methods[] = {
+        {NULL, NULL}
+    };
+
+    luaL_newmetatable(L, LUAMONGO_GRIDFILEREADER);
+    // reads are served from the chunk in memory, only the chunk fetches
+    // are recorded, as gridfilereader.chunk
+    luaL_setfuncs(L, gridfilereader_methods, 0);
+    lua_pushvalue(L,-1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, gridfilereader_gc);
+    lua_setfield(L, -2, "__gc");
+
+    lua_pushcfunction(L, gridfilereader_tostring);
+    lua_setfield(L, -2, "__tostring");
+
+    lua_pop(L,1);
+
+#if LUA_VERSION_NUM < 502
+    luaL_register(L, LUAMONGO_GRIDFILEREADER, gridfilereader_class_methods);
+#else
+    luaL_newlib(L, gridfilereader_class_methods);
+#endif
+
+    return 1;
+}
@@ -1,18 +1,346 @@
 #include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
 #include <client/dbclient.h>
 #include <client/gridfs.h>
+#include <util/md5.hpp>
 #include "utils.h"
 #include "common.h"
 
-// FIXME: GridFS pointer is keep in GridFile objects, review Lua binding in
-// order to avoid unexpected garbage collection of GridFS pointer
-
 using namespace mongo;
 
+// GridFile objects keep a pointer to their GridFS, and GridFS a reference to
+// its connection: a GridFile userdata references its GridFS userdata, which
+// references the connection in these slots of its uservalue table
+enum {
+    GRIDFS_CONNECTION = 1,
+    GRIDFS_CHUNKS_NS = 2, // namespace of the chunks collection
+    GRIDFS_DBNAME = 3,
+    GRIDFS_PREFIX = 4,
+    GRIDFS_CODEC = 5 // compression of the stored files
+};
+
+// chunk inserts sent before waiting for the server
+static const int DEFAULT_WINDOW = 16;
+
 extern void lua_to_bson(lua_State *L, int stackpos, BSONObj &obj);
 extern void bson_to_lua(lua_State *L, const BSONObj &obj);
-extern int gridfile_create(lua_State *L, GridFile gf);
+extern int gridfile_create(lua_State *L, GridFile gf, int gridfs);
 extern DBClientBase* userdata_to_dbclient(lua_State *L, int stackpos);
+extern int cursor_push(lua_State *L, std::auto_ptr<DBClientCursor> autocursor);
+extern void connection_add_user(lua_State *L, int connection, int user);
+extern BSONObj json_to_bson(const char *json);
+extern GridFSCodec gridfs_codec(const char *name);
+extern const char *gridfs_codec_name(GridFSCodec codec);
+extern void gridfs_compress(GridFSCodec codec, const char *data, size_t len, std::string &out);
+
+// Inserts the chunks of a new file as they are filled, compressed with the
+// codec. Only one insert out of every window waits for the server, the
+// others are sent unacknowledged and checked by finish(), which inserts the
+// files document. Once finished or aborted the stream can not be used.
+struct ChunkStream {
+    DBClientBase *connection;
+    std::string dbname;
+    std::string prefix;
+    OID id;
+    size_t chunk_size;
+    int window;
+    GridFSCodec codec;
+    md5_state_t md5; // of the uncompressed data, filemd5 sees compressed chunks
+    std::string pending;
+    std::string compressed;
+    int n;
+    long long length;
+    bool closed;
+
+    ChunkStream(DBClientBase *connection, const std::string &dbname, const std::string &prefix,
+                size_t chunk_size, int window, GridFSCodec codec)
+        : connection(connection), dbname(dbname), prefix(prefix), id(OID::gen()),
+          chunk_size(chunk_size), window(window), codec(codec), n(0), length(0),
+          closed(false) {
+        md5_init(&md5);
+        pending.reserve(chunk_size);
+    }
+
+    void append(const char *data, size_t len) {
+        check_open();
+        while (len > 0) {
+            size_t count = std::min(len, chunk_size - pending.size());
+            pending.append(data, count);
+            data += count;
+            len -= count;
+            if (pending.size() == chunk_size)
+                flush();
+        }
+    }
+
+    void flush() {
+        if (pending.empty())
+            return;
+
+        const std::string *data = &pending;
+        if (codec != GRIDFS_CODEC_NONE) {
+            md5_append(&md5, (const md5_byte_t *)pending.data(), static_cast<int>(pending.size()));
+            gridfs_compress(codec, pending.data(), pending.size(), compressed);
+            data = &compressed;
+        }
+
+        BSONObjBuilder chunk;
+        chunk.append("_id", OID::gen());
+        chunk.append("files_id", id);
+        chunk.append("n", n);
+        chunk.appendBinData("data", static_cast<int>(data->size()), BinDataGeneral, data->data());
+
+        ++n;
+        bool acknowledged = window > 0 && n % window == 0;
+        connection->insert(prefix_ns("chunks"), chunk.obj(), 0,
+                           acknowledged ? &WriteConcern::acknowledged : &WriteConcern::unacknowledged);
+        length += pending.size();
+        pending.clear();
+    }
+
+    BSONObj finish(const std::string &remote, const std::string &content_type) {
+        check_open();
+        flush();
+
+        std::string error = connection->getLastError();
+        if (!error.empty())
+            throw std::runtime_error(error);
+
+        // filemd5 also counts the chunks, catching any lost unacknowledged insert
+        BSONObjBuilder cmd;
+        cmd.append("filemd5", id);
+        cmd.append("root", prefix);
+        BSONObj res;
+        if (!connection->runCommand(dbname, cmd.obj(), res))
+            throw std::runtime_error("filemd5 failed: " + res.toString());
+        if (res["numChunks"].numberInt() != n)
+            throw std::runtime_error("chunks are missing after the upload");
+
+        struct timeval now;
+        gettimeofday(&now, 0);
+
+        BSONObjBuilder file;
+        file.append("_id", id);
+        file.append("filename", remote);
+        file.append("chunkSize", static_cast<int>(chunk_size));
+        file.appendDate("uploadDate", Date_t(static_cast<unsigned long long>(now.tv_sec) * 1000 + now.tv_usec / 1000));
+        if (codec != GRIDFS_CODEC_NONE) {
+            md5digest digest;
+            md5_finish(&md5, digest);
+            file.append("md5", digestToString(digest));
+            file.append("compression", gridfs_codec_name(codec));
+        } else {
+            file.append(res["md5"]);
+        }
+        if (length < 1024 * 1024 * 1024)
+            file.append("length", static_cast<int>(length));
+        else
+            file.append("length", length);
+        if (!content_type.empty())
+            file.append("contentType", content_type);
+
+        BSONObj obj = file.obj();
+        connection->insert(prefix_ns("files"), obj);
+        closed = true;
+        return obj;
+    }
+
+    // best effort removal of the chunks inserted before a failure
+    void abort() {
+        closed = true;
+        try {
+            BSONObjBuilder query;
+            query.append("files_id", id);
+            connection->remove(prefix_ns("chunks"), Query(query.obj()));
+        } catch (std::exception &) {
+        }
+    }
+
+    std::string prefix_ns(const char *collection) const {
+        return dbname + "." + prefix + "." + collection;
+    }
+
+    void check_open() const {
+        if (closed)
+            throw std::runtime_error("the file is already stored or aborted");
+    }
+};
+
+namespace {
+struct ScopedFile {
+    FILE *fp;
+    ScopedFile(FILE *fp) : fp(fp) {}
+    ~ScopedFile() {
+        if (fp)
+            fclose(fp);
+    }
+};
+
+/*
+ * returns the codec of the files stored by the GridFS userdata at index
+ */
+GridFSCodec gridfs_compression(lua_State *L, int index) {
+    lua_getuservalue(L, index);
+    lua_rawgeti(L, -1, GRIDFS_CODEC);
+    GridFSCodec codec = static_cast<GridFSCodec>(lua_tointeger(L, -1));
+    lua_pop(L, 2);
+
+    return codec;
+}
+
+/*
+ * appends the data read from source to stream: a file name, a function
+ * returning the next piece of data, or an object whose read(n) method is
+ * at stack index reader, looked up beforehand so that only protected calls
+ * run while C++ objects are alive
+ */
+void stream_source(lua_State *L, int source, int reader, ChunkStream &stream) {
+    int type = lua_type(L, source);
+
+    if (type == LUA_TSTRING) {
+        const char *filename = lua_tostring(L, source);
+        ScopedFile file(fopen(filename, "rb"));
+        if (!file.fp)
+            throw std::runtime_error(std::string(filename) + ": " + strerror(errno));
+
+        std::vector<char> buf(stream.chunk_size);
+        size_t len;
+        while ((len = fread(&buf[0], 1, buf.size(), file.fp)) > 0)
+            stream.append(&buf[0], len);
+        if (ferror(file.fp))
+            throw std::runtime_error(std::string(filename) + ": " + strerror(errno));
+        return;
+    }
+
+    int top = lua_gettop(L);
+    for (;;) {
+        int status;
+        if (type == LUA_TFUNCTION) {
+            lua_pushvalue(L, source);
+            status = lua_pcall(L, 0, 1, 0);
+        } else {
+            lua_pushvalue(L, reader);
+            lua_pushvalue(L, source);
+            lua_pushinteger(L, static_cast<lua_Integer>(stream.chunk_size));
+            status = lua_pcall(L, 2, 1, 0);
+        }
+        if (status != 0) {
+            std::string error = lua_isstring(L, -1) ? lua_tostring(L, -1) : "error reading the source";
+            lua_settop(L, top);
+            throw std::runtime_error(error);
+        }
+        if (lua_isnil(L, -1))
+            break;
+
+        size_t len;
+        const char *data = lua_tolstring(L, -1, &len);
+        if (!data) {
+            lua_settop(L, top);
+            throw std::runtime_error("the source returned a non-string value");
+        }
+        stream.append(data, len);
+        lua_pop(L, 1);
+    }
+    lua_settop(L, top);
+}
+
+/*
+ * stores the data of source through stream, removing the inserted chunks
+ * on failure
+ */
+BSONObj store_source(lua_State *L, int source, int reader, ChunkStream &stream,
+                     const std::string &remote, const std::string &content_type) {
+    try {
+        stream_source(L, source, reader, stream);
+        return stream.finish(remote, content_type);
+    } catch (std::exception &) {
+        stream.abort();
+        throw;
+    }
+}
+
+/*
+ * stores len bytes of data through stream, removing the inserted chunks on
+ * failure
+ */
+BSONObj store_buffer(ChunkStream &stream, const char *data, size_t len,
+                     const std::string &remote, const std::string &content_type) {
+    try {
+        stream.append(data, len);
+        return stream.finish(remote, content_type);
+    } catch (std::exception &) {
+        stream.abort();
+        throw;
+    }
+}
+} // anonymous namespace
+
+/*
+ * returns a new ChunkStream storing a file in the GridFS userdata at index,
+ * compressed with codec
+ */
+ChunkStream* chunkstream_create(lua_State *L, int index, GridFSCodec codec, int window) {
+    GridFS *gridfs = *((GridFS **)luaL_checkudata(L, index, LUAMONGO_GRIDFS));
+
+    lua_getuservalue(L, index);
+    int env = lua_gettop(L);
+    lua_rawgeti(L, env, GRIDFS_CONNECTION);
+    DBClientBase *connection = userdata_to_dbclient(L, lua_gettop(L));
+    lua_rawgeti(L, env, GRIDFS_DBNAME);
+    lua_rawgeti(L, env, GRIDFS_PREFIX);
+    std::string dbname = lua_tostring(L, -2);
+    std::string prefix = lua_tostring(L, -1);
+    lua_settop(L, env - 1);
+
+    return new ChunkStream(connection, dbname, prefix, gridfs->getChunkSize(), window, codec);
+}
+
+/*
+ * returns a new ChunkStream for GridFileBuilder, or 0 when the GridFS
+ * userdata at index stores files without compression
+ */
+ChunkStream* chunkstream_compressed(lua_State *L, int index) {
+    GridFSCodec codec = gridfs_compression(L, index);
+
+    return codec == GRIDFS_CODEC_NONE ? 0 : chunkstream_create(L, index, codec, DEFAULT_WINDOW);
+}
+
+void chunkstream_append(ChunkStream *stream, const char *data, size_t len) {
+    try {
+        stream->append(data, len);
+    } catch (std::exception &) {
+        stream->abort();
+        throw;
+    }
+}
+
+BSONObj chunkstream_finish(ChunkStream *stream, const std::string &remote,
+                           const std::string &content_type) {
+    try {
+        return stream->finish(remote, content_type);
+    } catch (std::exception &) {
+        stream->abort();
+        throw;
+    }
+}
+
+/*
+ * removes the chunks of a stream neither finished nor aborted
+ */
+void chunkstream_abort(ChunkStream *stream) {
+    if (!stream->closed)
+        stream->abort();
+}
+
+void chunkstream_delete(ChunkStream *stream) {
+    delete stream;
+}
 
 GridFS* userdata_to_gridfs(lua_State* L, int index) {
     void *ud = 0;
@@ -24,28 +352,64 @@ GridFS* userdata_to_gridfs(lua_State* L, int index) {
 }
 
 /*
- * gridfs, err = mongo.GridFS.New(connection, dbname[, prefix])
+ * returns the connection of the GridFS userdata at index and the namespace
+ * of its chunks collection in chunks_ns
+ */
+DBClientBase* gridfs_connection(lua_State *L, int index, std::string &chunks_ns) {
+    lua_getuservalue(L, index);
+    lua_rawgeti(L, -1, GRIDFS_CONNECTION);
+    DBClientBase *connection = userdata_to_dbclient(L, lua_gettop(L));
+    lua_rawgeti(L, -2, GRIDFS_CHUNKS_NS);
+    chunks_ns = lua_tostring(L, -1);
+    lua_pop(L, 3);
+
+    return connection;
+}
+
+/*
+ * gridfs, err = mongo.GridFS.New(connection, dbname[, prefix[, options]])
+ *    accepts an optional table of options:
+ *       compression   "zlib" or "zstd" compresses every chunk of the files
+ *                     stored through this GridFS on its own, recording the
+ *                     codec in the files document (default = "none")
  */
 static int gridfs_new(lua_State *L) {
-    int n = lua_gettop(L);
     int resultcount = 1;
 
     try {
         DBClientBase *connection = userdata_to_dbclient(L, 1);
         const char *dbname = lua_tostring(L, 2);
+        const char *prefix = luaL_optstring(L, 3, "fs");
+
+        GridFSCodec codec = GRIDFS_CODEC_NONE;
+        if (!lua_isnoneornil(L, 4)) {
+            luaL_checktype(L, 4, LUA_TTABLE);
+            lua_getfield(L, 4, "compression");
+            if (!lua_isnil(L, -1))
+                codec = gridfs_codec(luaL_checkstring(L, -1));
+            lua_pop(L, 1);
+        }
 
         GridFS **gridfs = (GridFS **)lua_newuserdata(L, sizeof(GridFS *));
 
-        if (n >= 3) {
-            const char *prefix = luaL_checkstring(L, 3);
-
-            *gridfs = new GridFS(*connection, dbname, prefix);
-        } else {
-            *gridfs = new GridFS(*connection, dbname);
-        }
+        *gridfs = new GridFS(*connection, dbname, prefix);
 
         luaL_getmetatable(L, LUAMONGO_GRIDFS);
         lua_setmetatable(L, -2);
+
+        lua_createtable(L, 5, 0);
+        lua_pushvalue(L, 1);
+        lua_rawseti(L, -2, GRIDFS_CONNECTION);
+        lua_pushfstring(L, "%s.%s.chunks", dbname, prefix);
+        lua_rawseti(L, -2, GRIDFS_CHUNKS_NS);
+        lua_pushstring(L, dbname);
+        lua_rawseti(L, -2, GRIDFS_DBNAME);
+        lua_pushstring(L, prefix);
+        lua_rawseti(L, -2, GRIDFS_PREFIX);
+        lua_pushinteger(L, codec);
+        lua_rawseti(L, -2, GRIDFS_CODEC);
+        lua_setuservalue(L, -2);
+        connection_add_user(L, 1, -1);
     } catch (std::exception &e) {
         lua_pushnil(L);
         lua_pushfstring(L, LUAMONGO_ERR_GRIDFS_FAILED, e.what());
@@ -71,10 +435,10 @@ static int gridfs_find_file(lua_State *L) {
                 BSONObj obj;
                 lua_to_bson(L, 2, obj);
                 GridFile gridfile = gridfs->findFile(obj);
-                resultcount = gridfile_create(L, gridfile);
+                resultcount = gridfile_create(L, gridfile, 1);
             } else {
                 GridFile gridfile = gridfs->findFile(luaL_checkstring(L, 2));
-                resultcount = gridfile_create(L, gridfile);
+                resultcount = gridfile_create(L, gridfile, 1);
             }
 
         } catch (std::exception &e) {
@@ -98,7 +462,7 @@ static int gridfs_find_file_by_name(lua_State *L) {
     if (!lua_isnoneornil(L, 2)) {
 	try {
 	    GridFile gridfile = gridfs->findFileByName(luaL_checkstring(L, 2));
-	    resultcount = gridfile_create(L, gridfile);
+	    resultcount = gridfile_create(L, gridfile, 1);
 	    
         } catch (std::exception &e) {
             lua_pushnil(L);
@@ -121,26 +485,21 @@ static int gridfs_list(lua_State *L) {
     int type = lua_type(L, 2);
     if (type == LUA_TSTRING) {
         const char *jsonstr = luaL_checkstring(L, 2);
-        query = fromjson(jsonstr);
+        query = json_to_bson(jsonstr);
     } else if (type == LUA_TTABLE) {
         lua_to_bson(L, 2, query);
     }
     std::auto_ptr<DBClientCursor> autocursor = gridfs->list(query);
 
-    if (!autocursor.get()){
-        lua_pushnil(L);
-        lua_pushstring(L, LUAMONGO_ERR_CONNECTION_LOST);
-        return 2;
+    int resultcount = cursor_push(L, autocursor);
+    if (resultcount == 1) {
+        lua_getuservalue(L, 1);
+        lua_rawgeti(L, -1, GRIDFS_CONNECTION);
+        connection_add_user(L, -1, -3);
+        lua_pop(L, 2);
     }
 
-    DBClientCursor **cursor = (DBClientCursor **)lua_newuserdata(L, sizeof(DBClientCursor *));
-    *cursor = autocursor.get();
-    autocursor.release();
-
-    luaL_getmetatable(L, LUAMONGO_CURSOR);
-    lua_setmetatable(L, -2);
-
-    return 1;
+    return resultcount;
 }
 
 /*
@@ -178,7 +537,14 @@ static int gridfs_store_file(lua_State *L) {
     const char *content_type = luaL_optstring(L, 4, "");
 
     try {
-        BSONObj res = gridfs->storeFile(filename, remote, content_type);
+        BSONObj res;
+        GridFSCodec codec = gridfs_compression(L, 1);
+        if (codec == GRIDFS_CODEC_NONE) {
+            res = gridfs->storeFile(filename, remote, content_type);
+        } else {
+            std::auto_ptr<ChunkStream> stream(chunkstream_create(L, 1, codec, DEFAULT_WINDOW));
+            res = store_source(L, 2, 0, *stream, *remote ? remote : filename, content_type);
+        }
         bson_to_lua(L, res);
     } catch (std::exception &e) {
         lua_pushnil(L);
@@ -205,7 +571,14 @@ static int gridfs_store_data(lua_State *L) {
     const char *content_type = luaL_optstring(L, 4, "");
 
     try {
-        BSONObj res = gridfs->storeFile(data, length, remote, content_type);
+        BSONObj res;
+        GridFSCodec codec = gridfs_compression(L, 1);
+        if (codec == GRIDFS_CODEC_NONE) {
+            res = gridfs->storeFile(data, length, remote, content_type);
+        } else {
+            std::auto_ptr<ChunkStream> stream(chunkstream_create(L, 1, codec, DEFAULT_WINDOW));
+            res = store_buffer(*stream, data, length, remote, content_type);
+        }
         bson_to_lua(L, res);
     } catch (std::exception &e) {
         lua_pushnil(L);
@@ -216,6 +589,63 @@ static int gridfs_store_data(lua_State *L) {
     return resultcount;
 }
 
+/*
+ * bson, err = gridfs:store_stream(source[, remote_file[, options]])
+ *    source is a file name, an object with a read(n) method as Lua files
+ *    and mongo.GridFileReader have, or a function returning the next piece
+ *    of data and nil at the end. The data is stored chunk by chunk as it is
+ *    read, with options:
+ *       content_type
+ *       compression    "none", "zlib" or "zstd" (default = the compression
+ *                      of the GridFS)
+ *       window         chunk inserts sent before waiting for the server
+ *                      (default = 16), a larger window keeps more chunks in
+ *                      flight
+ */
+static int gridfs_store_stream(lua_State *L) {
+    userdata_to_gridfs(L, 1);
+    int type = lua_type(L, 2);
+    luaL_argcheck(L, type == LUA_TSTRING || type == LUA_TFUNCTION ||
+                  type == LUA_TTABLE || type == LUA_TUSERDATA, 2,
+                  "file name, file or function expected");
+    const char *remote = luaL_optstring(L, 3, type == LUA_TSTRING ? lua_tostring(L, 2) : "");
+
+    // arguments are checked before any C++ object exists, their errors
+    // would skip its destructor
+    const char *content_type = "";
+    const char *compression = 0;
+    int window = DEFAULT_WINDOW;
+    if (!lua_isnoneornil(L, 4)) {
+        luaL_checktype(L, 4, LUA_TTABLE);
+        lua_getfield(L, 4, "content_type");
+        content_type = luaL_optstring(L, -1, content_type);
+        lua_getfield(L, 4, "compression");
+        compression = luaL_optstring(L, -1, 0);
+        lua_getfield(L, 4, "window");
+        window = luaL_optint(L, -1, window);
+    }
+
+    int reader = 0;
+    if (type == LUA_TTABLE || type == LUA_TUSERDATA) {
+        lua_getfield(L, 2, "read");
+        luaL_argcheck(L, lua_isfunction(L, -1), 2, "object with a read method expected");
+        reader = lua_gettop(L);
+    }
+
+    try {
+        GridFSCodec codec = compression ? gridfs_codec(compression) : gridfs_compression(L, 1);
+        std::auto_ptr<ChunkStream> stream(chunkstream_create(L, 1, codec, window));
+        BSONObj res = store_source(L, 2, reader, *stream, remote, content_type);
+        bson_to_lua(L, res);
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_GRIDFS, "store_stream", e.what());
+        return 2;
+    }
+
+    return 1;
+}
+
 /*
  * __gc
  */
@@ -246,6 +676,7 @@ int mongo_gridfs_register(lua_State *L) {
         {"remove_file", gridfs_remove_file},
         {"store_file", gridfs_store_file},
         {"store_data", gridfs_store_data},
+        {"store_stream", gridfs_store_stream},
         {NULL, NULL}
     };
 
@@ -256,7 +687,7 @@ int mongo_gridfs_register(lua_State *L) {
 
     luaL_newmetatable(L, LUAMONGO_GRIDFS);
     //luaL_register(L, 0, gridfs_methods);
-    luaL_setfuncs(L, gridfs_methods, 0);
+    stats_setfuncs(L, gridfs_methods, "gridfs.", false);
     lua_pushvalue(L,-1);
     lua_setfield(L, -2, "__index");
 
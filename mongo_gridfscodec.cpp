@@ -0,0 +1,121 @@
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string.h>
+#include <zlib.h>
+#ifdef LUAMONGO_ZSTD
+#include <zstd.h>
+#endif
+#include <client/dbclient.h>
+#include <client/gridfs.h>
+#include "utils.h"
+#include "common.h"
+
+using namespace mongo;
+
+// Chunks of a compressed GridFS file hold chunkSize bytes of the file each,
+// compressed on their own so that any chunk can be read without the others.
+// The files document keeps the uncompressed length and md5 of the file, and
+// the codec in its "compression" field.
+
+namespace {
+const char *const codec_names[] = {"none", "zlib", "zstd", NULL};
+
+const int ZSTD_LEVEL = 3;
+} // anonymous namespace
+
+/*
+ * returns the codec called name, throwing when it is unknown or left out
+ * of the build
+ */
+GridFSCodec gridfs_codec(const char *name) {
+    for (int i = 0; codec_names[i]; ++i) {
+        if (strcmp(name, codec_names[i]) == 0) {
+#ifndef LUAMONGO_ZSTD
+            if (i == GRIDFS_CODEC_ZSTD)
+                break;
+#endif
+            return static_cast<GridFSCodec>(i);
+        }
+    }
+    throw std::runtime_error(std::string("unsupported compression: ") + name);
+}
+
+const char *gridfs_codec_name(GridFSCodec codec) {
+    return codec_names[codec];
+}
+
+/*
+ * codec of the chunks of a file, GRIDFS_CODEC_NONE for files stored
+ * without compression
+ */
+GridFSCodec gridfile_codec(const GridFile &gridfile) {
+    BSONElement compression = gridfile.getFileField("compression");
+    if (compression.eoo())
+        return GRIDFS_CODEC_NONE;
+    if (compression.type() != String)
+        throw std::runtime_error("invalid compression field");
+    return gridfs_codec(compression.valuestr());
+}
+
+/*
+ * replaces out with the compressed data
+ */
+void gridfs_compress(GridFSCodec codec, const char *data, size_t len, std::string &out) {
+    switch (codec) {
+    case GRIDFS_CODEC_ZLIB: {
+        uLongf size = compressBound(len);
+        out.resize(size);
+        if (compress2((Bytef *)&out[0], &size, (const Bytef *)data, len, Z_DEFAULT_COMPRESSION) != Z_OK)
+            throw std::runtime_error("zlib compression failed");
+        out.resize(size);
+        break;
+    }
+#ifdef LUAMONGO_ZSTD
+    case GRIDFS_CODEC_ZSTD: {
+        out.resize(ZSTD_compressBound(len));
+        size_t size = ZSTD_compress(&out[0], out.size(), data, len, ZSTD_LEVEL);
+        if (ZSTD_isError(size))
+            throw std::runtime_error(std::string("zstd compression failed: ") + ZSTD_getErrorName(size));
+        out.resize(size);
+        break;
+    }
+#endif
+    default:
+        out.assign(data, len);
+    }
+}
+
+/*
+ * returns the len bytes of the file held by chunk n, whose stored data is
+ * decompressed into out when the file is compressed. Throws when the chunk
+ * does not hold exactly len bytes
+ */
+const char *gridfs_decode_chunk(GridFSCodec codec, int n, const char *data, int stored,
+                                int len, std::string &out) {
+    bool ok = codec == GRIDFS_CODEC_NONE ? stored == len : stored > 0;
+
+    if (ok && codec == GRIDFS_CODEC_ZLIB) {
+        out.resize(len);
+        uLongf size = len;
+        ok = len > 0 && uncompress((Bytef *)&out[0], &size, (const Bytef *)data, stored) == Z_OK &&
+             size == static_cast<uLongf>(len);
+        data = out.data();
+    }
+#ifdef LUAMONGO_ZSTD
+    else if (ok && codec == GRIDFS_CODEC_ZSTD) {
+        out.resize(len);
+        size_t size = ZSTD_decompress(&out[0], len, data, stored);
+        ok = len > 0 && !ZSTD_isError(size) && size == static_cast<size_t>(len);
+        data = out.data();
+    }
+#endif
+
+    if (!ok) {
+        std::stringstream ss;
+        ss << "chunk " << n << " is missing or truncated";
+        throw std::runtime_error(ss.str());
+    }
+
+    return data;
+}
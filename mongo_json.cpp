@@ -0,0 +1,975 @@
+#include <iostream>
+#include <string>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <client/dbclient.h>
+#include "utils.h"
+#include "common.h"
+
+using namespace mongo;
+
+extern void push_bsontype_table(lua_State* L, mongo::BSONType bsontype);
+extern void objectid_create(lua_State *L, const void *data);
+extern void date_create(lua_State *L, long long ms);
+extern void lua_push_int64(lua_State *L, long long v);
+
+// Strict JSON parser behind mongo.fromjson and the JSON string arguments,
+// writing Lua tables or BSON directly. Anything it does not handle, from
+// the mongo shell syntax and the rarer Extended JSON types to invalid
+// input, makes it give up so that mongo::fromjson parses the text instead
+// and reports the errors as it always did.
+
+namespace {
+// nesting limit of the documents, as for BSON
+const int MAX_DEPTH = 100;
+
+// powers of ten exactly representable as doubles
+const double exact_powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+inline bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+inline int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+inline bool needs_escape(unsigned char c) {
+    return c == '"' || c == '\\' || c < 0x20;
+}
+
+/*
+ * the first quote, backslash or control character from p, or end; with
+ * SSE2 the characters are tested 16 at a time
+ */
+const char *scan_string(const char *p, const char *end) {
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1f);
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        __m128i special = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+            _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+        int mask = _mm_movemask_epi8(special);
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+#endif
+    while (p < end && !needs_escape(static_cast<unsigned char>(*p)))
+        ++p;
+    return p;
+}
+
+void append_utf8(std::string &out, unsigned int cp) {
+    if (cp < 0x80) {
+        out += static_cast<char>(cp);
+    } else if (cp < 0x800) {
+        out += static_cast<char>(0xc0 | (cp >> 6));
+        out += static_cast<char>(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        out += static_cast<char>(0xe0 | (cp >> 12));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (cp & 0x3f));
+    } else {
+        out += static_cast<char>(0xf0 | (cp >> 18));
+        out += static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (cp & 0x3f));
+    }
+}
+
+struct JsonNumber {
+    bool is_integer;
+    long long integer;
+    double number;
+};
+
+// Tokens of the JSON text. Strings without escapes point into the text,
+// the others are decoded into scratch, valid until the next string.
+class JsonScanner {
+public:
+    JsonScanner(const char *data, size_t len) : p(data), end(data + len) { }
+
+    void skip_ws() {
+        while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t'))
+            ++p;
+    }
+
+    char peek() {
+        skip_ws();
+        return p < end ? *p : '\0';
+    }
+
+    bool consume(char c) {
+        if (peek() != c)
+            return false;
+        ++p;
+        return true;
+    }
+
+    bool literal(const char *word, size_t len) {
+        if (static_cast<size_t>(end - p) < len || memcmp(p, word, len) != 0)
+            return false;
+        p += len;
+        return true;
+    }
+
+    bool at_end() {
+        skip_ws();
+        return p == end;
+    }
+
+    bool string(const char **str, size_t *len);
+    bool number(JsonNumber *n);
+
+    const char *p;
+    const char *end;
+    std::string scratch;
+
+private:
+    bool hex4(unsigned int *cp) {
+        if (end - p < 4)
+            return false;
+        *cp = 0;
+        for (int i = 0; i < 4; ++i) {
+            int v = hex_value(*p++);
+            if (v < 0)
+                return false;
+            *cp = (*cp << 4) | v;
+        }
+        return true;
+    }
+};
+
+bool JsonScanner::string(const char **str, size_t *len) {
+    if (peek() != '"')
+        return false;
+
+    const char *start = ++p;
+    p = scan_string(p, end);
+    if (p < end && *p == '"') {
+        *str = start;
+        *len = p++ - start;
+        return true;
+    }
+
+    scratch.assign(start, p - start);
+    while (p < end) {
+        char c = *p;
+        if (c == '"') {
+            ++p;
+            *str = scratch.data();
+            *len = scratch.size();
+            return true;
+        }
+        if (c != '\\') {
+            if (static_cast<unsigned char>(c) < 0x20)
+                return false;
+            const char *span = p;
+            p = scan_string(p, end);
+            scratch.append(span, p - span);
+            continue;
+        }
+
+        if (++p == end)
+            return false;
+        switch (*p++) {
+        case '"': scratch += '"'; break;
+        case '\\': scratch += '\\'; break;
+        case '/': scratch += '/'; break;
+        case 'b': scratch += '\b'; break;
+        case 'f': scratch += '\f'; break;
+        case 'n': scratch += '\n'; break;
+        case 'r': scratch += '\r'; break;
+        case 't': scratch += '\t'; break;
+        case 'u': {
+            unsigned int cp;
+            if (!hex4(&cp))
+                return false;
+            if (cp >= 0xd800 && cp < 0xdc00) {
+                // a surrogate pair
+                unsigned int low;
+                if (end - p < 2 || p[0] != '\\' || p[1] != 'u')
+                    return false;
+                p += 2;
+                if (!hex4(&low) || low < 0xdc00 || low > 0xdfff)
+                    return false;
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+            } else if (cp >= 0xdc00 && cp < 0xe000) {
+                return false;
+            }
+            append_utf8(scratch, cp);
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+    return false;
+}
+
+/*
+ * integers are read digit by digit and up to 15 significant digits with a
+ * small exponent need a single multiplication or division, which is
+ * exact; strtod reads the other doubles
+ */
+bool JsonScanner::number(JsonNumber *n) {
+    skip_ws();
+    const char *start = p;
+    bool negative = p < end && *p == '-';
+    if (negative)
+        ++p;
+    if (p == end || !is_digit(*p))
+        return false;
+    if (*p == '0' && p + 1 < end && is_digit(p[1]))
+        return false;
+
+    unsigned long long mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    for (; p < end && is_digit(*p); ++p, ++digits) {
+        if (digits < 19)
+            mantissa = mantissa * 10 + (*p - '0');
+    }
+
+    bool is_integer = true;
+    if (p < end && *p == '.') {
+        is_integer = false;
+        if (++p == end || !is_digit(*p))
+            return false;
+        for (; p < end && is_digit(*p); ++p, ++digits) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                --exponent;
+            }
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        is_integer = false;
+        ++p;
+        bool negative_exponent = p < end && *p == '-';
+        if (p < end && (*p == '-' || *p == '+'))
+            ++p;
+        if (p == end || !is_digit(*p))
+            return false;
+        int e = 0;
+        for (; p < end && is_digit(*p); ++p) {
+            if (e < 100000)
+                e = e * 10 + (*p - '0');
+        }
+        exponent += negative_exponent ? -e : e;
+    }
+
+    n->is_integer = is_integer;
+    if (is_integer) {
+        static const unsigned long long max_int64 = 9223372036854775807ULL;
+        if (digits > 19 || mantissa > max_int64 + (negative ? 1 : 0))
+            return false;
+        n->integer = negative ? static_cast<long long>(0 - mantissa) :
+            static_cast<long long>(mantissa);
+        return true;
+    }
+
+    if (digits <= 15 && exponent >= -22 && exponent <= 22) {
+        double v = static_cast<double>(mantissa);
+        if (exponent < 0)
+            v /= exact_powers_of_ten[-exponent];
+        else
+            v *= exact_powers_of_ten[exponent];
+        n->number = negative ? -v : v;
+    } else {
+        // the text of a Lua string is followed by a '\0'
+        n->number = strtod(start, NULL);
+    }
+    return true;
+}
+
+// the value of an Extended JSON object such as {"$oid": "..."}
+struct JsonExtended {
+    mongo::BSONType type;
+    long long integer; // NumberInt, NumberLong, Date, Timestamp, BinData subtype
+    double number; // NumberDouble
+    unsigned char oid[12];
+    std::string str; // RegEx pattern, Symbol, BinData bytes
+    std::string options; // RegEx options
+};
+
+// first keys of the Extended JSON objects, the ones marked Undefined are
+// left to mongo::fromjson
+const struct {
+    const char *key;
+    mongo::BSONType type;
+} extended_keys[] = {
+    {"$oid", mongo::jstOID},
+    {"$date", mongo::Date},
+    {"$numberLong", mongo::NumberLong},
+    {"$numberInt", mongo::NumberInt},
+    {"$numberDouble", mongo::NumberDouble},
+    {"$timestamp", mongo::Timestamp},
+    {"$regularExpression", mongo::RegEx},
+    {"$symbol", mongo::Symbol},
+    {"$binary", mongo::BinData},
+    {"$regex", mongo::Undefined},
+    {"$options", mongo::Undefined},
+    {"$type", mongo::Undefined},
+    {"$ref", mongo::Undefined},
+    {"$undefined", mongo::Undefined},
+    {"$minKey", mongo::Undefined},
+    {"$maxKey", mongo::Undefined},
+    {"$numberDecimal", mongo::Undefined},
+    {"$code", mongo::Undefined},
+    {"$dbPointer", mongo::Undefined},
+};
+
+/*
+ * the type of the Extended JSON object starting with key, EOO when it is
+ * a regular object
+ */
+mongo::BSONType extended_type(const char *key, size_t len) {
+    if (len < 2 || key[0] != '$')
+        return mongo::EOO;
+    for (size_t i = 0; i < sizeof(extended_keys) / sizeof(extended_keys[0]); ++i) {
+        if (strlen(extended_keys[i].key) == len && memcmp(extended_keys[i].key, key, len) == 0)
+            return extended_keys[i].type;
+    }
+    return mongo::EOO;
+}
+
+bool parse_int64(const char *str, size_t len, long long *v) {
+    JsonScanner s(str, len);
+    JsonNumber n;
+    if (!s.number(&n) || !n.is_integer || !s.at_end())
+        return false;
+    *v = n.integer;
+    return true;
+}
+
+// days since 1970-01-01 of a date of the proleptic Gregorian calendar
+long long days_from_civil(long long y, unsigned int m, unsigned int d) {
+    y -= m <= 2;
+    long long era = (y >= 0 ? y : y - 399) / 400;
+    unsigned int yoe = static_cast<unsigned int>(y - era * 400);
+    unsigned int doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    unsigned int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + static_cast<long long>(doe) - 719468;
+}
+
+bool read_digits(const char *&p, const char *end, int n, int *v) {
+    *v = 0;
+    for (int i = 0; i < n; ++i, ++p) {
+        if (p == end || !is_digit(*p))
+            return false;
+        *v = *v * 10 + (*p - '0');
+    }
+    return true;
+}
+
+/*
+ * YYYY-MM-DDTHH:MM:SS[.fff](Z|+HH:MM|-HH:MM|+HHMM|-HHMM)
+ */
+bool parse_iso_date(const char *p, size_t len, long long *ms) {
+    const char *end = p + len;
+    int year, month, day, hour, minute, second;
+    if (!read_digits(p, end, 4, &year) || p == end || *p++ != '-' ||
+        !read_digits(p, end, 2, &month) || p == end || *p++ != '-' ||
+        !read_digits(p, end, 2, &day) || p == end || *p++ != 'T' ||
+        !read_digits(p, end, 2, &hour) || p == end || *p++ != ':' ||
+        !read_digits(p, end, 2, &minute) || p == end || *p++ != ':' ||
+        !read_digits(p, end, 2, &second))
+        return false;
+    if (month < 1 || month > 12 || day < 1 || day > 31 ||
+        hour > 23 || minute > 59 || second > 60)
+        return false;
+
+    int millis = 0;
+    if (p < end && *p == '.') {
+        int scale = 100;
+        for (++p; p < end && is_digit(*p); ++p, scale /= 10)
+            millis += (*p - '0') * scale;
+    }
+
+    int offset = 0; // minutes
+    if (p < end && *p == 'Z') {
+        ++p;
+    } else if (p < end && (*p == '+' || *p == '-')) {
+        int sign = *p++ == '-' ? -1 : 1;
+        int zone_hours, zone_minutes;
+        if (!read_digits(p, end, 2, &zone_hours))
+            return false;
+        if (p < end && *p == ':')
+            ++p;
+        if (!read_digits(p, end, 2, &zone_minutes))
+            return false;
+        offset = sign * (zone_hours * 60 + zone_minutes);
+    } else {
+        return false;
+    }
+    if (p != end)
+        return false;
+
+    long long seconds = days_from_civil(year, month, day) * 86400 +
+        hour * 3600 + minute * 60 + second - offset * 60;
+    *ms = seconds * 1000 + millis;
+    return true;
+}
+
+bool parse_base64(const std::string &in, std::string *out) {
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    if (in.size() % 4)
+        return false;
+
+    out->clear();
+    unsigned int bits = 0;
+    int nbits = 0;
+    for (size_t i = 0; i < in.size(); ++i) {
+        if (in[i] == '=') {
+            // padding, only at the end
+            if (i + 2 < in.size() || (i + 1 < in.size() && in[i + 1] != '='))
+                return false;
+            break;
+        }
+        const char *c = strchr(alphabet, in[i]);
+        if (c == NULL || in[i] == '\0')
+            return false;
+        bits = (bits << 6) | static_cast<unsigned int>(c - alphabet);
+        nbits += 6;
+        if (nbits >= 8) {
+            nbits -= 8;
+            *out += static_cast<char>((bits >> nbits) & 0xff);
+        }
+    }
+    return true;
+}
+
+/*
+ * reads {"<names[0]>": v, "<names[1]>": v} in any order, string values
+ * into str, or integer values into num when numbers is true
+ */
+bool parse_members(JsonScanner &s, const char *const names[2], bool numbers,
+                   std::string str[2], long long num[2]) {
+    if (!s.consume('{'))
+        return false;
+
+    bool seen[2] = { false, false };
+    do {
+        const char *key;
+        size_t len;
+        if (!s.string(&key, &len) || !s.consume(':'))
+            return false;
+        int i = -1;
+        for (int j = 0; j < 2; ++j) {
+            if (strlen(names[j]) == len && memcmp(names[j], key, len) == 0)
+                i = j;
+        }
+        if (i < 0 || seen[i])
+            return false;
+        seen[i] = true;
+
+        if (numbers) {
+            JsonNumber n;
+            if (!s.number(&n) || !n.is_integer)
+                return false;
+            num[i] = n.integer;
+        } else {
+            const char *value;
+            size_t value_len;
+            if (!s.string(&value, &value_len))
+                return false;
+            str[i].assign(value, value_len);
+        }
+    } while (s.consume(','));
+
+    return seen[0] && seen[1] && s.consume('}');
+}
+
+/*
+ * reads the value of an Extended JSON object of the given type, whose
+ * first key and ':' were read, up to its closing brace
+ */
+bool parse_extended(JsonScanner &s, mongo::BSONType type, JsonExtended *ext) {
+    const char *str;
+    size_t len;
+
+    ext->type = type;
+    switch (type) {
+    case mongo::jstOID:
+        if (!s.string(&str, &len) || len != 24)
+            return false;
+        for (int i = 0; i < 12; ++i) {
+            int hi = hex_value(str[2*i]), lo = hex_value(str[2*i+1]);
+            if (hi < 0 || lo < 0)
+                return false;
+            ext->oid[i] = static_cast<unsigned char>((hi << 4) | lo);
+        }
+        break;
+    case mongo::Date:
+        if (s.peek() == '"') {
+            if (!s.string(&str, &len) || !parse_iso_date(str, len, &ext->integer))
+                return false;
+        } else if (s.consume('{')) {
+            if (!s.string(&str, &len) || extended_type(str, len) != mongo::NumberLong ||
+                !s.consume(':') || !s.string(&str, &len) ||
+                !parse_int64(str, len, &ext->integer) || !s.consume('}'))
+                return false;
+        } else {
+            JsonNumber n;
+            if (!s.number(&n))
+                return false;
+            ext->integer = n.is_integer ? n.integer : static_cast<long long>(n.number);
+        }
+        break;
+    case mongo::NumberLong:
+        if (!s.string(&str, &len) || !parse_int64(str, len, &ext->integer))
+            return false;
+        break;
+    case mongo::NumberInt:
+        if (!s.string(&str, &len) || !parse_int64(str, len, &ext->integer) ||
+            ext->integer < INT_MIN || ext->integer > INT_MAX)
+            return false;
+        break;
+    case mongo::NumberDouble: {
+        if (!s.string(&str, &len))
+            return false;
+        ext->str.assign(str, len);
+        if (ext->str == "Infinity" || ext->str == "-Infinity" || ext->str == "NaN") {
+            ext->number = strtod(ext->str.c_str(), NULL);
+        } else {
+            JsonScanner number(ext->str.c_str(), ext->str.size());
+            JsonNumber n;
+            if (!number.number(&n) || !number.at_end())
+                return false;
+            ext->number = n.is_integer ? static_cast<double>(n.integer) : n.number;
+        }
+        break;
+    }
+    case mongo::Timestamp: {
+        static const char *const names[2] = {"t", "i"};
+        long long num[2];
+        if (!parse_members(s, names, true, NULL, num) ||
+            num[0] < 0 || num[0] > UINT_MAX || num[1] < 0 || num[1] > UINT_MAX)
+            return false;
+        ext->integer = static_cast<long long>(
+            (static_cast<unsigned long long>(num[0]) << 32) | static_cast<unsigned long long>(num[1]));
+        break;
+    }
+    case mongo::RegEx: {
+        static const char *const names[2] = {"pattern", "options"};
+        std::string parts[2];
+        if (!parse_members(s, names, false, parts, NULL))
+            return false;
+        ext->str = parts[0];
+        ext->options = parts[1];
+        break;
+    }
+    case mongo::Symbol:
+        if (!s.string(&str, &len))
+            return false;
+        ext->str.assign(str, len);
+        break;
+    case mongo::BinData: {
+        // {"$binary": {"base64": ..., "subType": ...}} or the legacy
+        // {"$binary": ..., "$type": ...}
+        std::string parts[2];
+        if (s.peek() == '{') {
+            static const char *const names[2] = {"base64", "subType"};
+            if (!parse_members(s, names, false, parts, NULL))
+                return false;
+        } else {
+            if (!s.string(&str, &len))
+                return false;
+            parts[0].assign(str, len);
+            if (!s.consume(',') || !s.string(&str, &len) || len != 5 ||
+                memcmp(str, "$type", 5) != 0 || !s.consume(':') || !s.string(&str, &len))
+                return false;
+            parts[1].assign(str, len);
+        }
+        if (parts[1].empty() || parts[1].size() > 2 || !parse_base64(parts[0], &ext->str))
+            return false;
+        ext->integer = 0;
+        for (size_t i = 0; i < parts[1].size(); ++i) {
+            int v = hex_value(parts[1][i]);
+            if (v < 0)
+                return false;
+            ext->integer = ext->integer * 16 + v;
+        }
+        break;
+    }
+    default:
+        return false;
+    }
+
+    return s.consume('}');
+}
+
+/*
+ * Lua tables, with the values bson_to_lua gives to the document that
+ * mongo::fromjson would have built
+ */
+void push_extended(lua_State *L, const JsonExtended &ext) {
+    switch (ext.type) {
+    case mongo::jstOID:
+        objectid_create(L, ext.oid);
+        break;
+    case mongo::Date:
+        date_create(L, ext.integer);
+        break;
+    case mongo::NumberLong:
+        lua_push_int64(L, ext.integer);
+        break;
+    case mongo::NumberInt:
+        lua_pushinteger(L, static_cast<int>(ext.integer));
+        break;
+    case mongo::NumberDouble:
+        lua_pushnumber(L, ext.number);
+        break;
+    case mongo::Timestamp: {
+        unsigned long long t = static_cast<unsigned long long>(ext.integer);
+        push_bsontype_table(L, mongo::Date);
+        lua_pushnumber(L, static_cast<double>((t >> 32) + (t & 0xffffffffULL)));
+        lua_rawseti(L, -2, 1);
+        break;
+    }
+    case mongo::RegEx:
+        push_bsontype_table(L, mongo::RegEx);
+        lua_pushlstring(L, ext.str.data(), ext.str.size());
+        lua_rawseti(L, -2, 1);
+        lua_pushlstring(L, ext.options.data(), ext.options.size());
+        lua_rawseti(L, -2, 2);
+        break;
+    default: // Symbol, BinData
+        push_bsontype_table(L, ext.type);
+        lua_pushlstring(L, ext.str.data(), ext.str.size());
+        lua_rawseti(L, -2, 1);
+        break;
+    }
+}
+
+void push_number(lua_State *L, const JsonNumber &n) {
+    if (!n.is_integer)
+        lua_pushnumber(L, n.number);
+    else if (n.integer >= INT_MIN && n.integer <= INT_MAX)
+        lua_pushinteger(L, static_cast<int>(n.integer));
+    else
+        lua_push_int64(L, n.integer);
+}
+
+bool lua_parse_value(lua_State *L, JsonScanner &s, int depth);
+
+// an object whose '{' was read
+bool lua_parse_object(lua_State *L, JsonScanner &s, int depth) {
+    if (depth > MAX_DEPTH || !lua_checkstack(L, 4))
+        return false;
+
+    lua_newtable(L);
+    if (s.consume('}'))
+        return true;
+
+    bool first = true;
+    do {
+        const char *key;
+        size_t len;
+        if (!s.string(&key, &len) || !s.consume(':'))
+            return false;
+        if (first) {
+            mongo::BSONType type = extended_type(key, len);
+            if (type == mongo::Undefined || (type != mongo::EOO && depth == 1))
+                return false;
+            if (type != mongo::EOO) {
+                JsonExtended ext;
+                if (!parse_extended(s, type, &ext))
+                    return false;
+                lua_pop(L, 1);
+                push_extended(L, ext);
+                return true;
+            }
+            first = false;
+        }
+
+        lua_pushlstring(L, key, len);
+        if (!lua_parse_value(L, s, depth))
+            return false;
+        lua_rawset(L, -3);
+    } while (s.consume(','));
+
+    return s.consume('}');
+}
+
+bool lua_parse_array(lua_State *L, JsonScanner &s, int depth) {
+    if (depth > MAX_DEPTH || !lua_checkstack(L, 4))
+        return false;
+
+    lua_newtable(L);
+    if (s.consume(']'))
+        return true;
+
+    int i = 0;
+    do {
+        if (!lua_parse_value(L, s, depth))
+            return false;
+        lua_rawseti(L, -2, ++i);
+    } while (s.consume(','));
+
+    return s.consume(']');
+}
+
+bool lua_parse_value(lua_State *L, JsonScanner &s, int depth) {
+    switch (s.peek()) {
+    case '{':
+        ++s.p;
+        return lua_parse_object(L, s, depth + 1);
+    case '[':
+        ++s.p;
+        return lua_parse_array(L, s, depth + 1);
+    case '"': {
+        const char *str;
+        size_t len;
+        if (!s.string(&str, &len))
+            return false;
+        lua_pushlstring(L, str, len);
+        return true;
+    }
+    case 't':
+        if (!s.literal("true", 4))
+            return false;
+        lua_pushboolean(L, 1);
+        return true;
+    case 'f':
+        if (!s.literal("false", 5))
+            return false;
+        lua_pushboolean(L, 0);
+        return true;
+    case 'n':
+        if (!s.literal("null", 4))
+            return false;
+        push_bsontype_table(L, mongo::jstNULL);
+        return true;
+    }
+
+    JsonNumber n;
+    if (!s.number(&n))
+        return false;
+    push_number(L, n);
+    return true;
+}
+
+void append_extended(BSONObjBuilder &b, const StringData &key, const JsonExtended &ext) {
+    switch (ext.type) {
+    case mongo::jstOID:
+        b.append(key, OID::from(ext.oid));
+        break;
+    case mongo::Date:
+        b.appendDate(key, Date_t(static_cast<unsigned long long>(ext.integer)));
+        break;
+    case mongo::NumberLong:
+        b.append(key, ext.integer);
+        break;
+    case mongo::NumberInt:
+        b.append(key, static_cast<int>(ext.integer));
+        break;
+    case mongo::NumberDouble:
+        b.append(key, ext.number);
+        break;
+    case mongo::Timestamp:
+        b.appendTimestamp(key, static_cast<unsigned long long>(ext.integer));
+        break;
+    case mongo::RegEx:
+        b.appendRegex(key, ext.str, ext.options);
+        break;
+    case mongo::Symbol:
+        b.appendSymbol(key, ext.str);
+        break;
+    default: // BinData
+        b.appendBinData(key, static_cast<int>(ext.str.size()),
+                        static_cast<BinDataType>(ext.integer), ext.str.data());
+        break;
+    }
+}
+
+bool bson_parse_value(JsonScanner &s, BSONObjBuilder &b, const StringData &key, int depth);
+
+/*
+ * the members of an object whose '{', first key and ':' were read
+ */
+bool bson_parse_members(JsonScanner &s, BSONObjBuilder &b, const char *key, size_t len, int depth) {
+    std::string owned;
+    for (;;) {
+        // the value may need the scratch buffer holding the key
+        if (key == s.scratch.data()) {
+            owned.assign(key, len);
+            key = owned.data();
+        }
+        if (memchr(key, '\0', len) != NULL)
+            return false;
+        if (!bson_parse_value(s, b, StringData(key, len), depth))
+            return false;
+        if (!s.consume(','))
+            break;
+        if (!s.string(&key, &len) || !s.consume(':'))
+            return false;
+    }
+    return s.consume('}');
+}
+
+bool bson_parse_value(JsonScanner &s, BSONObjBuilder &b, const StringData &key, int depth) {
+    switch (s.peek()) {
+    case '{': {
+        ++s.p;
+        if (depth >= MAX_DEPTH)
+            return false;
+        if (s.consume('}')) {
+            BSONObjBuilder sub(b.subobjStart(key));
+            sub.done();
+            return true;
+        }
+
+        const char *first;
+        size_t len;
+        if (!s.string(&first, &len) || !s.consume(':'))
+            return false;
+        mongo::BSONType type = extended_type(first, len);
+        if (type == mongo::Undefined)
+            return false;
+        if (type != mongo::EOO) {
+            JsonExtended ext;
+            if (!parse_extended(s, type, &ext))
+                return false;
+            append_extended(b, key, ext);
+            return true;
+        }
+
+        BSONObjBuilder sub(b.subobjStart(key));
+        if (!bson_parse_members(s, sub, first, len, depth + 1))
+            return false;
+        sub.done();
+        return true;
+    }
+    case '[': {
+        ++s.p;
+        if (depth >= MAX_DEPTH)
+            return false;
+        BSONObjBuilder sub(b.subarrayStart(key));
+        if (!s.consume(']')) {
+            char buf[16];
+            int i = 0;
+            do {
+                snprintf(buf, sizeof(buf), "%d", i++);
+                if (!bson_parse_value(s, sub, StringData(buf), depth + 1))
+                    return false;
+            } while (s.consume(','));
+            if (!s.consume(']'))
+                return false;
+        }
+        sub.done();
+        return true;
+    }
+    case '"': {
+        const char *str;
+        size_t len;
+        if (!s.string(&str, &len))
+            return false;
+        b.append(key, StringData(str, len));
+        return true;
+    }
+    case 't':
+        if (!s.literal("true", 4))
+            return false;
+        b.appendBool(key, true);
+        return true;
+    case 'f':
+        if (!s.literal("false", 5))
+            return false;
+        b.appendBool(key, false);
+        return true;
+    case 'n':
+        if (!s.literal("null", 4))
+            return false;
+        b.appendNull(key);
+        return true;
+    }
+
+    JsonNumber n;
+    if (!s.number(&n))
+        return false;
+    if (!n.is_integer)
+        b.append(key, n.number);
+    else if (n.integer >= INT_MIN && n.integer <= INT_MAX)
+        b.append(key, static_cast<int>(n.integer));
+    else
+        b.append(key, n.integer);
+    return true;
+}
+} // anonymous namespace
+
+/*
+ * pushes the Lua table of the JSON object in data, or nil when the object
+ * is empty as bson_to_lua does; false, with nothing pushed, when the text
+ * is not handled. data must be followed by a '\0', as Lua strings are.
+ */
+bool json_to_lua(lua_State *L, const char *data, size_t len) {
+    int top = lua_gettop(L);
+    JsonScanner s(data, len);
+
+    if (s.consume('{') && lua_parse_object(L, s, 1) && s.at_end()) {
+        lua_pushnil(L);
+        if (lua_next(L, -2)) {
+            lua_pop(L, 2);
+        } else {
+            lua_pop(L, 1);
+            lua_pushnil(L);
+        }
+        return true;
+    }
+
+    lua_settop(L, top);
+    return false;
+}
+
+/*
+ * the BSON document of the JSON object in data, false when the text is
+ * not handled. data must be followed by a '\0', as Lua strings are.
+ */
+bool json_to_bson(const char *data, size_t len, BSONObj &obj) {
+    JsonScanner s(data, len);
+    if (!s.consume('{'))
+        return false;
+
+    BSONObjBuilder builder;
+    if (!s.consume('}')) {
+        const char *key;
+        size_t key_len;
+        if (!s.string(&key, &key_len) || !s.consume(':') ||
+            extended_type(key, key_len) != mongo::EOO ||
+            !bson_parse_members(s, builder, key, key_len, 1))
+            return false;
+    }
+    if (!s.at_end())
+        return false;
+
+    obj = builder.obj();
+    return true;
+}
+
+/*
+ * replaces mongo::fromjson, which still parses what json_to_bson does not
+ * handle and throws the same errors
+ */
+BSONObj json_to_bson(const char *json) {
+    BSONObj obj;
+    if (!json_to_bson(json, strlen(json), obj))
+        obj = fromjson(json);
+    return obj;
+}
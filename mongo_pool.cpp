@@ -0,0 +1,419 @@
+#include <iostream>
+#include <vector>
+#include <stdexcept>
+#include <sys/time.h>
+#include <client/dbclient.h>
+#include "utils.h"
+#include "common.h"
+
+using namespace mongo;
+
+extern DBClientConnection* connection_create(lua_State *L, bool auto_reconnect, double rw_timeout);
+
+// A pool keeps its connections as regular Connection userdata inside its
+// uservalue table: idle connections in the array part (the most recently
+// released last) and checked out connections as keys of the "busy" table.
+struct ConnectionPool {
+    std::string host;
+    std::string dbname;
+    std::string username;
+    std::string password;
+    bool digest_password;
+    bool auto_reconnect;
+    double rw_timeout;
+    int min_size;    // connections kept open when evicting idle ones
+    int max_size;
+    double max_idle; // seconds, 0 = idle connections are never evicted
+
+    int size;        // open connections, idle or checked out
+    int in_use;
+    std::vector<double> idle_since; // parallel to the idle array
+
+    // counters
+    int peak_in_use;
+    double acquired;
+    double created;
+    double evicted;
+    double wait_time;
+
+    ConnectionPool()
+        : digest_password(true), auto_reconnect(false), rw_timeout(0),
+          min_size(1), max_size(1), max_idle(0), size(0), in_use(0),
+          peak_in_use(0), acquired(0), created(0), evicted(0), wait_time(0) { }
+};
+
+namespace {
+inline ConnectionPool* userdata_to_pool(lua_State* L, int index) {
+    void *ud = luaL_checkudata(L, index, LUAMONGO_POOL);
+    ConnectionPool *pool = *((ConnectionPool **)ud);
+    return pool;
+}
+
+double now() {
+    struct timeval wop;
+    gettimeofday(&wop, 0);
+    return static_cast<double>(wop.tv_sec) +
+        static_cast<double>(wop.tv_usec)*1e-6;
+}
+
+/*
+ * pushes a new connection, connected and authenticated, throws on failure
+ */
+void pool_connect(lua_State *L, ConnectionPool *pool) {
+    DBClientConnection *connection = connection_create(L, pool->auto_reconnect,
+                                                       pool->rw_timeout);
+    connection->connect(pool->host);
+
+    if (!pool->username.empty()) {
+        std::string errmsg;
+        if (!connection->auth(pool->dbname, pool->username, pool->password,
+                              errmsg, pool->digest_password)) {
+            throw std::runtime_error(errmsg);
+        }
+    }
+}
+
+/*
+ * removes the idle connection at position i (1-based) of the idle array
+ */
+void pool_remove_idle(lua_State *L, ConnectionPool *pool, int env, int i) {
+    int n = pool->idle_since.size();
+    pool->idle_since.erase(pool->idle_since.begin() + (i - 1));
+    for (; i < n; ++i) {
+        lua_rawgeti(L, env, i + 1);
+        lua_rawseti(L, env, i);
+    }
+    lua_pushnil(L);
+    lua_rawseti(L, env, n);
+}
+
+/*
+ * closes idle connections above min_size which are older than max_idle,
+ * and with check set all the idle connections which are failed
+ */
+int pool_evict(lua_State *L, ConnectionPool *pool, int env, bool check) {
+    int evicted = 0;
+    double t = now();
+
+    for (size_t i = 0; i < pool->idle_since.size(); ) {
+        bool evict = pool->max_idle > 0 && pool->size > pool->min_size &&
+            t - pool->idle_since[i] > pool->max_idle;
+        if (!evict && check) {
+            lua_rawgeti(L, env, i + 1);
+            DBClientConnection *connection = *((DBClientConnection **)lua_touserdata(L, -1));
+            evict = connection->isFailed();
+            lua_pop(L, 1);
+        }
+        if (evict) {
+            pool_remove_idle(L, pool, env, i + 1);
+            --pool->size;
+            ++evicted;
+        } else {
+            ++i;
+        }
+    }
+
+    pool->evicted += evicted;
+    return evicted;
+}
+
+/*
+ * returns a checked out connection to the idle array, or closes it when it
+ * is failed; false when the connection is not checked out from this pool
+ */
+bool pool_checkin(lua_State *L, ConnectionPool *pool, int env, int connidx) {
+    lua_getfield(L, env, "busy");
+    lua_pushvalue(L, connidx);
+    lua_rawget(L, -2);
+    bool busy = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    if (!busy) {
+        lua_pop(L, 1);
+        return false;
+    }
+    lua_pushvalue(L, connidx);
+    lua_pushnil(L);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+
+    --pool->in_use;
+
+    DBClientConnection *connection = *((DBClientConnection **)lua_touserdata(L, connidx));
+    if (connection->isFailed()) {
+        --pool->size;
+        ++pool->evicted;
+    } else {
+        pool->idle_since.push_back(now());
+        lua_pushvalue(L, connidx);
+        lua_rawseti(L, env, pool->idle_since.size());
+    }
+
+    pool_evict(L, pool, env, false);
+    return true;
+}
+} // anonymous namespace
+
+/*
+ * pool,err = mongo.Pool.New(connection_str[, {}])
+ *    accepts an optional table of features:
+ *       size             connections opened at creation and kept open (default = 1)
+ *       max              maximum number of connections (default = size)
+ *       max_idle         seconds before closing an idle connection above size
+ *                        (default = 0, never)
+ *       auto_reconnect   (default = false)
+ *       rw_timeout       (default = 0)
+ *       dbname, username, password, digestPassword
+ *                        when username is given every connection is
+ *                        authenticated as in db:auth
+ */
+static int pool_new(lua_State *L) {
+    const char *host = luaL_checkstring(L, 1);
+
+    ConnectionPool **ud = (ConnectionPool **)lua_newuserdata(L, sizeof(ConnectionPool *));
+    ConnectionPool *pool = *ud = new ConnectionPool();
+    luaL_getmetatable(L, LUAMONGO_POOL);
+    lua_setmetatable(L, -2);
+
+    pool->host = host;
+    if (lua_type(L, 2) == LUA_TTABLE) {
+        lua_getfield(L, 2, "size");
+        pool->min_size = luaL_optint(L, -1, 1);
+        lua_getfield(L, 2, "max");
+        pool->max_size = luaL_optint(L, -1, pool->min_size);
+        lua_getfield(L, 2, "max_idle");
+        pool->max_idle = luaL_optnumber(L, -1, 0);
+        lua_getfield(L, 2, "auto_reconnect");
+        pool->auto_reconnect = lua_toboolean(L, -1);
+        lua_getfield(L, 2, "rw_timeout");
+        pool->rw_timeout = luaL_optnumber(L, -1, 0);
+        lua_getfield(L, 2, "dbname");
+        pool->dbname = luaL_optstring(L, -1, "");
+        lua_getfield(L, 2, "username");
+        pool->username = luaL_optstring(L, -1, "");
+        lua_getfield(L, 2, "password");
+        pool->password = luaL_optstring(L, -1, "");
+        lua_getfield(L, 2, "digestPassword");
+        pool->digest_password = lua_isnil(L, -1) ? true : lua_toboolean(L, -1);
+        lua_pop(L, 9);
+    }
+    if (pool->max_size < pool->min_size) pool->max_size = pool->min_size;
+
+    lua_newtable(L);
+    int env = lua_gettop(L);
+    lua_newtable(L);
+    lua_setfield(L, env, "busy");
+
+    try {
+        while (pool->size < pool->min_size) {
+            pool_connect(L, pool);
+            pool->idle_since.push_back(now());
+            lua_rawseti(L, env, pool->idle_since.size());
+            ++pool->size;
+            ++pool->created;
+        }
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CONNECT_FAILED, host, e.what());
+        return 2;
+    }
+
+    lua_setuservalue(L, -2);
+    return 1;
+}
+
+/*
+ * db,err = pool:acquire()
+ *    checks out an idle connection, failed ones are closed on the way, or
+ *    opens a new one while the pool is below its maximum size
+ */
+static int pool_acquire(lua_State *L) {
+    ConnectionPool *pool = userdata_to_pool(L, 1);
+    double t0 = now();
+
+    lua_getuservalue(L, 1);
+    int env = lua_gettop(L);
+    pool_evict(L, pool, env, false);
+
+    bool found = false;
+    while (!found && !pool->idle_since.empty()) {
+        int n = pool->idle_since.size();
+        lua_rawgeti(L, env, n);
+        lua_pushnil(L);
+        lua_rawseti(L, env, n);
+        pool->idle_since.pop_back();
+
+        DBClientConnection *connection = *((DBClientConnection **)lua_touserdata(L, -1));
+        found = !connection->isFailed();
+        if (!found) {
+            lua_pop(L, 1);
+            --pool->size;
+            ++pool->evicted;
+        }
+    }
+
+    if (!found) {
+        if (pool->size >= pool->max_size) {
+            lua_pushnil(L);
+            lua_pushfstring(L, LUAMONGO_ERR_POOL_EXHAUSTED, pool->in_use);
+            return 2;
+        }
+        try {
+            pool_connect(L, pool);
+        } catch (std::exception &e) {
+            lua_pushnil(L);
+            lua_pushfstring(L, LUAMONGO_ERR_CONNECT_FAILED, pool->host.c_str(), e.what());
+            return 2;
+        }
+        ++pool->size;
+        ++pool->created;
+    }
+
+    lua_getfield(L, env, "busy");
+    lua_pushvalue(L, -2);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    lua_remove(L, env);
+
+    ++pool->acquired;
+    if (++pool->in_use > pool->peak_in_use) pool->peak_in_use = pool->in_use;
+    pool->wait_time += now() - t0;
+
+    return 1;
+}
+
+/*
+ * ok,err = pool:release(db)
+ */
+static int pool_release(lua_State *L) {
+    ConnectionPool *pool = userdata_to_pool(L, 1);
+    luaL_checkudata(L, 2, LUAMONGO_CONNECTION);
+
+    lua_getuservalue(L, 1);
+    if (!pool_checkin(L, pool, lua_gettop(L), 2)) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_POOL, "release",
+                        "connection is not checked out from this pool");
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * ... = pool:with(function(db) ... end)
+ *    calls the function with an acquired connection and releases it
+ *    afterwards, also when the function raises an error. Returns the
+ *    results of the function, or nil,err when no connection is available.
+ */
+static int pool_with(lua_State *L) {
+    ConnectionPool *pool = userdata_to_pool(L, 1);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_settop(L, 2);
+
+    if (pool_acquire(L) != 1) return 2;
+
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 3);
+    int status = lua_pcall(L, 1, LUA_MULTRET, 0);
+
+    lua_getuservalue(L, 1);
+    pool_checkin(L, pool, lua_gettop(L), 3);
+    lua_pop(L, 1);
+
+    if (status != 0) return lua_error(L);
+
+    return lua_gettop(L) - 3;
+}
+
+/*
+ * num_evicted = pool:check()
+ *    closes failed idle connections and the ones idle for too long
+ */
+static int pool_check(lua_State *L) {
+    ConnectionPool *pool = userdata_to_pool(L, 1);
+
+    lua_getuservalue(L, 1);
+    lua_pushinteger(L, pool_evict(L, pool, lua_gettop(L), true));
+
+    return 1;
+}
+
+/*
+ * stats_table = pool:stats()
+ */
+static int pool_stats(lua_State *L) {
+    ConnectionPool *pool = userdata_to_pool(L, 1);
+
+    lua_createtable(L, 0, 10);
+    LUA_PUSH_ATTRIB_INT("size", pool->size);
+    LUA_PUSH_ATTRIB_INT("idle", pool->idle_since.size());
+    LUA_PUSH_ATTRIB_INT("in_use", pool->in_use);
+    LUA_PUSH_ATTRIB_INT("max", pool->max_size);
+    LUA_PUSH_ATTRIB_INT("peak_in_use", pool->peak_in_use);
+    LUA_PUSH_ATTRIB_FLOAT("acquired", pool->acquired);
+    LUA_PUSH_ATTRIB_FLOAT("created", pool->created);
+    LUA_PUSH_ATTRIB_FLOAT("evicted", pool->evicted);
+    LUA_PUSH_ATTRIB_FLOAT("wait_time", pool->wait_time);
+    LUA_PUSH_ATTRIB_FLOAT("utilisation",
+                          static_cast<double>(pool->in_use)/pool->max_size);
+
+    return 1;
+}
+
+/*
+ * __gc
+ */
+static int pool_gc(lua_State *L) {
+    ConnectionPool *pool = userdata_to_pool(L, 1);
+    delete pool;
+    return 0;
+}
+
+/*
+ * __tostring
+ */
+static int pool_tostring(lua_State *L) {
+    ConnectionPool *pool = userdata_to_pool(L, 1);
+    lua_pushfstring(L, "%s: %s (%d/%d)", LUAMONGO_POOL, pool->host.c_str(),
+                    pool->in_use, pool->max_size);
+    return 1;
+}
+
+int mongo_pool_register(lua_State *L) {
+    static const luaL_Reg pool_methods[] = {
+        {"acquire", pool_acquire},
+        {"release", pool_release},
+        {"with", pool_with},
+        {"check", pool_check},
+        {"stats", pool_stats},
+        {NULL, NULL}
+    };
+
+    static const luaL_Reg pool_class_methods[] = {
+        {"New", pool_new},
+        {NULL, NULL}
+    };
+
+    luaL_newmetatable(L, LUAMONGO_POOL);
+    luaL_setfuncs(L, pool_methods, 0);
+    lua_pushvalue(L,-1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, pool_gc);
+    lua_setfield(L, -2, "__gc");
+
+    lua_pushcfunction(L, pool_tostring);
+    lua_setfield(L, -2, "__tostring");
+
+    lua_pop(L,1);
+
+    #if LUA_VERSION_NUM < 502
+    luaL_register(L, LUAMONGO_POOL, pool_class_methods);
+    #else
+    luaL_newlib(L, pool_class_methods);
+    #endif
+
+    return 1;
+}
@@ -7,6 +7,7 @@ using namespace mongo;
 
 extern void lua_to_bson(lua_State *L, int stackpos, BSONObj &obj);
 extern void bson_to_lua(lua_State *L, const BSONObj &obj);
+extern BSONObj json_to_bson(const char *json);
 
 namespace {
 inline Query* userdata_to_query(lua_State* L, int index) {
@@ -31,7 +32,7 @@ static int query_new(lua_State *L) {
             int type = lua_type(L, 1);
             if (type == LUA_TSTRING) {
                 const char *jsonstr = luaL_checkstring(L, 1);
-                *query = new Query(fromjson(jsonstr));
+                *query = new Query(json_to_bson(jsonstr));
             } else if (type == LUA_TTABLE) {
                 BSONObj data;
                 lua_to_bson(L, 1, data);
@@ -86,7 +87,7 @@ static int query_hint(lua_State *L) {
         int type = lua_type(L, 2);
         if (type == LUA_TSTRING) {
             const char *jsonstr = luaL_checkstring(L, 2);
-            query->hint(fromjson(jsonstr));
+            query->hint(json_to_bson(jsonstr));
         } else if (type == LUA_TTABLE) {
             BSONObj data;
             lua_to_bson(L, 2, data);
@@ -127,7 +128,7 @@ static int query_max_key(lua_State *L) {
         int type = lua_type(L, 2);
         if (type == LUA_TSTRING) {
             const char *jsonstr = luaL_checkstring(L, 2);
-            query->maxKey(fromjson(jsonstr));
+            query->maxKey(json_to_bson(jsonstr));
         } else if (type == LUA_TTABLE) {
             BSONObj data;
             lua_to_bson(L, 2, data);
@@ -159,7 +160,7 @@ static int query_min_key(lua_State *L) {
         int type = lua_type(L, 2);
         if (type == LUA_TSTRING) {
             const char *jsonstr = luaL_checkstring(L, 2);
-            query->minKey(fromjson(jsonstr));
+            query->minKey(json_to_bson(jsonstr));
         } else if (type == LUA_TTABLE) {
             BSONObj data;
             lua_to_bson(L, 2, data);
@@ -223,7 +224,7 @@ static int query_sort(lua_State *L) {
             int type = lua_type(L, 2);
             if (type == LUA_TSTRING) {
                 const char *jsonstr = luaL_checkstring(L, 2);
-                query->sort(fromjson(jsonstr));
+                query->sort(json_to_bson(jsonstr));
             } else if (type == LUA_TTABLE) {
                 BSONObj data;
                 lua_to_bson(L, 2, data);
@@ -261,7 +262,7 @@ static int query_where(lua_State *L) {
             int type = lua_type(L, 3);
             if (type == LUA_TSTRING) {
                 const char *jsonstr = luaL_checkstring(L, 3);
-                scope = fromjson(jsonstr);
+                scope = json_to_bson(jsonstr);
             } else if (type == LUA_TTABLE) {
                 lua_to_bson(L, 3, scope);
             } else {
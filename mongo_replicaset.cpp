@@ -5,6 +5,8 @@
 using namespace mongo;
 
 extern const luaL_Reg dbclient_methods[];
+extern const luaL_Reg dbclient_local_methods[];
+extern void connection_wait_idle(const DBClientBase *connection);
 
 namespace {
 inline DBClientReplicaSet* userdata_to_replicaset(lua_State* L, int index) {
@@ -78,6 +80,8 @@ static int replicaset_connect(lua_State *L) {
  */
 static int replicaset_gc(lua_State *L) {
     DBClientReplicaSet *replicaset = userdata_to_replicaset(L, 1);
+    // a collected prefetching cursor may still be finishing a getMore
+    connection_wait_idle(replicaset);
     delete replicaset;
     return 0;
 }
@@ -105,7 +109,8 @@ int mongo_replicaset_register(lua_State *L) {
 
     luaL_newmetatable(L, LUAMONGO_REPLICASET);
     //luaL_register(L, NULL, dbclient_methods);
-    luaL_setfuncs(L, dbclient_methods, 0);
+    stats_setfuncs(L, dbclient_methods, "", true);
+    luaL_setfuncs(L, dbclient_local_methods, 0);
     //luaL_register(L, NULL, replicaset_methods);
     luaL_setfuncs(L, replicaset_methods, 0);
     lua_pushvalue(L,-1);
@@ -0,0 +1,235 @@
+#include <map>
+#include <string>
+#include <cstring>
+#include <sys/time.h>
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+#include "utils.h"
+#include "common.h"
+
+#ifndef LUAMONGO_NO_STATS
+
+// Log-linear latency histogram in microseconds, as in HdrHistogram: values
+// below 16 have their own bucket, above that every power of two is split in
+// 8 sub-buckets, so a recorded value is off by at most 12.5%.
+class LatencyHistogram {
+public:
+    LatencyHistogram() : count(0), errors(0), max(0), sum(0) {
+        memset(buckets, 0, sizeof(buckets));
+    }
+
+    void record(unsigned long long usec, bool failed) {
+        ++buckets[bucket(usec)];
+        ++count;
+        if (failed) ++errors;
+        if (usec > max) max = usec;
+        sum += usec;
+    }
+
+    // smallest recorded value v such that a fraction p of the values is <= v
+    unsigned long long percentile(double p) const {
+        unsigned long long rank = static_cast<unsigned long long>(p * count + 0.5);
+        if (rank == 0) rank = 1;
+        unsigned long long seen = 0;
+        for (int i = 0; i < NBUCKETS; ++i) {
+            seen += buckets[i];
+            if (seen >= rank) {
+                unsigned long long v = upper_bound(i);
+                return v < max ? v : max;
+            }
+        }
+        return max;
+    }
+
+    unsigned long long count;
+    unsigned long long errors;
+    unsigned long long max;
+    unsigned long long sum;
+
+private:
+    static const int SUB_BITS = 3;
+    static const int LINEAR = 2 << SUB_BITS;
+    static const int NBUCKETS = LINEAR + (64 - SUB_BITS - 1) * (1 << SUB_BITS);
+
+    static int bucket(unsigned long long v) {
+        if (v < (unsigned long long)LINEAR) return v;
+        int msb = 63 - __builtin_clzll(v);
+        int sub = (v >> (msb - SUB_BITS)) & ((1 << SUB_BITS) - 1);
+        return LINEAR + (msb - SUB_BITS - 1) * (1 << SUB_BITS) + sub;
+    }
+
+    static unsigned long long upper_bound(int i) {
+        if (i < LINEAR) return i;
+        int msb = (i - LINEAR) / (1 << SUB_BITS) + SUB_BITS + 1;
+        unsigned long long sub = (i - LINEAR) % (1 << SUB_BITS);
+        unsigned long long width = 1ULL << (msb - SUB_BITS);
+        return ((1ULL << SUB_BITS) + sub) * width + width - 1;
+    }
+
+    unsigned long long buckets[NBUCKETS];
+};
+
+typedef std::map<std::string, LatencyHistogram> NamespaceHistograms;
+// operations are never erased, the method wrappers keep a pointer to theirs
+typedef std::map<std::string, NamespaceHistograms> OperationHistograms;
+
+namespace {
+// cursors with the prefetch option record their getMore from native threads
+boost::atomic<bool> stats_enabled(true);
+boost::mutex stats_mutex;
+OperationHistograms stats_histograms;
+
+double now() {
+    struct timeval wop;
+    gettimeofday(&wop, 0);
+    return static_cast<double>(wop.tv_sec) +
+        static_cast<double>(wop.tv_usec)*1e-6;
+}
+
+void record(NamespaceHistograms &histograms, const std::string &ns, double elapsed, bool failed) {
+    unsigned long long usec = elapsed > 0 ? static_cast<unsigned long long>(elapsed*1e6 + 0.5) : 0;
+    boost::mutex::scoped_lock lock(stats_mutex);
+    NamespaceHistograms::iterator h = histograms.find(ns);
+    if (h == histograms.end())
+        h = histograms.insert(std::make_pair(ns, LatencyHistogram())).first;
+    h->second.record(usec, failed);
+}
+
+/*
+ * method wrapper installed by stats_setfuncs, upvalues are the method, the
+ * histograms of the operation and whether the second argument is a namespace.
+ * The method runs in a protected call, so a raised error is recorded as a
+ * failure before it is propagated, and nothing on the C++ stack needs to be
+ * destroyed when it is
+ */
+int stats_call(lua_State *L) {
+    if (!stats_enabled.load(boost::memory_order_relaxed))
+        return lua_tocfunction(L, lua_upvalueindex(1))(L);
+
+    NamespaceHistograms *histograms = (NamespaceHistograms *)lua_touserdata(L, lua_upvalueindex(2));
+    // copied, the argument may be replaced by the method. Namespaces are at
+    // most 120 bytes in MongoDB
+    char nskey[128] = "";
+    if (lua_toboolean(L, lua_upvalueindex(3)) && lua_type(L, 2) == LUA_TSTRING) {
+        strncpy(nskey, lua_tostring(L, 2), sizeof(nskey) - 1);
+        nskey[sizeof(nskey) - 1] = '\0';
+    }
+
+    int nargs = lua_gettop(L);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+
+    double t0 = now();
+    int status = lua_pcall(L, nargs, LUA_MULTRET, 0);
+    double elapsed = now() - t0;
+
+    if (status != 0) {
+        record(*histograms, nskey, elapsed, true);
+        return lua_error(L);
+    }
+
+    // methods report errors as nil or false followed by a message
+    int nret = lua_gettop(L);
+    bool failed = nret >= 2 && !lua_toboolean(L, 1) && lua_type(L, 2) == LUA_TSTRING;
+    record(*histograms, nskey, elapsed, failed);
+
+    return nret;
+}
+
+NamespaceHistograms *operation_histograms(const std::string &op) {
+    boost::mutex::scoped_lock lock(stats_mutex);
+    return &stats_histograms[op];
+}
+} // anonymous namespace
+
+bool stats_is_enabled() {
+    return stats_enabled.load(boost::memory_order_relaxed);
+}
+
+void stats_record(const char *op, const char *ns, double elapsed, bool failed) {
+    record(*operation_histograms(op), ns, elapsed, failed);
+}
+
+/*
+ * registers the methods of l in the table on top of the stack so that each
+ * call is recorded as operation prefix .. name, keyed by the namespace given
+ * as second argument when ns_arg is set
+ */
+void stats_setfuncs(lua_State *L, const luaL_Reg *l, const char *prefix, bool ns_arg) {
+    for (; l->name != NULL; l++) {
+        lua_pushcfunction(L, l->func);
+        lua_pushlightuserdata(L, operation_histograms(std::string(prefix) + l->name));
+        lua_pushboolean(L, ns_arg);
+        lua_pushcclosure(L, stats_call, 3);
+        lua_setfield(L, -2, l->name);
+    }
+}
+
+#endif // LUAMONGO_NO_STATS
+
+/*
+ * stats_table = mongo.stats()
+ *    returns {[operation] = {[namespace] = {count, errors, p50, p90, p99,
+ *    max, mean}}} with the latencies in seconds. Operations without
+ *    namespace use the empty string
+ */
+int mongo_stats(lua_State *L) {
+    lua_newtable(L);
+
+#ifndef LUAMONGO_NO_STATS
+    boost::mutex::scoped_lock lock(stats_mutex);
+    for (OperationHistograms::const_iterator op = stats_histograms.begin();
+         op != stats_histograms.end(); ++op) {
+        if (op->second.empty())
+            continue;
+        lua_newtable(L);
+        for (NamespaceHistograms::const_iterator ns = op->second.begin();
+             ns != op->second.end(); ++ns) {
+            const LatencyHistogram &h = ns->second;
+            lua_createtable(L, 0, 7);
+            LUA_PUSH_ATTRIB_FLOAT("count", h.count);
+            LUA_PUSH_ATTRIB_FLOAT("errors", h.errors);
+            LUA_PUSH_ATTRIB_FLOAT("p50", h.percentile(0.5)*1e-6);
+            LUA_PUSH_ATTRIB_FLOAT("p90", h.percentile(0.9)*1e-6);
+            LUA_PUSH_ATTRIB_FLOAT("p99", h.percentile(0.99)*1e-6);
+            LUA_PUSH_ATTRIB_FLOAT("max", h.max*1e-6);
+            LUA_PUSH_ATTRIB_FLOAT("mean", h.count ? h.sum*1e-6/h.count : 0);
+            lua_setfield(L, -2, ns->first.c_str());
+        }
+        lua_setfield(L, -2, op->first.c_str());
+    }
+#endif
+
+    return 1;
+}
+
+/*
+ * mongo.stats_reset()
+ */
+int mongo_stats_reset(lua_State *L) {
+#ifndef LUAMONGO_NO_STATS
+    boost::mutex::scoped_lock lock(stats_mutex);
+    for (OperationHistograms::iterator op = stats_histograms.begin();
+         op != stats_histograms.end(); ++op)
+        op->second.clear();
+#else
+    (void)L;
+#endif
+    return 0;
+}
+
+/*
+ * was_enabled = mongo.stats_enable([enable])
+ *    switches the recording on or off at runtime, always false when built
+ *    with -DLUAMONGO_NO_STATS
+ */
+int mongo_stats_enable(lua_State *L) {
+#ifndef LUAMONGO_NO_STATS
+    lua_pushboolean(L, stats_enabled.load());
+    if (!lua_isnoneornil(L, 1))
+        stats_enabled.store(lua_toboolean(L, 1) != 0);
+#else
+    lua_pushboolean(L, 0);
+#endif
+    return 1;
+}
@@ -47,8 +47,111 @@ function test_ReplicaSet()
     -- insert the same using a JSON string
     assertTrue( db:insert(test_ns, data_as_json), 'unable to insert JSON-based data' )
 
+    -- insert the same as raw BSON, passed through without conversion
+    local bson = mongo.BSON.New(data)
+    assertNotNil( bson, 'unable to create mongo.BSON' )
+    assertTrue( db:insert(test_ns, bson), 'unable to insert mongo.BSON data' )
+    assertTrue( db:insert(test_ns, bson:data()), 'unable to insert BSON string data' )
+    -- raw BSON strings are checked before use: this string length is too long
+    local bad, err = mongo.BSON.New('\12\0\0\0\2a\0\127\0\0\0\0')
+    assertNil( bad )
+    assertNotNil( err )
+
+    -- shared subtables are encoded every time, cycles are skipped
+    local shared = { 1, 2 }
+    local cyclic = { x = shared, y = shared }
+    cyclic.self = cyclic
+    local doc = mongo.BSON.New(cyclic)
+    assertEqual( 2, doc.x[2] )
+    assertEqual( 2, doc.y[2] )
+    assertNil( doc.self )
+    -- methods come before fields of the same name, read with doc:get()
+    doc = mongo.BSON.New({ data = 'x', list = { 10, 20, 30 } })
+    assertEqual( 'function', type(doc.data) )
+    assertEqual( 'x', doc:get('data') )
+    local list, sum = doc.list, 0
+    for i = 1, #list do sum = sum + list[i] end
+    assertEqual( 60, sum )
+    assertNil( list[4] )
+
+    -- ObjectId and Date values are compact userdata
+    local oid = mongo.ObjectId('507f1f77bcf86cd799439011')
+    assertEqual( '507f1f77bcf86cd799439011', tostring(oid) )
+    assertEqual( oid, mongo.ObjectId(oid:hex()) )
+    assertTrue( oid < mongo.ObjectId('507f1f77bcf86cd799439012') )
+    assertEqual( 0x507f1f77, oid:timestamp() )
+    -- the former setter forms raise an error instead of being ignored
+    assertFalse( pcall(oid, '507f1f77bcf86cd799439012') )
+    assertFalse( pcall(mongo.Date(0), 1000) )
+    assertEqual( '507f1f77bcf86cd799439011', oid() )
+    local doc = mongo.BSON.New({ _id = oid, at = mongo.Date(1400000000000) })
+    assertEqual( oid, doc._id )
+    assertEqual( 1400000000000, doc.at() )
+    assertEqual( 'mongo.Date', mongo.type(doc.at) )
+    assertEqual( 1400000000000, mongo.tonumber(doc.at) )
+    assertEqual( 42, mongo.tonumber(mongo.NumberLong(42)) )
+    assertEqual( 42, mongo.tonumber(mongo.NumberInt(42)) )
+
+    -- tables are written to JSON directly
+    assertEqual( '{"a":[1,2.5,"x\\n"]}', mongo.tojson({ a = { 1, 2.5, 'x\n' } }) )
+    assertEqual( '{"a":1,"b":{"$oid":"507f1f77bcf86cd799439011"}}',
+                 mongo.tojson({ b = mongo.ObjectId('507f1f77bcf86cd799439011'), a = 1 }, { sort = true }) )
+    assertEqual( '{"n":{"$numberInt":"1"}}', mongo.tojson({ n = 1 }, { mode = 'canonical' }) )
+    assertEqual( '{\n  "d": {"$date":"1970-01-01T00:00:01.000Z"}\n}',
+                 mongo.tojson({ d = mongo.Date(1000) }, { pretty = true }) )
+
+    -- JSON is parsed to tables directly, Extended JSON included
+    local t = mongo.fromjson('{"id":{"$oid":"507f1f77bcf86cd799439011"},"n":{"$numberLong":"42"},' ..
+                             '"at":{"$date":"1970-01-01T00:00:01.000Z"},"a":[1,"x\\n"]}')
+    assertEqual( mongo.ObjectId('507f1f77bcf86cd799439011'), t.id )
+    assertEqual( 42, t.n )
+    assertEqual( 1000, t.at() )
+    assertEqual( 'x\n', t.a[2] )
+    assertEqual( 1000, mongo.fromjson(mongo.tojson(t)).at() )
+    -- mongo shell syntax is still accepted
+    assertEqual( 1, mongo.fromjson('{a: 1}').a )
+    -- and JSON strings passed as documents keep their string values
+    local doc = mongo.BSON.New('{"s":"x","e":"a\\"b"}')
+    assertEqual( 'x', doc.s )
+    assertEqual( 'a"b', doc.e )
+    assertEqual( data.a, db:find_one(test_ns, '{"b":"str1"}').a )
+
+    -- both decoders give the same tables
+    local doc = mongo.BSON.New({ s = 'a\0b', n = 1.5, i = mongo.NumberInt(2),
+                                 a = { 1, 'x', { y = true } }, d = mongo.Date(5) })
+    assertEqual( 'raw', mongo.decoder('iterator') )
+    local t_iter = doc:totable()
+    assertEqual( 'iterator', mongo.decoder('raw') )
+    local t_raw = doc:totable()
+    for _,t in ipairs{ t_iter, t_raw } do
+        assertEqual( 1.5, t.n )
+        assertEqual( 2, t.i )
+        assertEqual( 'x', t.a[2] )
+        assertTrue( t.a[3].y )
+        assertEqual( 5, t.d() )
+    end
+    assertEqual( 'a', t_iter.s )
+    assertEqual( 'a\0b', t_raw.s )
+
+    -- arrays are detected from the keys unless the table is marked
+    local doc = mongo.BSON.New({ a = mongo.Array({}), o = mongo.Object({ 1, 2 }),
+                                 s = { [2] = 'b', [1] = 'a' }, h = { 1, 2, x = 3 } })
+    assertEqual( 'mongo.Array', mongo.type(mongo.Array({})) )
+    assertEqual( 0, #doc.a )
+    assertEqual( 2, doc.o['2'] )
+    assertEqual( 'b', doc.s[2] )
+    assertEqual( 3, doc.h.x )
+    -- an integer key stored in the hash part after string keys keeps them
+    local mixed = { x = 1, y = 2, z = 3 }
+    mixed[1] = 'a'
+    doc = mongo.BSON.New({ m = mixed })
+    assertEqual( 'a', doc.m['1'] )
+    assertEqual( 3, doc.m.z )
+    assertEqual( 2, mongo.fromjson(mongo.tojson(mixed)).y )
+
     -- check the data
-    assertEqual( 2, db:count(test_ns) )
+    assertEqual( 4, db:count(test_ns) )
+    assertEqual( 4, db:count(test_ns, bson) )
 
     -- query all the values in the namespace, ensuring the values are equal to the inserted values
     local q = db:query( test_ns, {} )
@@ -58,11 +161,278 @@ function test_ReplicaSet()
         assertEqual( result.b, data.b )
     end
 	
+    -- fetch all the values with a single call
+    local q = db:query( test_ns, {} )
+    local docs = q:next_batch( 10 )
+    assertEqual( 4, #docs )
+    assertEqual( docs[4].b, data.b )
+    assertEqual( 0, #q:next_batch( 10 ) )
+
+    -- fetch the values as columns
+    local cols, count = db:query( test_ns, {} ):columns( { 'a', 'b', 'c.d' }, { missing = false } )
+    assertEqual( 4, count )
+    assertEqual( cols.a[4], data.a )
+    assertEqual( cols.b[1], data.b )
+    assertEqual( cols['c.d'][2], false )
+    local q = db:query( test_ns, {} )
+    assertFalse( pcall( q.columns, q, { 'a', {} } ) )
+
+    -- field names cached by the cursor decode to the same documents
+    local uncached = db:query( test_ns, {}, nil, nil, nil, { key_cache = false } ):next_batch( 10 )
+    for i,doc in ipairs(db:query( test_ns, {} ):next_batch( 10 )) do
+        for k,v in pairs(uncached[i]) do
+            if type(v) ~= 'table' then assertEqual( v, doc[k] ) end
+        end
+    end
+
+    -- decode every document into the same table
+    local row = { stale = true }
+    local q = db:query( test_ns, {} )
+    assertEqual( row, q:next( row ) )
+    assertNil( row.stale )
+    assertEqual( data.a, row.a )
+    local rows, last, ids = 0, nil, {}
+    for r in q:results( { reuse = true } ) do
+        assertTrue( last == nil or last == r )
+        assertNotNil( r._id )
+        assertNil( ids[tostring(r._id)] )
+        ids[tostring(r._id)] = true
+        last, rows = r, rows + 1
+    end
+    assertEqual( 3, rows )
+
+    -- fetch the values from a prefetching cursor
+    local q = db:query( test_ns, {}, nil, nil, nil, { prefetch = 2 } )
+    assertEqual( 4, q:itcount() )
+    assertEqual( 2, q:stats().prefetch )
+    -- the connection is refused to other calls until the cursor is exhausted
+    local q = db:query( test_ns, {}, nil, nil, nil, { prefetch = 1 }, 2 )
+    assertFalse( pcall(db.count, db, test_ns) )
+    assertEqual( 4, q:itcount() )
+    assertEqual( 4, db:count(test_ns) )
+    -- and prefetching is refused while another cursor uses the connection
+    local open = db:query( test_ns, {}, nil, nil, nil, nil, 2 )
+    assertNotNil( open:next() )
+    local q, err = db:query( test_ns, {}, nil, nil, nil, { prefetch = 1 } )
+    assertNil( q )
+    assertNotNil( err:find('prefetch', 1, true) )
+    assertEqual( 3, open:itcount() )
+    assertEqual( 4, db:query( test_ns, {}, nil, nil, nil, { prefetch = 1 } ):itcount() )
+
 	-- query for a single result from the namespace
 	local result = db:find_one( test_ns, {} )
 	assertNotNil( result, 'could not find result' )
 	assertEqual( result.a, data.a )
 	assertEqual( result.b, data.b )
+
+    -- query the values as lazily decoded mongo.BSON documents
+    local q = db:query( test_ns, {}, nil, nil, nil, { lazy = true } )
+    assertNotNil( q, 'unable to create lazy Query object' )
+    for result in q:results() do
+        assertEqual( result.a, data.a )
+        assertEqual( result.b, data.b )
+        assertEqual( result:totable().b, data.b )
+    end
+
+    -- mix inserts, updates and removes in a single bulk write
+    local res = db:bulk_write( test_ns, {
+        { insert = { a = 'bulk' } },
+        { update = { { a = 'bulk' }, { ['$set'] = { b = 1 } } } },
+        { update = { { a = 'bulk2' }, { b = 2 }, true } },
+        { remove = { { a = 'bulk' }, true } },
+        { remove = { { a = 'bulk2' } } },
+    }, { ordered = true } )
+    assertNotNil( res, 'unable to run bulk write' )
+    assertEqual( 1, res.nInserted )
+    assertEqual( 1, res.nMatched )
+    assertEqual( 1, res.nUpserted )
+    assertNotNil( res.upserted[3] )
+    assertEqual( 2, res.nRemoved )
+    assertEqual( 0, #res.errors )
+
+    -- NumberLong keeps its 64 bits on Lua 5.3 (integers) and LuaJIT (int64_t)
+    local long_ns = test_db .. '.conn_long'
+    db:drop_collection( long_ns )
+    assertTrue( db:insert(long_ns, { n = mongo.NumberLong('9007199254740993') }) )
+    local n = db:find_one( long_ns, {} ).n
+    if math.type or jit then
+        assertEqual( '9007199254740993', (tostring(n):gsub('LL$', '')) )
+        assertEqual( 'number', type(mongo.tonumber(n)) )
+        assertTrue( math.abs(mongo.tonumber(n) - 2^53) <= 2 )
+    end
+    db:drop_collection( long_ns )
+
+    -- stream documents from an iterator into insert_batch
+    local batch_ns = test_db .. '.conn_batch'
+    db:drop_collection( batch_ns )
+    local i = 0
+    local n = db:insert_batch( batch_ns, function()
+        i = i + 1
+        if i <= 1000 then return { i = i } end
+    end )
+    assertEqual( 1000, n )
+    assertEqual( 1000, db:count(batch_ns) )
+    local ok, err, inserted, index = db:insert_batch( batch_ns, { { i = 1 }, 42 } )
+    assertFalse( ok )
+    assertEqual( 1, inserted )
+    assertEqual( 2, index )
+    db:drop_collection( batch_ns )
+
+    -- read a GridFS file spanning several chunks through a reader
+    local gridfs = mongo.GridFS.New( db, test_db, 'conn_fs' )
+    assertNotNil( gridfs, 'unable to create mongo.GridFS' )
+    gridfs:remove_file( 'conn_lines.txt' )
+    local lines = {}
+    for i = 1, 40000 do lines[i] = 'line ' .. i end
+    local content = table.concat( lines, '\n' ) .. '\n'
+    assertNotNil( gridfs:store_data( content, 'conn_lines.txt' ) )
+    local gridfile = gridfs:find_file_by_name( 'conn_lines.txt' )
+    assertTrue( gridfile:num_chunks() > 1 )
+    local reader = gridfile:reader()
+    assertNotNil( reader, 'unable to create mongo.GridFileReader' )
+    local i = 0
+    for line in reader:lines() do
+        i = i + 1
+        assertEqual( lines[i], line )
+    end
+    assertEqual( #lines, i )
+    assertNil( reader:read(1) )
+    local size = gridfile:chunk_size()
+    assertEqual( size - 5, reader:seek( 'set', size - 5 ) )
+    assertEqual( content:sub( size - 4, size + 5 ), reader:read(10) )
+    assertEqual( content:sub( size + 6 ), reader:read('*a') )
+    assertEqual( #content, reader:seek( 'end' ) )
+    assertTrue( reader:close() )
+    assertFalse( pcall(reader.read, reader) )
+
+    -- byte ranges across chunk boundaries and past the end of the file
+    assertEqual( content:sub( size - 9, 2 * size + 10 ), gridfile:range( size - 10, size + 20 ) )
+    assertEqual( content:sub( 1, 5 ), gridfile:range( 0, 5 ) )
+    assertEqual( content:sub( -3 ), gridfile:range( #content - 3, 100 ) )
+    assertEqual( content:sub( size + 1 ), gridfile:range( size ) )
+    assertEqual( '', gridfile:range( #content, 10 ) )
+
+    -- download the chunks over two connections of a pool and check the md5
+    local fs_pool = mongo.Pool.New( test_server, { size = 2 } )
+    local tmpname = os.tmpname()
+    assertTrue( gridfile:write( tmpname, { parallel = 2, pool = fs_pool, md5 = true } ) )
+    local f = io.open( tmpname, 'rb' )
+    assertEqual( content, f:read('*a') )
+    f:close()
+    assertEqual( 0, fs_pool:stats().in_use )
+    assertTrue( gridfile:write( tmpname, { md5 = true } ) )
+    -- the acquired connections are released when the write raises an error
+    local acquires = 0
+    local failing_pool = {
+        acquire = function()
+            acquires = acquires + 1
+            if acquires > 1 then error( 'acquire failed' ) end
+            return fs_pool:acquire()
+        end,
+        release = function( _, conn ) return fs_pool:release( conn ) end,
+    }
+    assertFalse( pcall( gridfile.write, gridfile, tmpname, { parallel = 2, pool = failing_pool } ) )
+    assertEqual( 0, fs_pool:stats().in_use )
+    -- and a parallel write needs a pool
+    assertFalse( pcall( gridfile.write, gridfile, tmpname, { parallel = 2 } ) )
+
+    -- upload from a file, a file handle and an iterator, chunk by chunk
+    local res = gridfs:store_stream( tmpname, 'conn_stream.txt', { content_type = 'text/plain', window = 1 } )
+    assertNotNil( res, 'unable to store a file with store_stream' )
+    assertEqual( #content, res.length )
+    assertEqual( gridfile:md5(), res.md5 )
+    assertEqual( content, gridfs:find_file_by_name( 'conn_stream.txt' ):data() )
+    gridfs:remove_file( 'conn_stream.txt' )
+    f = io.open( tmpname, 'rb' )
+    res = gridfs:store_stream( f, 'conn_stream.txt' )
+    f:close()
+    assertEqual( gridfile:md5(), res.md5 )
+    gridfs:remove_file( 'conn_stream.txt' )
+    os.remove( tmpname )
+    i = 0
+    res = gridfs:store_stream( function()
+        i = i + 1
+        return lines[i] and lines[i] .. '\n'
+    end, 'conn_stream.txt' )
+    assertEqual( gridfile:md5(), res.md5 )
+    assertEqual( gridfile:num_chunks(), gridfs:find_file_by_name( 'conn_stream.txt' ):num_chunks() )
+    gridfs:remove_file( 'conn_stream.txt' )
+    -- an object without read is refused before anything is stored
+    assertFalse( pcall(gridfs.store_stream, gridfs, {}, 'conn_stream.txt') )
+    assertFalse( gridfs:find_file_by_name( 'conn_stream.txt' ):exists() )
+
+    -- chunks compressed on their own keep random access to the file
+    local zfs = mongo.GridFS.New( db, test_db, 'conn_zfs', { compression = 'zlib' } )
+    assertNotNil( zfs, 'unable to create a compressed mongo.GridFS' )
+    zfs:remove_file( 'conn_lines.txt' )
+    res = zfs:store_data( content, 'conn_lines.txt' )
+    assertEqual( 'zlib', res.compression )
+    assertEqual( #content, res.length )
+    assertEqual( gridfile:md5(), res.md5 )
+    local zfile = zfs:find_file_by_name( 'conn_lines.txt' )
+    assertEqual( gridfile:num_chunks(), zfile:num_chunks() )
+    assertEqual( content, zfile:data() )
+    assertEqual( content:sub( size - 9, size + 10 ), zfile:range( size - 10, 20 ) )
+    assertEqual( content:sub( size + 1, 2 * size ), zfile:chunk(1):data() )
+    assertEqual( lines[1], zfile:reader():read() )
+    assertTrue( zfile:write( tmpname, { md5 = true } ) )
+    os.remove( tmpname )
+    zfs:remove_file( 'conn_lines.txt' )
+    local builder = mongo.GridFileBuilder.New( zfs )
+    assertTrue( builder:append( content:sub( 1, 1000 ) ) )
+    assertTrue( builder:append( content:sub( 1001 ) ) )
+    res = builder:build( 'conn_built.txt' )
+    assertEqual( gridfile:md5(), res.md5 )
+    assertEqual( content, zfs:find_file_by_name( 'conn_built.txt' ):data() )
+    zfs:remove_file( 'conn_built.txt' )
+    -- the chunks of a builder collected without build() are removed
+    local zchunks = test_db .. '.conn_zfs.chunks'
+    local nchunks = db:count( zchunks )
+    builder = mongo.GridFileBuilder.New( zfs )
+    assertTrue( builder:append( content ) )
+    assertTrue( db:count( zchunks ) > nchunks )
+    builder = nil
+    collectgarbage()
+    assertEqual( nchunks, db:count( zchunks ) )
+    assertNil( mongo.GridFS.New( db, test_db, 'conn_zfs', { compression = 'lz4' } ) )
+    gridfs:remove_file( 'conn_lines.txt' )
+
+    -- check out connections from a pool
+    local pool = mongo.Pool.New( test_server, { size = 1, max = 2 } )
+    assertNotNil( pool, 'unable to create mongo.Pool' )
+    local c1 = pool:acquire()
+    local c2 = pool:acquire()
+    assertNotNil( c2, 'unable to grow the pool' )
+    assertNil( pool:acquire() )
+    assertTrue( pool:release(c1) )
+    assertEqual( 4, pool:with(function(c) return c:count(test_ns) end) )
+    assertEqual( 1, pool:stats().in_use )
+    assertEqual( 2, pool:stats().created )
+
+    -- evicting the connection idle for too long leaves the others open
+    local idle_pool = mongo.Pool.New( test_server, { size = 1, max = 3, max_idle = 0.5 } )
+    local i1, i2, i3 = idle_pool:acquire(), idle_pool:acquire(), idle_pool:acquire()
+    assertTrue( idle_pool:release(i1) )
+    local t0 = os.clock()
+    while os.clock() - t0 < 0.6 do end
+    assertTrue( idle_pool:release(i2) )
+    assertTrue( idle_pool:release(i3) )
+    assertEqual( 2, idle_pool:stats().idle )
+    assertEqual( 1, idle_pool:stats().evicted )
+
+    -- every call above has been recorded
+    local stats = mongo.stats()
+    assertTrue( stats.insert[test_ns].count >= 2 )
+    assertEqual( 0, stats.insert[test_ns].errors )
+    assertTrue( stats.insert_batch[test_db .. '.conn_batch'].errors >= 1 )
+    assertTrue( stats.find_one[test_ns].p99 <= stats.find_one[test_ns].max )
+    -- raised errors too, as the calls refused while prefetching
+    assertTrue( stats.count[test_ns].errors >= 1 )
+    -- local methods are not timed, chunk fetches of readers are
+    assertNil( stats['gridfilereader.read'] )
+    assertTrue( stats['gridfilereader.chunk'][''].count >= 1 )
+    mongo.stats_reset()
+    assertNil( next(mongo.stats()) )
 end
 
 local t = {setup=setup, test=test_ReplicaSet, teardown=teardown}
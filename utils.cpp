@@ -2,16 +2,149 @@
 #include <client/dbclient.h>
 #include "utils.h"
 #include "common.h"
+#include <algorithm>
+#include <float.h>
 #include <limits.h>
-#include <sstream>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdexcept>
+#include <vector>
 
 using namespace mongo;
 
 extern void push_bsontype_table(lua_State* L, mongo::BSONType bsontype);
+extern const BSONObj* bson_testudata(lua_State *L, int index);
+extern void objectid_create(lua_State *L, const void *data);
+extern const unsigned char *objectid_testudata(lua_State *L, int index);
+extern void date_create(lua_State *L, long long ms);
+extern bool date_testudata(lua_State *L, int index, long long *ms);
 void lua_push_value(lua_State *L, const BSONElement &elem);
+extern bool json_to_bson(const char *data, size_t len, BSONObj &obj);
 const char *bson_name(int type);
 
-static void bson_to_array(lua_State *L, const BSONObj &obj) {
+#if LUA_VERSION_NUM < 503
+// LuaJIT int64_t cdata can only be created and read from Lua, through
+// the ffi helpers {make(hi, lo), split(v)} kept in the registry (false
+// when there is no ffi module)
+#define LUAMONGO_INT64_HELPERS LUAMONGO_ROOT ".int64"
+#define LUAMONGO_TCDATA 10 // lua_type of LuaJIT cdata
+
+static const char *int64_helpers_source =
+    "local ok, ffi = pcall(require, 'ffi')\n"
+    "if not ok then return false end\n"
+    "local int64, uint64 = ffi.typeof('int64_t'), ffi.typeof('uint64_t')\n"
+    "local shift = 4294967296\n"
+    "return {\n"
+    "  function(hi, lo) return int64(hi) * shift + lo end,\n"
+    "  function(v)\n"
+    "    if not (ffi.istype(int64, v) or ffi.istype(uint64, v)) then return nil end\n"
+    "    local u = ffi.cast(uint64, v)\n"
+    "    return tonumber(u / shift), tonumber(u % shift)\n"
+    "  end,\n"
+    "}\n";
+
+static void push_int64_helpers(lua_State *L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, LUAMONGO_INT64_HELPERS);
+    if (!lua_isnil(L, -1))
+        return;
+
+    lua_pop(L, 1);
+    if (luaL_loadstring(L, int64_helpers_source) || lua_pcall(L, 0, 1, 0)) {
+        lua_pop(L, 1);
+        lua_pushboolean(L, 0);
+    }
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUAMONGO_INT64_HELPERS);
+}
+#endif
+
+/*
+ * pushes a NumberLong: a Lua integer on Lua 5.3, a number when it fits in
+ * the 53 bits of a double and an int64_t cdata above that on LuaJIT
+ */
+void lua_push_int64(lua_State *L, long long v) {
+#if LUA_VERSION_NUM >= 503
+    lua_pushinteger(L, v);
+#else
+    static const long long max_exact = 1LL << 53;
+    if (v >= -max_exact && v <= max_exact) {
+        lua_pushnumber(L, static_cast<lua_Number>(v));
+        return;
+    }
+
+    push_int64_helpers(L);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_pushnumber(L, static_cast<lua_Number>(v));
+        return;
+    }
+    lua_rawgeti(L, -1, 1);
+    lua_remove(L, -2);
+    lua_pushnumber(L, static_cast<int>(v >> 32));
+    lua_pushnumber(L, static_cast<unsigned int>(v & 0xffffffffULL));
+    lua_call(L, 2, 1);
+#endif
+}
+
+/*
+ * reads a native 64 bit integer, a Lua 5.3 integer or a LuaJIT int64_t or
+ * uint64_t cdata, false for anything else
+ */
+bool lua_to_int64(lua_State *L, int stackpos, long long *v) {
+#if LUA_VERSION_NUM >= 503
+    if (!lua_isinteger(L, stackpos))
+        return false;
+    *v = lua_tointeger(L, stackpos);
+    return true;
+#else
+    if (lua_type(L, stackpos) != LUAMONGO_TCDATA)
+        return false;
+    if (stackpos < 0) stackpos = lua_gettop(L) + stackpos + 1;
+
+    push_int64_helpers(L);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return false;
+    }
+    lua_rawgeti(L, -1, 2);
+    lua_remove(L, -2);
+    lua_pushvalue(L, stackpos);
+    lua_call(L, 1, 2);
+    bool ok = !lua_isnil(L, -2);
+    if (ok) {
+        unsigned long long hi = static_cast<unsigned long long>(lua_tonumber(L, -2));
+        unsigned long long lo = static_cast<unsigned long long>(lua_tonumber(L, -1));
+        *v = static_cast<long long>((hi << 32) | lo);
+    }
+    lua_pop(L, 2);
+    return ok;
+#endif
+}
+
+// registry field set to true once mongo.decoder("iterator") is selected in
+// a state, the raw decoder is used otherwise
+#define LUAMONGO_ITERATOR_DECODER LUAMONGO_ROOT ".iterator_decoder"
+
+/*
+ * true when bson_to_table and bson_to_array use the raw decoder in this
+ * state, see mongo.decoder()
+ */
+bool raw_decoder_enabled(lua_State *L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, LUAMONGO_ITERATOR_DECODER);
+    bool iterator = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    return !iterator;
+}
+
+void raw_decoder_enable(lua_State *L, bool enable) {
+    lua_pushboolean(L, !enable);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUAMONGO_ITERATOR_DECODER);
+}
+
+static void iterator_to_array(lua_State *L, const BSONObj &obj) {
     BSONObjIterator it = BSONObjIterator(obj);
 
     lua_newtable(L);
@@ -25,7 +158,7 @@ static void bson_to_array(lua_State *L, const BSONObj &obj) {
     }
 }
 
-static void bson_to_table(lua_State *L, const BSONObj &obj) {
+static void iterator_to_table(lua_State *L, const BSONObj &obj) {
     BSONObjIterator it = BSONObjIterator(obj);
 
     lua_newtable(L);
@@ -40,6 +173,289 @@ static void bson_to_table(lua_State *L, const BSONObj &obj) {
     }
 }
 
+/*
+ * Raw decoder: walks the BSON bytes of a document, pushing keys and strings
+ * with their known length and presizing every table from a first pass that
+ * only counts the elements. Types without a fast path below are pushed by
+ * lua_push_value, so both decoders map BSON types to the same Lua values.
+ */
+namespace {
+// BSON numbers are little-endian whatever the host
+inline int read_int32(const char *p) {
+    const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+    return static_cast<int>(u[0] | (u[1] << 8) | (u[2] << 16) |
+                            (static_cast<unsigned int>(u[3]) << 24));
+}
+
+inline long long read_int64(const char *p) {
+    unsigned long long lo = static_cast<unsigned int>(read_int32(p));
+    unsigned long long hi = static_cast<unsigned int>(read_int32(p + 4));
+    return static_cast<long long>((hi << 32) | lo);
+}
+
+inline double read_double(const char *p) {
+    long long bits = read_int64(p);
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+struct RawElement {
+    const char *start; // type byte
+    int type;
+    const char *key;
+    size_t key_len;
+    const char *value;
+};
+
+/*
+ * size of the value of e, the driver computes it for the types that are
+ * rare enough to not deserve a case here
+ */
+inline int raw_value_size(const RawElement &e) {
+    switch (e.type) {
+    case mongo::Undefined:
+    case mongo::jstNULL:
+    case mongo::MinKey:
+    case mongo::MaxKey:
+        return 0;
+    case mongo::Bool:
+        return 1;
+    case mongo::NumberInt:
+        return 4;
+    case mongo::NumberDouble:
+    case mongo::NumberLong:
+    case mongo::Date:
+    case mongo::Timestamp:
+        return 8;
+    case mongo::jstOID:
+        return 12;
+    case mongo::String:
+    case mongo::Symbol:
+    case mongo::Code:
+        return 4 + read_int32(e.value);
+    case mongo::Object:
+    case mongo::Array:
+        return read_int32(e.value);
+    case mongo::BinData:
+        return 5 + read_int32(e.value);
+    }
+    return BSONElement(e.start).size() - static_cast<int>(e.value - e.start);
+}
+
+/*
+ * reads the element at p into e, returns the next element or NULL at the
+ * end of the document
+ */
+inline const char *raw_next(const char *p, RawElement *e) {
+    e->type = static_cast<signed char>(*p);
+    if (e->type == mongo::EOO)
+        return NULL;
+
+    e->start = p;
+    e->key = ++p;
+    while (*p)
+        ++p;
+    e->key_len = p - e->key;
+    e->value = p + 1;
+
+    return e->value + raw_value_size(*e);
+}
+
+/*
+ * field names kept between documents by bson_to_lua_cached: the table at
+ * stack index table holds the key strings in decoding order, next is the
+ * position of the next key
+ */
+struct KeyCache {
+    int table;
+    int next;
+};
+static const int KEY_CACHE_SIZE = 256;
+
+inline void raw_push_key(lua_State *L, const RawElement &e, KeyCache *cache) {
+    if (cache == NULL || cache->next > KEY_CACHE_SIZE) {
+        lua_pushlstring(L, e.key, e.key_len);
+        return;
+    }
+
+    int pos = cache->next++;
+    lua_rawgeti(L, cache->table, pos);
+    size_t len;
+    const char *key = lua_tolstring(L, -1, &len);
+    if (key != NULL && len == e.key_len && memcmp(key, e.key, len) == 0)
+        return;
+
+    // another shape, its keys replace the cached ones from here
+    lua_pop(L, 1);
+    lua_pushlstring(L, e.key, e.key_len);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, cache->table, pos);
+}
+
+void raw_push_document(lua_State *L, const char *data, bool is_array, KeyCache *cache);
+
+/*
+ * pushes the value of e, returns false when its type has no Lua value
+ */
+bool raw_push_value(lua_State *L, const RawElement &e, KeyCache *cache) {
+    switch (e.type) {
+    case mongo::NumberDouble:
+        lua_pushnumber(L, read_double(e.value));
+        break;
+    case mongo::String:
+        lua_pushlstring(L, e.value + 4, read_int32(e.value) - 1);
+        break;
+    case mongo::Object:
+        raw_push_document(L, e.value, false, cache);
+        break;
+    case mongo::Array:
+        raw_push_document(L, e.value, true, cache);
+        break;
+    case mongo::Bool:
+        lua_pushboolean(L, *e.value);
+        break;
+    case mongo::NumberInt:
+        lua_pushinteger(L, read_int32(e.value));
+        break;
+    case mongo::NumberLong:
+        lua_push_int64(L, read_int64(e.value));
+        break;
+    case mongo::Date:
+        date_create(L, read_int64(e.value));
+        break;
+    case mongo::jstOID:
+        objectid_create(L, e.value);
+        break;
+    case mongo::Undefined:
+        lua_pushnil(L);
+        break;
+    default: {
+        int top = lua_gettop(L);
+        lua_push_value(L, BSONElement(e.start));
+        return lua_gettop(L) > top;
+    }
+    }
+    return true;
+}
+
+void raw_push_document(lua_State *L, const char *data, bool is_array, KeyCache *cache) {
+    lua_checkstack(L, 3);
+
+    RawElement e;
+    const char *first = data + 4;
+    int count = 0;
+    for (const char *p = first; (p = raw_next(p, &e)) != NULL; )
+        ++count;
+
+    if (is_array)
+        lua_createtable(L, count, 0);
+    else
+        lua_createtable(L, 0, count);
+
+    int n = 1;
+    for (const char *p = first; (p = raw_next(p, &e)) != NULL; ++n) {
+        if (is_array) {
+            if (raw_push_value(L, e, cache))
+                lua_rawseti(L, -2, n);
+        } else {
+            raw_push_key(L, e, cache);
+            if (raw_push_value(L, e, cache))
+                lua_rawset(L, -3);
+            else
+                lua_pop(L, 1);
+        }
+    }
+}
+
+/*
+ * refills the table at stack index table with the document at data. Plain
+ * tables found where the document has an object or an array are refilled
+ * as well, fields and elements absent from the document are removed.
+ */
+void raw_fill_document(lua_State *L, const char *data, bool is_array, int table, KeyCache *cache) {
+    lua_checkstack(L, 4);
+
+    RawElement e;
+    int n = 0;
+    int set = 0; // non-nil values in the table
+    for (const char *p = data + 4; (p = raw_next(p, &e)) != NULL; ) {
+        ++n;
+        if (is_array)
+            lua_pushinteger(L, n);
+        else
+            raw_push_key(L, e, cache);
+
+        if (e.type == mongo::Object || e.type == mongo::Array) {
+            lua_pushvalue(L, -1);
+            lua_rawget(L, table);
+            bool reuse = lua_istable(L, -1);
+            if (reuse && lua_getmetatable(L, -1)) {
+                lua_pop(L, 1);
+                reuse = false;
+            }
+            if (reuse) {
+                raw_fill_document(L, e.value, e.type == mongo::Array, lua_gettop(L), cache);
+                lua_pop(L, 2);
+                ++set;
+                continue;
+            }
+            lua_pop(L, 1);
+        }
+
+        if (raw_push_value(L, e, cache))
+            ++set;
+        else
+            lua_pushnil(L);
+        lua_rawset(L, table);
+    }
+
+    int entries = 0;
+    lua_pushnil(L);
+    while (lua_next(L, table)) {
+        lua_pop(L, 1);
+        ++entries;
+    }
+    if (entries == set)
+        return;
+
+    // left from a previous document of another shape
+    BSONObj obj(data);
+    lua_pushnil(L);
+    while (lua_next(L, table)) {
+        lua_pop(L, 1);
+        bool keep;
+        if (is_array) {
+            lua_Number i = lua_tonumber(L, -1);
+            keep = lua_type(L, -1) == LUA_TNUMBER && i >= 1 && i <= n &&
+                i == static_cast<int>(i);
+        } else {
+            keep = lua_type(L, -1) == LUA_TSTRING &&
+                !obj.getField(lua_tostring(L, -1)).eoo();
+        }
+        if (!keep) {
+            lua_pushvalue(L, -1);
+            lua_pushnil(L);
+            lua_rawset(L, table);
+        }
+    }
+}
+} // anonymous namespace
+
+void bson_to_array(lua_State *L, const BSONObj &obj) {
+    if (raw_decoder_enabled(L))
+        raw_push_document(L, obj.objdata(), true, NULL);
+    else
+        iterator_to_array(L, obj);
+}
+
+void bson_to_table(lua_State *L, const BSONObj &obj) {
+    if (raw_decoder_enabled(L))
+        raw_push_document(L, obj.objdata(), false, NULL);
+    else
+        iterator_to_table(L, obj);
+}
+
 void lua_push_value(lua_State *L, const BSONElement &elem) {
     lua_checkstack(L, 2);
     int type = elem.type();
@@ -52,8 +468,10 @@ void lua_push_value(lua_State *L, const BSONElement &elem) {
         lua_pushinteger(L, elem.numberInt());
         break;
     case mongo::NumberLong:
+        lua_push_int64(L, elem._numberLong());
+        break;
     case mongo::NumberDouble:
-        lua_pushnumber(L, elem.number());
+        lua_pushnumber(L, elem._numberDouble());
         break;
     case mongo::Bool:
         lua_pushboolean(L, elem.boolean());
@@ -68,9 +486,7 @@ void lua_push_value(lua_State *L, const BSONElement &elem) {
         bson_to_table(L, elem.embeddedObject());
         break;
     case mongo::Date:
-        push_bsontype_table(L, mongo::Date);
-        lua_pushnumber(L, elem.date());
-        lua_rawseti(L, -2, 1);
+        date_create(L, static_cast<long long>(elem.date().millis));
         break;
     case mongo::Timestamp:
 	{
@@ -101,9 +517,7 @@ void lua_push_value(lua_State *L, const BSONElement &elem) {
         lua_rawseti(L, -2, 2);
         break;
     case mongo::jstOID:
-        push_bsontype_table(L, mongo::jstOID);
-        lua_pushstring(L, elem.__oid().toString().c_str());
-        lua_rawseti(L, -2, 1);
+        objectid_create(L, elem.value());
         break;
     case mongo::jstNULL:
         push_bsontype_table(L, mongo::jstNULL);
@@ -115,8 +529,196 @@ void lua_push_value(lua_State *L, const BSONElement &elem) {
     }
 }
 
-static void lua_append_bson(lua_State *L, const char *key, int stackpos, BSONObjBuilder *builder, int ref) {
+// encoded documents are built in a buffer kept in the registry of each
+// lua_State, which keeps its capacity up to ENCODE_ARENA_KEEP bytes
+#define LUAMONGO_ENCODE_ARENA LUAMONGO_ROOT ".encode_arena"
+static const int ENCODE_ARENA_KEEP = 1024 * 1024;
+
+// keys of the first ARRAY_KEYS array elements, "0", "1", ...
+static const int ARRAY_KEYS = 1000;
+static const int KEY_SIZE = 32;
+static char array_keys[ARRAY_KEYS][4];
+
+static struct ArrayKeysInit {
+    ArrayKeysInit() {
+        for (int i = 0; i < ARRAY_KEYS; ++i)
+            snprintf(array_keys[i], sizeof(array_keys[i]), "%d", i);
+    }
+} array_keys_init;
+
+/*
+ * key of array element i, formatted in buf (KEY_SIZE chars) when it is not
+ * precomputed
+ */
+static inline const char *array_key(int i, char *buf) {
+    if (i < ARRAY_KEYS)
+        return array_keys[i];
+
+    char *p = buf + KEY_SIZE - 1;
+    *p = '\0';
+    do {
+        *--p = '0' + i % 10;
+        i /= 10;
+    } while (i);
+    return p;
+}
+
+static int encode_arena_gc(lua_State *L) {
+    BufBuilder **arena = (BufBuilder **)lua_touserdata(L, 1);
+    delete *arena;
+    return 0;
+}
+
+static BufBuilder *encode_arena(lua_State *L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, LUAMONGO_ENCODE_ARENA);
+    BufBuilder **arena = (BufBuilder **)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (arena)
+        return *arena;
+
+    arena = (BufBuilder **)lua_newuserdata(L, sizeof(BufBuilder *));
+    *arena = new BufBuilder();
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, encode_arena_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUAMONGO_ENCODE_ARENA);
+    return *arena;
+}
+
+// The tables from the root to the one being encoded, identified by
+// lua_topointer. A table found among its own ancestors is a cycle and is
+// skipped, while a table shared by several fields is encoded every time.
+// The first INLINE_DEPTH levels need no allocation.
+class EncodeAncestry {
+public:
+    EncodeAncestry() : depth(0) { }
+
+    bool contains(const void *table) const {
+        int n = depth < INLINE_DEPTH ? depth : INLINE_DEPTH;
+        for (int i = 0; i < n; ++i)
+            if (tables[i] == table) return true;
+        for (size_t i = 0; i < deeper.size(); ++i)
+            if (deeper[i] == table) return true;
+        return false;
+    }
+
+    void push(const void *table) {
+        if (depth < INLINE_DEPTH)
+            tables[depth] = table;
+        else
+            deeper.push_back(table);
+        ++depth;
+    }
+
+    void pop() {
+        if (--depth >= INLINE_DEPTH)
+            deeper.pop_back();
+    }
+
+private:
+    static const int INLINE_DEPTH = 32;
+    const void *tables[INLINE_DEPTH];
+    std::vector<const void *> deeper;
+    int depth;
+};
+
+static void lua_append_bson(lua_State *L, const char *key, int stackpos, BSONObjBuilder *builder, EncodeAncestry *ancestry);
+
+/*
+ * appends the string and number keyed fields of the table at stackpos,
+ * numbers are formatted as std::ostream does
+ */
+static void lua_append_fields(lua_State *L, int stackpos, BSONObjBuilder *builder, EncodeAncestry *ancestry) {
+    char buf[KEY_SIZE];
+
+    for (lua_pushnil(L); lua_next(L, stackpos); lua_pop(L, 1)) {
+        switch (lua_type(L, -2)) { // key type
+            case LUA_TNUMBER: {
+                snprintf(buf, sizeof(buf), "%g", lua_tonumber(L, -2));
+                lua_append_bson(L, buf, -1, builder, ancestry);
+                break;
+            }
+            case LUA_TSTRING: {
+                lua_append_bson(L, lua_tostring(L, -2), -1, builder, ancestry);
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * true when the keys of the table are 1 to len, being len its border. The
+ * API can not tell whether a key is in the array or the hash part, so every
+ * key is checked, stopping at the first one out of 1 to len; holes below
+ * the border are only found when the elements are read
+ */
+static bool is_sequence(lua_State *L, int stackpos, int len) {
+    int n = 0;
+    for (lua_pushnil(L); lua_next(L, stackpos); lua_pop(L, 1)) {
+        lua_Number k = lua_type(L, -2) == LUA_TNUMBER ? lua_tonumber(L, -2) : 0;
+        if (k != floor(k) || k < 1 || k > len) {
+            lua_pop(L, 2);
+            return false;
+        }
+        ++n;
+    }
+    return n == len;
+}
+
+/*
+ * appends a plain Lua table as an array when its keys are 1 to #t, or as a
+ * document otherwise. A table marked with mongo.Array (bsontype Array) is
+ * an array of its elements 1 to #t, with nil written as null, and one
+ * marked with mongo.Object is always a document.
+ */
+static void lua_append_table(lua_State *L, const char *key, int stackpos, BSONObjBuilder *builder, EncodeAncestry *ancestry, int bsontype) {
+    const void *table = lua_topointer(L, stackpos);
+    if (ancestry->contains(table)) // do nothing for a cycle
+        return;
+    ancestry->push(table);
+
+    int len = lua_rawlen(L, stackpos);
+    bool dense = bsontype == mongo::Array ||
+        (bsontype != mongo::Object && is_sequence(L, stackpos, len));
+
+    // nested documents are written in place in the parent buffer
+    if (dense) {
+        BufBuilder &bb = builder->bb();
+        int start = bb.len();
+        BSONObjBuilder b(builder->subarrayStart(key));
+        char buf[KEY_SIZE];
+        int i;
+        for (i = 0; i < len; i++) {
+            lua_rawgeti(L, stackpos, i+1);
+            if (lua_isnil(L, -1) && bsontype != mongo::Array) {
+                lua_pop(L, 1);
+                break;
+            }
+            lua_append_bson(L, array_key(i, buf), -1, &b, ancestry);
+            lua_pop(L, 1);
+        }
+        b.done();
+
+        if (i < len) {
+            // a hole below the border, drop the array and write a document
+            bb.setlen(start);
+            dense = false;
+        }
+    }
+
+    if (!dense) {
+        BSONObjBuilder b(builder->subobjStart(key));
+        lua_append_fields(L, stackpos, &b, ancestry);
+        b.done();
+    }
+
+    ancestry->pop();
+}
+
+static void lua_append_bson(lua_State *L, const char *key, int stackpos, BSONObjBuilder *builder, EncodeAncestry *ancestry) {
     int type = lua_type(L, stackpos);
+    long long intval;
 
     if (type == LUA_TTABLE) {
         if (stackpos < 0) stackpos = lua_gettop(L) + stackpos + 1;
@@ -124,64 +726,14 @@ static void lua_append_bson(lua_State *L, const char *key, int stackpos, BSONObj
 
         int bsontype_found = luaL_getmetafield(L, stackpos, "__bsontype");
         if (!bsontype_found) {
-            // not a special bsontype
-            // handle as a regular table, iterating keys
-
-            lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
-            lua_pushvalue(L, stackpos);
-            lua_rawget(L, -2);
-            if (lua_toboolean(L, -1)) { // do nothing if the same table encountered
-                lua_pop(L, 2);
-            } else {
-                lua_pop(L, 1);
-                lua_pushvalue(L, stackpos);
-                lua_pushboolean(L, 1);
-                lua_rawset(L, -3);
-                lua_pop(L, 1);
-
-                BSONObjBuilder b;
-
-                bool dense = true;
-                int len = 0;
-                for (lua_pushnil(L); lua_next(L, stackpos); lua_pop(L, 1)) {
-                    ++len;
-                    if ((lua_type(L, -2) != LUA_TNUMBER) || (lua_tointeger(L, -2) != len)) {
-                        lua_pop(L, 2);
-                        dense = false;
-                        break;
-                    }
-                }
-
-                if (dense) {
-                    for (int i = 0; i < len; i++) {
-                        lua_rawgeti(L, stackpos, i+1);
-                        std::stringstream ss;
-                        ss << i;
-
-                        lua_append_bson(L, ss.str().c_str(), -1, &b, ref);
-                        lua_pop(L, 1);
-                    }
-
-                    builder->appendArray(key, b.obj());
-                } else {
-                    for (lua_pushnil(L); lua_next(L, stackpos); lua_pop(L, 1)) {
-                        switch (lua_type(L, -2)) { // key type
-                            case LUA_TNUMBER: {
-                                std::stringstream ss;
-                                ss << lua_tonumber(L, -2);
-                                lua_append_bson(L, ss.str().c_str(), -1, &b, ref);
-                                break;
-                            }
-                            case LUA_TSTRING: {
-                                lua_append_bson(L, lua_tostring(L, -2), -1, &b, ref);
-                                break;
-                            }
-                        }
-                    }
-
-                    builder->append(key, b.obj());
-                }
-            }
+            // not a special bsontype, a regular table
+            lua_append_table(L, key, stackpos, builder, ancestry, mongo::EOO);
+        } else if (lua_tointeger(L, -1) == mongo::Array ||
+                   lua_tointeger(L, -1) == mongo::Object) {
+            // marked with mongo.Array or mongo.Object
+            int bson_type = lua_tointeger(L, -1);
+            lua_pop(L, 1);
+            lua_append_table(L, key, stackpos, builder, ancestry, bson_type);
         } else {
             int bson_type = lua_tointeger(L, -1);
             lua_pop(L, 1);
@@ -204,9 +756,16 @@ static void lua_append_bson(lua_State *L, const char *key, int stackpos, BSONObj
             case mongo::NumberInt:
                 builder->append(key, static_cast<int32_t>(lua_tointeger(L, -1)));
                 break;
-            case mongo::NumberLong:
-                builder->append(key, static_cast<long long int>(lua_tonumber(L, -1)));
+            case mongo::NumberLong: {
+                long long v;
+                if (lua_to_int64(L, -1, &v))
+                    builder->append(key, v);
+                else if (lua_type(L, -1) == LUA_TSTRING)
+                    builder->append(key, strtoll(lua_tostring(L, -1), NULL, 10));
+                else
+                    builder->append(key, static_cast<long long int>(lua_tonumber(L, -1)));
                 break;
+            }
             case mongo::Symbol: {
                 const char* c = lua_tostring(L, -1);
                 if (c) builder->appendSymbol(key, c);
@@ -238,25 +797,490 @@ static void lua_append_bson(lua_State *L, const char *key, int stackpos, BSONObj
         }
     } else if (type == LUA_TNIL) {
         builder->appendNull(key);
+    } else if (type == LUA_TNUMBER && lua_to_int64(L, stackpos, &intval)) {
+        // Lua 5.3 integers, int32 when they fit
+        if (intval >= INT_MIN && intval <= INT_MAX)
+            builder->append(key, static_cast<int32_t>(intval));
+        else
+            builder->append(key, intval);
     } else if (type == LUA_TNUMBER) {
         double numval = lua_tonumber(L, stackpos);
         if ((numval == floor(numval)) && fabs(numval)< INT_MAX ) {
             // The numeric value looks like an integer, treat it as such.
             // This is closer to how JSON datatypes behave.
-            int intval = lua_tointeger(L, stackpos);
-            builder->append(key, static_cast<int32_t>(intval));
+            builder->append(key, static_cast<int32_t>(lua_tointeger(L, stackpos)));
         } else {
             builder->append(key, numval);
         }
     } else if (type == LUA_TBOOLEAN) {
         builder->appendBool(key, lua_toboolean(L, stackpos));
     } else if (type == LUA_TSTRING) {
-        builder->append(key, lua_tostring(L, stackpos));
+        size_t len;
+        const char *str = lua_tolstring(L, stackpos, &len);
+        builder->append(key, str, static_cast<int>(len) + 1);
+    } else if (type == LUA_TUSERDATA) {
+        const unsigned char *oid = objectid_testudata(L, stackpos);
+        if (oid) {
+            builder->append(key, OID::from(oid));
+        } else if (date_testudata(L, stackpos, &intval)) {
+            builder->appendDate(key, Date_t(static_cast<unsigned long long>(intval)));
+        }
+    } else if (lua_to_int64(L, stackpos, &intval)) {
+        // LuaJIT int64_t cdata
+        builder->append(key, intval);
     }/* else {
         luaL_error(L, LUAMONGO_UNSUPPORTED_LUA_TYPE, luaL_typename(L, stackpos));
     }*/
 }
 
+/*
+ * Lua to JSON, written from the tables without going through BSON. Values
+ * follow the same rules as lua_append_bson, with the bsontype wrappers,
+ * ObjectId and Date written as relaxed or canonical Extended JSON.
+ */
+struct JsonWriter {
+    BufBuilder *out;
+    bool canonical;
+    int indent; // spaces per level, 0 writes everything on one line
+    bool sort;
+    int depth;
+    EncodeAncestry ancestry;
+
+    JsonWriter(BufBuilder *out, bool canonical, int indent, bool sort)
+        : out(out), canonical(canonical), indent(indent), sort(sort), depth(0) { }
+};
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static inline void json_append_raw(BufBuilder *out, const char *s) {
+    out->appendBuf(s, strlen(s));
+}
+
+static void json_append_string(BufBuilder *out, const char *s, size_t len) {
+    out->appendChar('"');
+    const char *span = s;
+    const char *end = s + len;
+    for (const char *p = s; p < end; ++p) {
+        unsigned char c = static_cast<unsigned char>(*p);
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        out->appendBuf(span, p - span);
+        span = p + 1;
+        switch (c) {
+        case '"': out->appendBuf("\\\"", 2); break;
+        case '\\': out->appendBuf("\\\\", 2); break;
+        case '\n': out->appendBuf("\\n", 2); break;
+        case '\r': out->appendBuf("\\r", 2); break;
+        case '\t': out->appendBuf("\\t", 2); break;
+        default: {
+            char esc[6] = { '\\', 'u', '0', '0', hex_digits[c >> 4], hex_digits[c & 15] };
+            out->appendBuf(esc, sizeof(esc));
+        }
+        }
+    }
+    out->appendBuf(span, end - span);
+    out->appendChar('"');
+}
+
+static void json_append_base64(BufBuilder *out, const unsigned char *p, size_t len) {
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char quad[4];
+
+    out->appendChar('"');
+    for (; len >= 3; p += 3, len -= 3) {
+        quad[0] = alphabet[p[0] >> 2];
+        quad[1] = alphabet[((p[0] & 3) << 4) | (p[1] >> 4)];
+        quad[2] = alphabet[((p[1] & 15) << 2) | (p[2] >> 6)];
+        quad[3] = alphabet[p[2] & 63];
+        out->appendBuf(quad, 4);
+    }
+    if (len) {
+        quad[0] = alphabet[p[0] >> 2];
+        quad[1] = alphabet[((p[0] & 3) << 4) | (len > 1 ? p[1] >> 4 : 0)];
+        quad[2] = len > 1 ? alphabet[(p[1] & 15) << 2] : '=';
+        quad[3] = '=';
+        out->appendBuf(quad, 4);
+    }
+    out->appendChar('"');
+}
+
+static void json_newline(JsonWriter *w) {
+    if (!w->indent)
+        return;
+    w->out->appendChar('\n');
+    for (int i = w->indent * w->depth; i > 0; --i)
+        w->out->appendChar(' ');
+}
+
+static void json_write_int64(JsonWriter *w, long long v, bool int32) {
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%lld", v);
+    if (!w->canonical) {
+        w->out->appendBuf(buf, n);
+        return;
+    }
+    json_append_raw(w->out, int32 ? "{\"$numberInt\":\"" : "{\"$numberLong\":\"");
+    w->out->appendBuf(buf, n);
+    json_append_raw(w->out, "\"}");
+}
+
+/*
+ * doubles are written with the fewest digits that read back the same
+ * value, and always with a fraction or an exponent
+ */
+static void json_write_double(JsonWriter *w, double v) {
+    char buf[40];
+    if (v != v)
+        strcpy(buf, "NaN");
+    else if (v > DBL_MAX)
+        strcpy(buf, "Infinity");
+    else if (v < -DBL_MAX)
+        strcpy(buf, "-Infinity");
+    else {
+        snprintf(buf, sizeof(buf), "%.15g", v);
+        if (strtod(buf, NULL) != v)
+            snprintf(buf, sizeof(buf), "%.17g", v);
+        if (!strpbrk(buf, ".e"))
+            strcat(buf, ".0");
+        if (!w->canonical) {
+            json_append_raw(w->out, buf);
+            return;
+        }
+    }
+    json_append_raw(w->out, "{\"$numberDouble\":\"");
+    json_append_raw(w->out, buf);
+    json_append_raw(w->out, "\"}");
+}
+
+/*
+ * Lua numbers, int32 when the encoder would append them as such
+ */
+static void json_write_number(lua_State *L, JsonWriter *w, int stackpos) {
+    long long intval;
+    if (lua_to_int64(L, stackpos, &intval)) {
+        json_write_int64(w, intval, intval >= INT_MIN && intval <= INT_MAX);
+        return;
+    }
+
+    double numval = lua_tonumber(L, stackpos);
+    if (numval == floor(numval) && fabs(numval) < INT_MAX)
+        json_write_int64(w, static_cast<long long>(numval), true);
+    else
+        json_write_double(w, numval);
+}
+
+/*
+ * relaxed dates between 1970 and 9999 are ISO-8601 strings, milliseconds
+ * otherwise
+ */
+static void json_write_date(JsonWriter *w, long long ms) {
+    static const long long max_iso_ms = 253402300799999LL; // 9999-12-31T23:59:59.999Z
+    char buf[64];
+
+    if (!w->canonical && ms >= 0 && ms <= max_iso_ms) {
+        time_t secs = static_cast<time_t>(ms / 1000);
+        struct tm tm;
+        gmtime_r(&secs, &tm);
+        snprintf(buf, sizeof(buf), "{\"$date\":\"%04d-%02d-%02dT%02d:%02d:%02d.%03dZ\"}",
+                 tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                 tm.tm_hour, tm.tm_min, tm.tm_sec, static_cast<int>(ms % 1000));
+    } else {
+        snprintf(buf, sizeof(buf), "{\"$date\":{\"$numberLong\":\"%lld\"}}", ms);
+    }
+    json_append_raw(w->out, buf);
+}
+
+static void json_write_oid(JsonWriter *w, const unsigned char *oid) {
+    char hex[24];
+    for (int i = 0; i < 12; ++i) {
+        hex[2*i] = hex_digits[oid[i] >> 4];
+        hex[2*i+1] = hex_digits[oid[i] & 15];
+    }
+    json_append_raw(w->out, "{\"$oid\":\"");
+    w->out->appendBuf(hex, sizeof(hex));
+    json_append_raw(w->out, "\"}");
+}
+
+static bool json_write_value(lua_State *L, JsonWriter *w, int stackpos);
+
+/*
+ * writes a field of an object, nothing when its value has no JSON form
+ */
+static bool json_write_field(lua_State *L, JsonWriter *w, const char *key, size_t len, int value, bool first) {
+    int mark = w->out->len();
+    if (!first)
+        w->out->appendChar(',');
+    json_newline(w);
+    json_append_string(w->out, key, len);
+    w->out->appendBuf(": ", w->indent ? 2 : 1);
+
+    if (json_write_value(L, w, value))
+        return true;
+    w->out->setlen(mark);
+    return false;
+}
+
+// a key of an object written by the sort option, number keys are named
+// as in lua_append_fields
+struct JsonKey {
+    std::string name;
+    bool is_number;
+    lua_Number number;
+
+    bool operator<(const JsonKey &other) const { return name < other.name; }
+};
+
+static void json_write_fields(lua_State *L, JsonWriter *w, int stackpos) {
+    char buf[KEY_SIZE];
+    bool first = true;
+
+    w->out->appendChar('{');
+    ++w->depth;
+
+    if (!w->sort) {
+        for (lua_pushnil(L); lua_next(L, stackpos); lua_pop(L, 1)) {
+            const char *key;
+            size_t len;
+            if (lua_type(L, -2) == LUA_TNUMBER) {
+                len = snprintf(buf, sizeof(buf), "%g", lua_tonumber(L, -2));
+                key = buf;
+            } else if (lua_type(L, -2) == LUA_TSTRING) {
+                key = lua_tolstring(L, -2, &len);
+            } else {
+                continue;
+            }
+            if (json_write_field(L, w, key, len, lua_gettop(L), first))
+                first = false;
+        }
+    } else {
+        std::vector<JsonKey> keys;
+        for (lua_pushnil(L); lua_next(L, stackpos); lua_pop(L, 1)) {
+            JsonKey key;
+            key.is_number = lua_type(L, -2) == LUA_TNUMBER;
+            key.number = 0;
+            if (key.is_number) {
+                key.number = lua_tonumber(L, -2);
+                snprintf(buf, sizeof(buf), "%g", key.number);
+                key.name = buf;
+            } else if (lua_type(L, -2) == LUA_TSTRING) {
+                size_t len;
+                const char *name = lua_tolstring(L, -2, &len);
+                key.name.assign(name, len);
+            } else {
+                continue;
+            }
+            keys.push_back(key);
+        }
+        std::sort(keys.begin(), keys.end());
+
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (keys[i].is_number)
+                lua_pushnumber(L, keys[i].number);
+            else
+                lua_pushlstring(L, keys[i].name.data(), keys[i].name.size());
+            lua_rawget(L, stackpos);
+            if (json_write_field(L, w, keys[i].name.data(), keys[i].name.size(), lua_gettop(L), first))
+                first = false;
+            lua_pop(L, 1);
+        }
+    }
+
+    --w->depth;
+    if (!first)
+        json_newline(w);
+    w->out->appendChar('}');
+}
+
+/*
+ * an array or an object, chosen as lua_append_table does. Values with no
+ * JSON form are written as null in arrays so the positions are kept.
+ */
+static bool json_write_table(lua_State *L, JsonWriter *w, int stackpos, int bsontype) {
+    const void *table = lua_topointer(L, stackpos);
+    if (w->ancestry.contains(table)) // do nothing for a cycle
+        return false;
+    w->ancestry.push(table);
+    lua_checkstack(L, 4);
+
+    int len = lua_rawlen(L, stackpos);
+    bool dense = bsontype == mongo::Array ||
+        (bsontype != mongo::Object && is_sequence(L, stackpos, len));
+
+    if (dense) {
+        int start = w->out->len();
+        w->out->appendChar('[');
+        ++w->depth;
+        int i;
+        for (i = 1; i <= len; ++i) {
+            lua_rawgeti(L, stackpos, i);
+            if (lua_isnil(L, -1) && bsontype != mongo::Array) {
+                lua_pop(L, 1);
+                break;
+            }
+            if (i > 1)
+                w->out->appendChar(',');
+            json_newline(w);
+            if (!json_write_value(L, w, lua_gettop(L)))
+                json_append_raw(w->out, "null");
+            lua_pop(L, 1);
+        }
+        --w->depth;
+
+        if (i <= len) {
+            // a hole below the border, write an object instead
+            w->out->setlen(start);
+            dense = false;
+        } else {
+            if (len)
+                json_newline(w);
+            w->out->appendChar(']');
+        }
+    }
+
+    if (!dense)
+        json_write_fields(L, w, stackpos);
+
+    w->ancestry.pop();
+    return true;
+}
+
+/*
+ * a table with a bsontype metatable, value is the stack index of its
+ * first element
+ */
+static bool json_write_wrapper(lua_State *L, JsonWriter *w, int bsontype, int table, int value) {
+    BufBuilder *out = w->out;
+    size_t len;
+
+    switch (bsontype) {
+    case mongo::Date:
+        json_write_date(w, static_cast<long long>(lua_tonumber(L, value)));
+        return true;
+    case mongo::Timestamp:
+        // the encoder leaves it to the server to fill in
+        json_append_raw(out, "{\"$timestamp\":{\"t\":0,\"i\":0}}");
+        return true;
+    case mongo::RegEx: {
+        lua_rawgeti(L, table, 2);
+        size_t options_len;
+        const char *regex = lua_tolstring(L, value, &len);
+        const char *options = lua_tolstring(L, -1, &options_len);
+        if (regex && options) {
+            json_append_raw(out, "{\"$regularExpression\":{\"pattern\":");
+            json_append_string(out, regex, len);
+            json_append_raw(out, ",\"options\":");
+            json_append_string(out, options, options_len);
+            json_append_raw(out, "}}");
+        }
+        lua_pop(L, 1);
+        return regex && options;
+    }
+    case mongo::NumberInt:
+        json_write_int64(w, static_cast<int32_t>(lua_tointeger(L, value)), true);
+        return true;
+    case mongo::NumberLong: {
+        long long v;
+        if (!lua_to_int64(L, value, &v)) {
+            if (lua_type(L, value) == LUA_TSTRING)
+                v = strtoll(lua_tostring(L, value), NULL, 10);
+            else
+                v = static_cast<long long>(lua_tonumber(L, value));
+        }
+        json_write_int64(w, v, false);
+        return true;
+    }
+    case mongo::Symbol: {
+        const char *symbol = lua_tolstring(L, value, &len);
+        if (!symbol)
+            return false;
+        json_append_raw(out, "{\"$symbol\":");
+        json_append_string(out, symbol, len);
+        out->appendChar('}');
+        return true;
+    }
+    case mongo::BinData: {
+        const char *data = lua_tolstring(L, value, &len);
+        if (!data)
+            return false;
+        json_append_raw(out, "{\"$binary\":{\"base64\":");
+        json_append_base64(out, reinterpret_cast<const unsigned char *>(data), len);
+        json_append_raw(out, ",\"subType\":\"00\"}}");
+        return true;
+    }
+    case mongo::jstOID: {
+        const char *hex = lua_tolstring(L, value, &len);
+        if (!hex)
+            return false;
+        json_append_raw(out, "{\"$oid\":");
+        json_append_string(out, hex, len);
+        out->appendChar('}');
+        return true;
+    }
+    case mongo::jstNULL:
+        json_append_raw(out, "null");
+        return true;
+    }
+    return false;
+}
+
+static bool json_write_value(lua_State *L, JsonWriter *w, int stackpos) {
+    long long intval;
+
+    switch (lua_type(L, stackpos)) {
+    case LUA_TNIL:
+        json_append_raw(w->out, "null");
+        return true;
+    case LUA_TBOOLEAN:
+        json_append_raw(w->out, lua_toboolean(L, stackpos) ? "true" : "false");
+        return true;
+    case LUA_TNUMBER:
+        json_write_number(L, w, stackpos);
+        return true;
+    case LUA_TSTRING: {
+        size_t len;
+        const char *str = lua_tolstring(L, stackpos, &len);
+        json_append_string(w->out, str, len);
+        return true;
+    }
+    case LUA_TUSERDATA: {
+        const unsigned char *oid = objectid_testudata(L, stackpos);
+        if (oid) {
+            json_write_oid(w, oid);
+            return true;
+        }
+        if (date_testudata(L, stackpos, &intval)) {
+            json_write_date(w, intval);
+            return true;
+        }
+        return false;
+    }
+    case LUA_TTABLE: {
+        lua_checkstack(L, 3);
+        if (!luaL_getmetafield(L, stackpos, "__bsontype"))
+            return json_write_table(L, w, stackpos, mongo::EOO);
+
+        int bsontype = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        if (bsontype == mongo::Array || bsontype == mongo::Object)
+            return json_write_table(L, w, stackpos, bsontype);
+
+        lua_rawgeti(L, stackpos, 1);
+        bool written = json_write_wrapper(L, w, bsontype, stackpos, lua_gettop(L));
+        lua_pop(L, 1);
+        return written;
+    }
+    }
+
+    if (lua_to_int64(L, stackpos, &intval)) {
+        // LuaJIT int64_t cdata
+        json_write_int64(w, intval, false);
+        return true;
+    }
+    return false;
+}
+
 void bson_to_lua(lua_State *L, const BSONObj &obj) {
     if (obj.isEmpty()) {
         lua_pushnil(L);
@@ -265,30 +1289,215 @@ void bson_to_lua(lua_State *L, const BSONObj &obj) {
     }
 }
 
+/*
+ * like bson_to_lua, pushing the field names from the table at stack index
+ * keys, which keeps them from one document to the next. Documents of the
+ * same shape find all their keys there.
+ */
+void bson_to_lua_cached(lua_State *L, const BSONObj &obj, int keys) {
+    if (obj.isEmpty()) {
+        lua_pushnil(L);
+    } else if (!raw_decoder_enabled(L)) {
+        iterator_to_table(L, obj);
+    } else {
+        if (keys < 0) keys = lua_gettop(L) + keys + 1;
+        KeyCache cache = { keys, 1 };
+        raw_push_document(L, obj.objdata(), false, &cache);
+    }
+}
+
+/*
+ * decodes obj into the existing table at stack index table instead of a new
+ * one, see raw_fill_document. keys is the stack index of a key cache as in
+ * bson_to_lua_cached, or 0. Always done by the raw decoder.
+ */
+void bson_fill_table(lua_State *L, const BSONObj &obj, int table, int keys) {
+    // pseudo-indices, such as the upvalue of cursor:results(), are left as is
+    if (table < 0 && table > LUA_REGISTRYINDEX) table = lua_gettop(L) + table + 1;
+    if (keys < 0) keys = lua_gettop(L) + keys + 1;
+
+    KeyCache cache = { keys, 1 };
+    raw_fill_document(L, obj.objdata(), false, table, keys ? &cache : NULL);
+}
+
+/*
+ * pushes the JSON text of the table at stackpos, an object unless marked
+ * with mongo.Array. indent is the number of spaces per level of nesting,
+ * 0 for a single line; sort writes the fields of objects sorted by name.
+ */
+void lua_to_json(lua_State *L, int stackpos, bool canonical, int indent, bool sort) {
+    if (stackpos < 0) stackpos = lua_gettop(L) + stackpos + 1;
+    BufBuilder *out = encode_arena(L);
+    out->reset();
+
+    int bsontype = mongo::Object;
+    if (luaL_getmetafield(L, stackpos, "__bsontype")) {
+        if (lua_tointeger(L, -1) == mongo::Array)
+            bsontype = mongo::Array;
+        lua_pop(L, 1);
+    }
+
+    JsonWriter w(out, canonical, indent, sort);
+    json_write_table(L, &w, stackpos, bsontype);
+
+    lua_pushlstring(L, out->buf(), out->len());
+    out->reset(ENCODE_ARENA_KEEP);
+}
+
 // stackpos must be relative to the bottom, i.e., not negative
 void lua_to_bson(lua_State *L, int stackpos, BSONObj &obj) {
-    BSONObjBuilder builder;
+    BufBuilder *arena = encode_arena(L);
+    arena->reset();
 
-    lua_newtable(L);
-    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    EncodeAncestry ancestry;
+    ancestry.push(lua_topointer(L, stackpos));
 
-    for (lua_pushnil(L); lua_next(L, stackpos); lua_pop(L, 1)) {
-        switch (lua_type(L, -2)) { // key type
-            case LUA_TNUMBER: {
-                std::ostringstream ss;
-                ss << lua_tonumber(L, -2);
-                lua_append_bson(L, ss.str().c_str(), -1, &builder, ref);
-                break;
-            }
-            case LUA_TSTRING: {
-                lua_append_bson(L, lua_tostring(L, -2), -1, &builder, ref);
-                break;
-            }
+    BSONObjBuilder builder(*arena);
+    lua_append_fields(L, stackpos, &builder, &ancestry);
+
+    // the only allocation of the result, sized to the document
+    obj = builder.done().copy();
+    arena->reset(ENCODE_ARENA_KEEP);
+}
+
+/*
+ * a Lua string holds raw BSON when it starts with its own length as a
+ * little endian int32 and ends with the document terminator
+ */
+static bool is_raw_bson(const char *data, size_t len) {
+    if (len < 5 || data[len-1] != '\0') return false;
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+    size_t objsize = p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+    return objsize == len;
+}
+
+static const int RAW_BSON_MAX_DEPTH = 100;
+
+/*
+ * walks the elements of the document of len bytes at data without reading
+ * past its end, returns false when a size, a terminator or a type is out of
+ * place, so that raw BSON strings can be read and sent without a copy
+ */
+static bool raw_bson_valid(const char *data, size_t len, int depth) {
+    if (len < 5 || depth > RAW_BSON_MAX_DEPTH || data[len-1] != '\0' ||
+        static_cast<size_t>(read_int32(data)) != len)
+        return false;
+
+    const char *p = data + 4;
+    const char *end = data + len - 1;
+    while (p < end) {
+        int type = static_cast<signed char>(*p++);
+        const char *key_end = static_cast<const char *>(memchr(p, '\0', end - p));
+        if (!key_end)
+            return false;
+        p = key_end + 1;
+
+        size_t left = end - p;
+        size_t size;
+        int n = left >= 4 ? read_int32(p) : -1;
+        switch (type) {
+        case mongo::Undefined:
+        case mongo::jstNULL:
+        case mongo::MinKey:
+        case mongo::MaxKey:
+            size = 0;
+            break;
+        case mongo::Bool:
+            size = 1;
+            break;
+        case mongo::NumberInt:
+            size = 4;
+            break;
+        case mongo::NumberDouble:
+        case mongo::NumberLong:
+        case mongo::Date:
+        case mongo::Timestamp:
+            size = 8;
+            break;
+        case mongo::jstOID:
+            size = 12;
+            break;
+        case mongo::String:
+        case mongo::Symbol:
+        case mongo::Code:
+        case mongo::DBRef:
+            if (n < 1 || static_cast<size_t>(n) > left - 4 || p[4 + n - 1] != '\0')
+                return false;
+            size = 4 + n + (type == mongo::DBRef ? 12 : 0);
+            break;
+        case mongo::Object:
+        case mongo::Array:
+            if (n < 5 || static_cast<size_t>(n) > left || !raw_bson_valid(p, n, depth + 1))
+                return false;
+            size = n;
+            break;
+        case mongo::BinData:
+            if (n < 0 || static_cast<size_t>(n) > left - 4)
+                return false;
+            size = 5 + n;
+            break;
+        case mongo::RegEx: {
+            const char *pattern_end = static_cast<const char *>(memchr(p, '\0', left));
+            if (!pattern_end || !memchr(pattern_end + 1, '\0', end - pattern_end - 1))
+                return false;
+            size = strlen(pattern_end + 1) + 1 + (pattern_end + 1 - p);
+            break;
+        }
+        case mongo::CodeWScope: {
+            if (n < 14 || static_cast<size_t>(n) > left)
+                return false;
+            int code = read_int32(p + 4);
+            if (code < 1 || code > n - 13 || p[8 + code - 1] != '\0' ||
+                !raw_bson_valid(p + 8 + code, n - 8 - code, depth + 1))
+                return false;
+            size = n;
+            break;
+        }
+        default:
+            return false;
         }
+
+        if (size > left)
+            return false;
+        p += size;
+    }
+
+    return p == end;
+}
+
+// converts a mongo.BSON, a raw BSON string, a JSON string or a Lua table
+// into obj, returns false for any other type; BSON input is not copied, obj
+// is only valid while the Lua value at stackpos is alive
+bool lua_arg_to_bson(lua_State *L, int stackpos, BSONObj &obj) {
+    if (stackpos < 0) stackpos = lua_gettop(L) + stackpos + 1;
+
+    switch (lua_type(L, stackpos)) {
+    case LUA_TSTRING: {
+        size_t len;
+        const char *data = lua_tolstring(L, stackpos, &len);
+        if (is_raw_bson(data, len)) {
+            if (!raw_bson_valid(data, len, 0))
+                throw std::runtime_error("invalid BSON string");
+            obj = BSONObj(data);
+        }
+        else if (!json_to_bson(data, len, obj))
+            obj = fromjson(data);
+        return true;
+    }
+    case LUA_TTABLE:
+        lua_to_bson(L, stackpos, obj);
+        return true;
+    case LUA_TUSERDATA: {
+        const BSONObj *bson = bson_testudata(L, stackpos);
+        if (bson) {
+            obj = *bson;
+            return true;
+        }
+        break;
+    }
     }
-    luaL_unref(L, LUA_REGISTRYINDEX, ref);
 
-    obj = builder.obj();
+    return false;
 }
 
 const char *bson_name(int type) {
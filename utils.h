@@ -41,6 +41,9 @@ extern "C" {
 
 #if LUA_VERSION_NUM < 502
 #define lua_rawlen lua_objlen
+/* userdata environments play the role of Lua 5.2 uservalues */
+#define lua_setuservalue lua_setfenv
+#define lua_getuservalue lua_getfenv
 #endif
 };
 
@@ -105,6 +108,21 @@ LUALIB_API void luaL_setfuncs(lua_State *L, const luaL_Reg *l, int nup);
     lua_rawseti(L, -2, n); \
     n++;
 
+/*
+ * Latency statistics returned by mongo.stats(), left out of the build with
+ * -DLUAMONGO_NO_STATS. stats_setfuncs works as luaL_setfuncs, recording the
+ * wall time of every call of the registered methods
+ */
+#ifndef LUAMONGO_NO_STATS
+bool stats_is_enabled();
+void stats_record(const char *op, const char *ns, double elapsed, bool failed);
+void stats_setfuncs(lua_State *L, const luaL_Reg *l, const char *prefix, bool ns_arg);
+#define LUAMONGO_STATS_ENABLED stats_is_enabled()
+#else
+#define LUAMONGO_STATS_ENABLED false
+#define stats_record(op, ns, elapsed, failed) ((void)(elapsed))
+#define stats_setfuncs(L, l, prefix, ns_arg) luaL_setfuncs(L, l, 0)
+#endif
 
 #ifdef _WIN32
     #define LM_EXPORT __declspec(dllexport)
@@ -112,3 +130,13 @@ LUALIB_API void luaL_setfuncs(lua_State *L, const luaL_Reg *l, int nup);
     #define LM_EXPORT
 #endif
 
+
+/*
+ * Per-chunk compression of GridFS files, see mongo_gridfscodec.cpp. zstd is
+ * only available when built with -DLUAMONGO_ZSTD
+ */
+enum GridFSCodec {
+    GRIDFS_CODEC_NONE = 0,
+    GRIDFS_CODEC_ZLIB,
+    GRIDFS_CODEC_ZSTD
+};